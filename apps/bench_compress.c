@@ -0,0 +1,150 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Size of each sequential read, and of the small ones */
+#define SEQ_READ_SIZE (64 * 1024)
+#define SMALL_READ_SIZE 4096
+/* Size and number of random reads */
+#define RAND_READ_SIZE 4096
+#define RAND_READ_COUNT 2000
+/* Minimum duration of each measurement */
+#define MIN_SECONDS 0.5
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double mib(size_t bytes)
+{
+	return bytes / (1024.0 * 1024.0);
+}
+
+static void bench_file(const char *filename, int compressed, const char *data,
+		       size_t size)
+{
+	static char buf[SEQ_READ_SIZE];
+	double start, elapsed;
+	size_t total;
+	int fd, runs;
+
+	if (fs_create(filename))
+		die("Cannot create file");
+	fd = fs_open(filename);
+	if (fd < 0)
+		die("Cannot open file");
+	if (fs_set_compression(fd, compressed))
+		die("Cannot set compression");
+
+	start = now();
+	if ((size_t)fs_write(fd, (void *)data, size) != size)
+		die("Cannot write file, is the disk large enough?");
+	elapsed = now() - start;
+	printf("%-5s write:      %8.1f MiB/s\n", filename, mib(size) / elapsed);
+
+	/* Sequential reads of the whole file */
+	total = 0;
+	runs = 0;
+	start = now();
+	do {
+		int read;
+		fs_lseek(fd, 0);
+		while ((read = fs_read(fd, buf, sizeof(buf))) > 0)
+			total += read;
+		runs++;
+	} while ((elapsed = now() - start) < MIN_SECONDS);
+	printf("%-5s seq read:   %8.1f MiB/s (%d runs)\n", filename,
+		   mib(total) / elapsed, runs);
+
+	/* Sequential reads smaller than a cluster */
+	total = 0;
+	runs = 0;
+	start = now();
+	do {
+		int read;
+		fs_lseek(fd, 0);
+		while ((read = fs_read(fd, buf, SMALL_READ_SIZE)) > 0)
+			total += read;
+		runs++;
+	} while ((elapsed = now() - start) < MIN_SECONDS);
+	printf("%-5s small read: %8.1f MiB/s (%d runs)\n", filename,
+		   mib(total) / elapsed, runs);
+
+	/* Random reads, each one lands in a different cluster */
+	srand(1);
+	total = 0;
+	runs = 0;
+	start = now();
+	do {
+		for (int i = 0; i < RAND_READ_COUNT; i++) {
+			size_t offset = (size_t)rand() % size;
+			total += fs_pread(fd, buf, RAND_READ_SIZE, offset);
+		}
+		runs++;
+	} while ((elapsed = now() - start) < MIN_SECONDS);
+	printf("%-5s rand read:  %8.1f MiB/s, %.0f reads/s\n", filename,
+		   mib(total) / elapsed, runs * RAND_READ_COUNT / elapsed);
+
+	if (fs_close(fd))
+		die("Cannot close file");
+}
+
+int main(int argc, char *argv[])
+{
+	char *diskname, *filename, *data;
+	struct stat st;
+	int fd;
+
+	if (argc < 3)
+		die("Usage: <diskname> <host filename>");
+
+	diskname = argv[1];
+	filename = argv[2];
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+		die("Cannot open host file");
+	if (!st.st_size)
+		die("Empty host file");
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		die("Cannot map host file");
+
+	/* Start from a fresh, largest possible, file system */
+	if (fs_format(diskname, FS_DATA_BLK_MAX_COUNT, 0))
+		die("Cannot format diskname");
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	printf("Host file '%s': %.1f MiB\n", filename, mib(st.st_size));
+	bench_file("raw", 0, data, st.st_size);
+	fs_info();
+	bench_file("lz", 1, data, st.st_size);
+	fs_info();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	munmap(data, st.st_size);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,340 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Size of each read and write, and of the blocks they are aligned to */
+#define IO_SIZE 4096
+/* Number of blocks of each data file */
+#define FILE_BLOCKS 64
+/* Number of files all the threads share */
+#define SHARED_FILES 8
+/* Each thread keeps at most one file open, and owns two files */
+#define MAX_THREADS FS_OPEN_MAX_COUNT
+/* Width of the bars of the plot */
+#define PLOT_WIDTH 50
+
+/* Header of each block written, the rest of the block derives from it */
+struct block_header {
+	uint32_t file;
+	uint32_t block;
+	uint32_t seq;
+	uint32_t seed;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	/* Whether the threads work on the shared files, or on their own */
+	int shared;
+	unsigned int rand;
+	/* Sequence number of the last write to each block of the own file */
+	uint32_t seq[FILE_BLOCKS];
+	size_t ops;
+	size_t errors;
+	size_t corrupted;
+};
+
+static volatile int stopping;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fill @buf with the content of block @block of file @file, version @seq */
+static void block_fill(uint8_t *buf, uint32_t file, uint32_t block, uint32_t seq)
+{
+	struct block_header header = { file, block, seq, file * 2654435761U ^ block << 16 ^ seq };
+	uint32_t x = header.seed | 1;
+
+	memcpy(buf, &header, sizeof(header));
+	for (size_t i = sizeof(header); i < IO_SIZE; i += sizeof(x)) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		memcpy(buf + i, &x, sizeof(x));
+	}
+}
+
+/*
+ * Check that @buf holds an untorn version of block @block of file @file, and
+ * return its sequence number, -1 if it does not
+ */
+static int64_t block_check(const uint8_t *buf, uint32_t file, uint32_t block)
+{
+	static __thread uint8_t expected[IO_SIZE];
+	struct block_header header;
+
+	memcpy(&header, buf, sizeof(header));
+	if (header.file != file || header.block != block)
+		return -1;
+	block_fill(expected, file, block, header.seq);
+	if (memcmp(buf, expected, IO_SIZE))
+		return -1;
+	return header.seq;
+}
+
+static void file_name(char *name, uint32_t file)
+{
+	snprintf(name, FS_FILENAME_LEN, "f%u", file);
+}
+
+/* Create file @file with every block at version 0 */
+static void file_setup(uint32_t file)
+{
+	uint8_t buf[IO_SIZE];
+	char name[FS_FILENAME_LEN];
+	int fd;
+
+	file_name(name, file);
+	if (fs_create(name))
+		die("Cannot create file '%s'", name);
+	fd = fs_open(name);
+	if (fd < 0)
+		die("Cannot open file '%s'", name);
+	for (uint32_t block = 0; block < FILE_BLOCKS; block++) {
+		block_fill(buf, file, block, 0);
+		if (fs_write(fd, buf, IO_SIZE) != IO_SIZE)
+			die("Cannot write file '%s', is the disk large enough?", name);
+	}
+	fs_close(fd);
+}
+
+/* Perform one random operation */
+static void worker_op(struct worker *w)
+{
+	uint8_t buf[IO_SIZE];
+	char name[FS_FILENAME_LEN];
+	int op = rand_r(&w->rand) % 100;
+	uint32_t block = rand_r(&w->rand) % FILE_BLOCKS;
+	/* Shared files come first, then one file per thread */
+	uint32_t file = w->shared ? rand_r(&w->rand) % SHARED_FILES : SHARED_FILES + w->id;
+	int fd;
+
+	if (op >= 95) {
+		/* Create, write and delete a scratch file of the thread */
+		file_name(name, SHARED_FILES + MAX_THREADS + w->id);
+		block_fill(buf, 0, 0, 0);
+		if (fs_create(name)) {
+			w->errors++;
+			return;
+		}
+		fd = fs_open(name);
+		if (fd < 0 || fs_write(fd, buf, IO_SIZE) != IO_SIZE)
+			w->errors++;
+		if (fd >= 0)
+			fs_close(fd);
+		if (fs_delete(name))
+			w->errors++;
+		return;
+	}
+
+	file_name(name, file);
+	fd = fs_open(name);
+	if (fd < 0) {
+		w->errors++;
+		return;
+	}
+	if (op < 50) {
+		int64_t seq;
+
+		if (fs_pread(fd, buf, IO_SIZE, (size_t)block * IO_SIZE) != IO_SIZE) {
+			w->errors++;
+		} else if ((seq = block_check(buf, file, block)) < 0
+			   || (!w->shared && seq != w->seq[block])) {
+			w->corrupted++;
+		}
+	} else if (op < 85) {
+		uint32_t seq = w->shared ? (uint32_t)rand_r(&w->rand) : ++w->seq[block];
+
+		block_fill(buf, file, block, seq);
+		if (fs_pwrite(fd, buf, IO_SIZE, (size_t)block * IO_SIZE) != IO_SIZE)
+			w->errors++;
+	} else {
+		if (fs_stat(fd) != FILE_BLOCKS * IO_SIZE)
+			w->errors++;
+	}
+	fs_close(fd);
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+
+	while (!stopping) {
+		worker_op(w);
+		w->ops++;
+	}
+	return NULL;
+}
+
+/* Check every block of file @file, and its exact versions if @seq is not NULL */
+static size_t file_verify(uint32_t file, const uint32_t *seq)
+{
+	uint8_t buf[IO_SIZE];
+	char name[FS_FILENAME_LEN];
+	size_t corrupted = 0;
+	int fd;
+
+	file_name(name, file);
+	fd = fs_open(name);
+	if (fd < 0)
+		return FILE_BLOCKS;
+	for (uint32_t block = 0; block < FILE_BLOCKS; block++) {
+		int64_t found;
+
+		if (fs_read(fd, buf, IO_SIZE) != IO_SIZE)
+			found = -1;
+		else
+			found = block_check(buf, file, block);
+		if (found < 0 || (seq && found != seq[block]))
+			corrupted++;
+	}
+	fs_close(fd);
+	return corrupted;
+}
+
+/* Run @n threads for @seconds, and return the number of operations per second */
+static double run(int n, int shared, double seconds, size_t *failures)
+{
+	static struct worker workers[MAX_THREADS];
+	struct timespec ts = { (time_t)seconds, (seconds - (time_t)seconds) * 1e9 };
+	size_t ops = 0;
+	double start, elapsed;
+
+	stopping = 0;
+	start = now();
+	for (int i = 0; i < n; i++) {
+		struct worker *w = &workers[i];
+
+		/* The own files keep their content from one run to the next */
+		w->id = i;
+		w->shared = shared;
+		w->rand = i * 7919 + n;
+		w->ops = w->errors = w->corrupted = 0;
+		if (pthread_create(&w->thread, NULL, worker_thread, w))
+			die("Cannot start thread");
+	}
+	nanosleep(&ts, NULL);
+	stopping = 1;
+	for (int i = 0; i < n; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = now() - start;
+
+	for (int i = 0; i < n; i++) {
+		struct worker *w = &workers[i];
+
+		ops += w->ops;
+		*failures += w->errors + w->corrupted;
+		if (!shared)
+			*failures += file_verify(SHARED_FILES + i, w->seq);
+	}
+	if (shared)
+		for (uint32_t file = 0; file < SHARED_FILES; file++)
+			*failures += file_verify(file, NULL);
+	return ops / elapsed;
+}
+
+static void plot_bar(const char *label, double value, double max)
+{
+	int width = max > 0 ? value / max * PLOT_WIDTH + 0.5 : 0;
+
+	printf("  %-8s |", label);
+	for (int i = 0; i < width; i++)
+		putchar('#');
+	printf(" %.0f\n", value);
+}
+
+int main(int argc, char *argv[])
+{
+	double disjoint[MAX_THREADS + 1], shared[MAX_THREADS + 1];
+	int counts[MAX_THREADS + 1], runs = 0;
+	double seconds = 1, max = 0;
+	int max_threads, opt;
+	size_t failures = 0;
+	char *diskname;
+
+	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "j:s:")) != -1) {
+		switch (opt) {
+		case 'j':
+			max_threads = atoi(optarg);
+			break;
+		case 's':
+			seconds = atof(optarg);
+			break;
+		default:
+			die("Usage: [-j <max threads>] [-s <seconds per run>] <diskname>");
+		}
+	}
+	if (optind >= argc)
+		die("Usage: [-j <max threads>] [-s <seconds per run>] <diskname>");
+	diskname = argv[optind];
+	if (max_threads < 1)
+		max_threads = 1;
+	if (max_threads > MAX_THREADS)
+		max_threads = MAX_THREADS;
+	if (seconds <= 0)
+		die("Invalid duration");
+
+	/* Start from a fresh, largest possible, file system */
+	if (fs_format(diskname, FS_DATA_BLK_MAX_COUNT, 0))
+		die("Cannot format diskname");
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	for (uint32_t file = 0; file < SHARED_FILES + (uint32_t)max_threads; file++)
+		file_setup(file);
+
+	/* Powers of two, and the largest count */
+	printf("%8s %16s %16s\n", "threads", "disjoint ops/s", "shared ops/s");
+	for (int n = 1;; n *= 2) {
+		if (n > max_threads)
+			n = max_threads;
+		counts[runs] = n;
+		disjoint[runs] = run(n, 0, seconds, &failures);
+		shared[runs] = run(n, 1, seconds, &failures);
+		printf("%8d %16.0f %16.0f\n", n, disjoint[runs], shared[runs]);
+		if (disjoint[runs] > max)
+			max = disjoint[runs];
+		if (shared[runs] > max)
+			max = shared[runs];
+		runs++;
+		if (n == max_threads)
+			break;
+	}
+
+	printf("\nOperations per second:\n");
+	for (int i = 0; i < runs; i++) {
+		printf("%d thread%s\n", counts[i], counts[i] > 1 ? "s" : "");
+		plot_bar("disjoint", disjoint[i], max);
+		plot_bar("shared", shared[i], max);
+	}
+
+	if (fs_fsck(0))
+		failures++;
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (failures)
+		die("%zu failed operations or corrupted blocks", failures);
+	printf("\nData verified\n");
+	return 0;
+}
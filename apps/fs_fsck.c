@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define fs_fsck_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Exit codes, following e2fsck's */
+#define FSCK_EXIT_OK		0
+#define FSCK_EXIT_REPAIRED	1
+#define FSCK_EXIT_UNCORRECTED	4
+#define FSCK_EXIT_ERROR		8
+
+int main(int argc, char *argv[])
+{
+	char *diskname;
+	int repair = 0;
+	int opt, errors;
+
+	while ((opt = getopt(argc, argv, "r")) != -1) {
+		switch (opt) {
+		case 'r':
+			repair = 1;
+			break;
+		default:
+			fs_fsck_error("Usage: [-r] <diskname>");
+			return FSCK_EXIT_ERROR;
+		}
+	}
+	if (optind >= argc) {
+		fs_fsck_error("Usage: [-r] <diskname>");
+		return FSCK_EXIT_ERROR;
+	}
+	diskname = argv[optind];
+
+	if (fs_mount(diskname)) {
+		fs_fsck_error("Cannot mount diskname");
+		return FSCK_EXIT_ERROR;
+	}
+
+	errors = fs_fsck(repair);
+
+	/* Repairs are written back when unmounting */
+	if (fs_umount()) {
+		fs_fsck_error("Cannot unmount diskname");
+		return FSCK_EXIT_ERROR;
+	}
+	if (errors < 0) {
+		fs_fsck_error("Cannot check diskname");
+		return FSCK_EXIT_ERROR;
+	}
+
+	if (!errors) {
+		printf("%s: clean\n", diskname);
+		return FSCK_EXIT_OK;
+	}
+	printf("%s: %d inconsistencies %s\n", diskname, errors,
+		   repair ? "repaired" : "found");
+	return repair ? FSCK_EXIT_REPAIRED : FSCK_EXIT_UNCORRECTED;
+}
@@ -0,0 +1,87 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define fs_make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_make_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+void usage(void)
+{
+	die("Usage: [-r <reserved block count>] <diskname> <data block count>[K|M|G]");
+}
+
+/*
+ * Parse a data size: a plain number is a count of data blocks, while a number
+ * followed by a K, M or G suffix is a size in bytes rounded up to whole blocks
+ */
+size_t get_data_blk_count(const char *arg)
+{
+	char *end;
+	unsigned long long size = strtoull(arg, &end, 0);
+	unsigned long long unit;
+
+	switch (*end) {
+	case '\0':
+		return size;
+	case 'k': case 'K':
+		unit = 1ULL << 10;
+		break;
+	case 'm': case 'M':
+		unit = 1ULL << 20;
+		break;
+	case 'g': case 'G':
+		unit = 1ULL << 30;
+		break;
+	default:
+		usage();
+		return 0;
+	}
+	if (end[1] != '\0' || size > ULLONG_MAX / unit)
+		usage();
+
+	return (size * unit + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+int main(int argc, char *argv[])
+{
+	char *diskname;
+	size_t data_blk_count, reserved_blk_count = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:")) != -1) {
+		switch (opt) {
+		case 'r':
+			reserved_blk_count = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind < 2)
+		usage();
+
+	diskname = argv[optind];
+	data_blk_count = get_data_blk_count(argv[optind + 1]);
+
+	if (data_blk_count < 1 || data_blk_count > FS_DATA_BLK_MAX_COUNT)
+		die("data block count invalid, range is [1, %d]",
+			FS_DATA_BLK_MAX_COUNT);
+
+	if (fs_format(diskname, data_blk_count, reserved_blk_count))
+		die("Cannot create virtual disk");
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n", diskname,
+		   data_blk_count);
+
+	return 0;
+}
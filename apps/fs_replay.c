@@ -0,0 +1,335 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fs_trace.h>
+
+#define fs_replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_replay_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+static const char *op_names[FS_TRACE_OP_COUNT] = {
+	[FS_TRACE_MOUNT] = "mount",
+	[FS_TRACE_UMOUNT] = "umount",
+	[FS_TRACE_CREATE] = "create",
+	[FS_TRACE_DELETE] = "delete",
+	[FS_TRACE_CLONE] = "clone",
+	[FS_TRACE_OPEN] = "open",
+	[FS_TRACE_CLOSE] = "close",
+	[FS_TRACE_STAT] = "stat",
+	[FS_TRACE_LSEEK] = "lseek",
+	[FS_TRACE_SEEK] = "seek",
+	[FS_TRACE_SET_COMPRESSION] = "set_compression",
+	[FS_TRACE_SET_DEDUP] = "set_dedup",
+	[FS_TRACE_READ] = "read",
+	[FS_TRACE_WRITE] = "write",
+	[FS_TRACE_READV] = "readv",
+	[FS_TRACE_WRITEV] = "writev",
+	[FS_TRACE_PREAD] = "pread",
+	[FS_TRACE_PWRITE] = "pwrite",
+	[FS_TRACE_DEFRAG] = "defrag",
+	[FS_TRACE_FSCK] = "fsck",
+	[FS_TRACE_ADVISE] = "advise",
+	[FS_TRACE_SYNC] = "sync",
+	[FS_TRACE_COPY_RANGE] = "copy_range",
+	[FS_TRACE_TRIM] = "trim",
+};
+
+/* Latencies of the calls to one operation, in nanoseconds */
+struct op_stats {
+	uint64_t *latencies;
+	size_t count, cap;
+	size_t failed;
+	/* Bytes actually read or written */
+	uint64_t bytes;
+};
+
+static struct op_stats stats[FS_TRACE_OP_COUNT];
+
+/* Data written by the replay, the trace does not record the original data */
+static uint8_t *data;
+static size_t data_size;
+static struct iovec *iov;
+static int iov_size;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double mib(uint64_t bytes)
+{
+	return bytes / (1024.0 * 1024.0);
+}
+
+/* Make the data buffer at least @count bytes long */
+static void data_reserve(size_t count)
+{
+	if (count <= data_size)
+		return;
+	data = realloc(data, count);
+	if (!data)
+		die("Cannot allocate %zu bytes", count);
+	/* Not zeros, which sparse files and deduplication would not store */
+	for (size_t i = data_size; i < count; i++)
+		data[i] = i * 31 + 7;
+	data_size = count;
+}
+
+/* Split @count bytes of the data buffer evenly between @iovcnt buffers */
+static struct iovec *data_split(size_t count, int iovcnt)
+{
+	if (iovcnt > iov_size) {
+		iov = realloc(iov, iovcnt * sizeof(*iov));
+		if (!iov)
+			die("Cannot allocate %d buffers", iovcnt);
+		iov_size = iovcnt;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		size_t start = count * i / iovcnt;
+		iov[i].iov_base = data + start;
+		iov[i].iov_len = count * (i + 1) / iovcnt - start;
+	}
+	return iov;
+}
+
+static void stats_add(struct op_stats *s, uint64_t latency)
+{
+	if (s->count == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 1024;
+		s->latencies = realloc(s->latencies, s->cap * sizeof(*s->latencies));
+		if (!s->latencies)
+			die("Cannot allocate latencies");
+	}
+	s->latencies[s->count++] = latency;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Latency below which @percent % of the sorted latencies fall, in us */
+static double percentile(const struct op_stats *s, double percent)
+{
+	size_t i = (s->count - 1) * percent / 100;
+
+	return s->latencies[i] / 1000.0;
+}
+
+/* Perform the call of @record, the first one with a format of @diskname */
+static int64_t replay(const struct fs_trace_record *record, const char *name,
+		      const char *name2, const char *diskname, int *formatted)
+{
+	int fd = record->fd;
+
+	switch (record->op) {
+	case FS_TRACE_MOUNT:
+		/* Start from a fresh disk of the same size as the original */
+		if (!*formatted) {
+			if (fs_format(diskname, record->count, 0))
+				die("Cannot format diskname");
+			*formatted = 1;
+		}
+		return fs_mount(diskname);
+	case FS_TRACE_UMOUNT:
+		return fs_umount();
+	case FS_TRACE_CREATE:
+		return fs_create(name);
+	case FS_TRACE_DELETE:
+		return fs_delete(name);
+	case FS_TRACE_CLONE:
+		return fs_clone(name, name2);
+	case FS_TRACE_OPEN:
+		return fs_open_flags(name, record->arg);
+	case FS_TRACE_CLOSE:
+		return fs_close(fd);
+	case FS_TRACE_STAT:
+		return fs_stat(fd);
+	case FS_TRACE_LSEEK:
+		return fs_lseek(fd, record->offset);
+	case FS_TRACE_SEEK:
+		return fs_seek(fd, record->offset, record->arg);
+	case FS_TRACE_SET_COMPRESSION:
+		return fs_set_compression(fd, record->arg);
+	case FS_TRACE_SET_DEDUP:
+		return fs_set_dedup(fd, record->arg);
+	case FS_TRACE_READ:
+		return fs_read(fd, data, record->count);
+	case FS_TRACE_WRITE:
+		return fs_write(fd, data, record->count);
+	case FS_TRACE_READV:
+		return fs_readv(fd, data_split(record->count, record->iovcnt),
+				record->iovcnt);
+	case FS_TRACE_WRITEV:
+		return fs_writev(fd, data_split(record->count, record->iovcnt),
+				 record->iovcnt);
+	case FS_TRACE_PREAD:
+		return fs_pread(fd, data, record->count, record->offset);
+	case FS_TRACE_PWRITE:
+		return fs_pwrite(fd, data, record->count, record->offset);
+	case FS_TRACE_DEFRAG:
+		return fs_defrag(record->offset);
+	case FS_TRACE_FSCK:
+		return fs_fsck(record->arg);
+	case FS_TRACE_ADVISE:
+		return fs_advise(fd, record->offset, record->count, record->arg);
+	case FS_TRACE_SYNC:
+		return fs_sync();
+	case FS_TRACE_COPY_RANGE:
+		return fs_copy_range(fd, record->offset, record->fd2, record->offset2,
+				     record->count);
+	case FS_TRACE_TRIM:
+		return fs_trim();
+	}
+	return -1;
+}
+
+static int is_io(uint8_t op)
+{
+	return op >= FS_TRACE_READ && op <= FS_TRACE_PWRITE;
+}
+
+static int is_write(uint8_t op)
+{
+	return op == FS_TRACE_WRITE || op == FS_TRACE_WRITEV || op == FS_TRACE_PWRITE;
+}
+
+static void report(uint64_t elapsed)
+{
+	size_t calls = 0, failed = 0;
+	uint64_t read = 0, written = 0;
+	double seconds = elapsed / 1e9;
+
+	for (int op = 0; op < FS_TRACE_OP_COUNT; op++) {
+		calls += stats[op].count;
+		failed += stats[op].failed;
+		if (is_write(op))
+			written += stats[op].bytes;
+		else
+			read += stats[op].bytes;
+	}
+	printf("Replayed %zu calls in %.3f s (%.0f calls/s), %zu failed\n",
+	       calls, seconds, calls / seconds, failed);
+	printf("Read:    %10.1f MiB, %8.1f MiB/s\n", mib(read), mib(read) / seconds);
+	printf("Written: %10.1f MiB, %8.1f MiB/s\n", mib(written), mib(written) / seconds);
+
+	printf("\n%-16s %8s %8s %10s %10s %10s %10s\n", "call", "count", "failed",
+	       "p50 us", "p90 us", "p99 us", "max us");
+	for (int op = 0; op < FS_TRACE_OP_COUNT; op++) {
+		struct op_stats *s = &stats[op];
+
+		if (!s->count)
+			continue;
+		qsort(s->latencies, s->count, sizeof(*s->latencies), cmp_u64);
+		printf("%-16s %8zu %8zu %10.1f %10.1f %10.1f %10.1f\n", op_names[op],
+		       s->count, s->failed, percentile(s, 50), percentile(s, 90),
+		       percentile(s, 99), percentile(s, 100));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char *tracename, *diskname;
+	struct fs_trace_header header;
+	struct fs_trace_record record;
+	char name[FS_FILENAME_LEN + 1], name2[FS_FILENAME_LEN + 1];
+	uint64_t start, end = 0;
+	int timed = 0, formatted = 0, mounted = 0;
+	FILE *trace;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t")) != -1) {
+		switch (opt) {
+		case 't':
+			timed = 1;
+			break;
+		default:
+			die("Usage: [-t] <trace file> <diskname>");
+		}
+	}
+	if (optind + 2 > argc)
+		die("Usage: [-t] <trace file> <diskname>");
+	tracename = argv[optind];
+	diskname = argv[optind + 1];
+
+	trace = fopen(tracename, "r");
+	if (!trace)
+		die("Cannot open trace '%s'", tracename);
+	if (fread(&header, sizeof(header), 1, trace) != 1
+	    || header.magic != FS_TRACE_MAGIC)
+		die("Not a trace: '%s'", tracename);
+	if (header.version != FS_TRACE_VERSION)
+		die("Unsupported trace version %u", header.version);
+
+	/* At full speed by default, or with -t at the pace of the original */
+	start = now_ns();
+	while (fread(&record, sizeof(record), 1, trace) == 1) {
+		uint64_t call_start;
+		int64_t ret;
+
+		if (fread(name, 1, record.name_len, trace) != record.name_len
+		    || fread(name2, 1, record.name2_len, trace) != record.name2_len)
+			die("Truncated trace");
+		name[record.name_len] = '\0';
+		name2[record.name2_len] = '\0';
+		if (record.op >= FS_TRACE_OP_COUNT)
+			die("Unknown call %u in trace", record.op);
+		if (!formatted && record.op != FS_TRACE_MOUNT)
+			die("Trace does not start with a mount");
+		if (is_io(record.op))
+			data_reserve(record.count);
+
+		if (timed) {
+			uint64_t due = start + record.time;
+			struct timespec ts = {
+				.tv_sec = due / 1000000000ULL,
+				.tv_nsec = due % 1000000000ULL,
+			};
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+
+		call_start = now_ns();
+		ret = replay(&record, name, name2, diskname, &formatted);
+		end = now_ns();
+
+		stats_add(&stats[record.op], end - call_start);
+		if (ret < 0)
+			stats[record.op].failed++;
+		else if (is_io(record.op))
+			stats[record.op].bytes += ret;
+		if (record.op == FS_TRACE_MOUNT && !ret)
+			mounted = 1;
+		if (record.op == FS_TRACE_UMOUNT && !ret)
+			mounted = 0;
+	}
+	if (!formatted)
+		die("Empty trace");
+	fclose(trace);
+
+	report(end - start);
+
+	/* The trace may end before the files are closed and the disk unmounted */
+	if (mounted) {
+		for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+			fs_close(fd);
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+
+	return 0;
+}
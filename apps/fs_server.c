@@ -0,0 +1,314 @@
+#define _GNU_SOURCE /* for accept4() and file seals */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fs_proto.h>
+
+#define fs_server_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_server_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Held while serving a request, so that shutting down waits for it */
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set by SIGINT and SIGTERM */
+static volatile sig_atomic_t stopping;
+
+struct client {
+	int sock;
+	/* Shared memory of the client, NULL until its FS_PROTO_HELLO */
+	uint8_t *shm;
+	/* Whether each file descriptor was opened by this client */
+	uint8_t fds[FS_OPEN_MAX_COUNT];
+};
+
+static void stop(int signum)
+{
+	(void)signum;
+	stopping = 1;
+}
+
+/*
+ * Receive the next request of @client, and the shared memory file descriptor
+ * that comes with FS_PROTO_HELLO, -1 if none. Return 0 when the client is gone.
+ */
+static int recv_request(struct client *client, struct fs_proto_request *req,
+			int *memfd)
+{
+	struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+	union {
+		struct cmsghdr header;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	ssize_t len;
+
+	*memfd = -1;
+	len = recvmsg(client->sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	if (len != sizeof(*req))
+		return 0;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(memfd, CMSG_DATA(cmsg), sizeof(int));
+
+	/* Never trust the client to terminate its strings */
+	req->filename[FS_FILENAME_LEN - 1] = '\0';
+	req->filename2[FS_FILENAME_LEN - 1] = '\0';
+	return 1;
+}
+
+static int64_t serve_hello(struct client *client, int memfd)
+{
+	struct stat st;
+	int seals;
+
+	if (client->shm || memfd == -1)
+		return -1;
+	/*
+	 * Accessing past the end of a smaller memfd would kill the server, so
+	 * the client must not be able to shrink it after the check either
+	 */
+	seals = fcntl(memfd, F_GET_SEALS);
+	if (seals == -1 || (~seals & (F_SEAL_SHRINK | F_SEAL_GROW)))
+		return -1;
+	if (fstat(memfd, &st) || st.st_size < FS_PROTO_SHM_SIZE)
+		return -1;
+	client->shm = mmap(NULL, FS_PROTO_SHM_SIZE, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, memfd, 0);
+	if (client->shm == MAP_FAILED) {
+		client->shm = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Copy the listing of the root directory to the shared memory of @client */
+static int64_t serve_opendir(struct client *client, int flags)
+{
+	struct fs_dirent *dirents = (struct fs_dirent *)client->shm;
+	struct fs_dir *dir;
+	int64_t count = 0;
+
+	dir = fs_opendir(flags);
+	if (!dir)
+		return -1;
+	while (fs_readdir(dir, &dirents[count]) == 1)
+		count++;
+	fs_closedir(dir);
+	return count;
+}
+
+/* Perform @req for @client, with fs_lock held */
+static int64_t serve(struct client *client, struct fs_proto_request *req)
+{
+	int fd = req->fd;
+	int64_t ret;
+
+	switch (req->op) {
+	case FS_PROTO_CREATE:
+		return fs_create(req->filename);
+	case FS_PROTO_DELETE:
+		return fs_delete(req->filename);
+	case FS_PROTO_CLONE:
+		return fs_clone(req->filename, req->filename2);
+	case FS_PROTO_OPEN:
+		ret = fs_open_flags(req->filename, req->enable);
+		if (ret >= 0)
+			client->fds[ret] = 1;
+		return ret;
+	case FS_PROTO_OPENDIR:
+		return serve_opendir(client, req->enable);
+	case FS_PROTO_SYNC:
+		return fs_sync();
+	}
+
+	/* Clients can only use the file descriptors they opened */
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || !client->fds[fd])
+		return -1;
+	if (req->count > FS_PROTO_SHM_SIZE)
+		return -1;
+
+	switch (req->op) {
+	case FS_PROTO_CLOSE:
+		ret = fs_close(fd);
+		if (!ret)
+			client->fds[fd] = 0;
+		return ret;
+	case FS_PROTO_STAT:
+		return fs_stat(fd);
+	case FS_PROTO_LSEEK:
+		return fs_lseek(fd, req->offset);
+	case FS_PROTO_SEEK:
+		return fs_seek(fd, req->offset, req->enable);
+	case FS_PROTO_ADVISE:
+		return fs_advise(fd, req->offset, req->len, req->enable);
+	case FS_PROTO_SET_COMPRESSION:
+		return fs_set_compression(fd, req->enable);
+	case FS_PROTO_SET_DEDUP:
+		return fs_set_dedup(fd, req->enable);
+	case FS_PROTO_READ:
+		return fs_read(fd, client->shm, req->count);
+	case FS_PROTO_WRITE:
+		return fs_write(fd, client->shm, req->count);
+	case FS_PROTO_PREAD:
+		return fs_pread(fd, client->shm, req->count, req->offset);
+	case FS_PROTO_PWRITE:
+		return fs_pwrite(fd, client->shm, req->count, req->offset);
+	case FS_PROTO_COPY_RANGE:
+		if (req->fd2 < 0 || req->fd2 >= FS_OPEN_MAX_COUNT || !client->fds[req->fd2])
+			return -1;
+		return fs_copy_range(fd, req->offset, req->fd2, req->offset2, req->len);
+	}
+	return -1;
+}
+
+static void *client_thread(void *arg)
+{
+	struct client *client = arg;
+	struct fs_proto_request req;
+	struct fs_proto_reply reply;
+	int memfd;
+
+	while (recv_request(client, &req, &memfd)) {
+		if (req.op == FS_PROTO_HELLO) {
+			reply.ret = serve_hello(client, memfd);
+		} else if (!client->shm) {
+			reply.ret = -1;
+		} else {
+			pthread_mutex_lock(&fs_lock);
+			reply.ret = serve(client, &req);
+			pthread_mutex_unlock(&fs_lock);
+		}
+		if (memfd != -1)
+			close(memfd);
+		if (send(client->sock, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply))
+			break;
+	}
+
+	/* Close the files the client left open */
+	pthread_mutex_lock(&fs_lock);
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+		if (client->fds[fd])
+			fs_close(fd);
+	pthread_mutex_unlock(&fs_lock);
+
+	if (client->shm)
+		munmap(client->shm, FS_PROTO_SHM_SIZE);
+	close(client->sock);
+	free(client);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct sigaction sa = { .sa_handler = stop };
+	char *diskname, *sockname;
+	pthread_attr_t attr;
+	int listener, opt, flags = 0;
+
+	while ((opt = getopt(argc, argv, "dHt")) != -1) {
+		switch (opt) {
+		case 'd':
+			flags |= FS_MOUNT_DIRECT;
+			break;
+		case 'H':
+			flags |= FS_MOUNT_HUGEPAGES;
+			break;
+		case 't':
+			flags |= FS_MOUNT_DISCARD;
+			break;
+		default:
+			die("Usage: [-d] [-H] [-t] <diskname> <socket path>");
+		}
+	}
+	if (optind + 2 > argc)
+		die("Usage: [-d] [-H] [-t] <diskname> <socket path>");
+
+	diskname = argv[optind];
+	sockname = argv[optind + 1];
+	if (strlen(sockname) >= sizeof(addr.sun_path))
+		die("Socket path too long");
+	strcpy(addr.sun_path, sockname);
+
+	/* Dedicated servers can bypass the host's page cache */
+	if (fs_mount_flags(diskname, flags))
+		die("Cannot mount diskname");
+
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0)
+		die("Cannot create socket");
+	/* Replace the socket a previous server left behind */
+	unlink(sockname);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)))
+		die("Cannot bind socket '%s'", sockname);
+	if (listen(listener, SOMAXCONN))
+		die("Cannot listen on socket");
+
+	/* No SA_RESTART, so that the signals interrupt accept() */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/* Each client is served by its own thread */
+	while (!stopping) {
+		pthread_t thread;
+		struct client *client;
+		int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+
+		if (sock < 0) {
+			if (errno != EINTR)
+				fs_server_error("Cannot accept client");
+			continue;
+		}
+		client = calloc(1, sizeof(*client));
+		if (!client) {
+			close(sock);
+			continue;
+		}
+		client->sock = sock;
+		if (pthread_create(&thread, &attr, client_thread, client)) {
+			fs_server_error("Cannot start client thread");
+			close(sock);
+			free(client);
+		}
+	}
+
+	close(listener);
+	unlink(sockname);
+
+	/* Stop serving requests and close the files of the remaining clients */
+	pthread_mutex_lock(&fs_lock);
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+		fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return 0;
+}
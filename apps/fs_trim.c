@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define fs_trim_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_trim_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+int main(int argc, char *argv[])
+{
+	char *diskname;
+	int trimmed;
+
+	if (argc < 2)
+		die("Usage: <diskname>");
+	diskname = argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* Like fstrim, for images that were not mounted with FS_MOUNT_DISCARD */
+	trimmed = fs_trim();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	if (trimmed < 0)
+		die("Cannot trim diskname");
+
+	printf("%s: %d free blocks (%.1f MiB) trimmed\n", diskname, trimmed,
+	       (double)trimmed * BLOCK_SIZE / (1024 * 1024));
+	return 0;
+}
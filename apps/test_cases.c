@@ -0,0 +1,629 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <disk.h>
+#include <fs.h>
+
+/*
+ * Regression cases of the features of the file system. Each case runs on a
+ * freshly formatted disk, checks what it reads back, and the disk must pass
+ * fs_fsck() once the case is done.
+ */
+
+#define test_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	test_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Fail the current case if @cond does not hold */
+#define check(cond)							\
+do {									\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n",	\
+			__func__, __LINE__, #cond);			\
+		return -1;						\
+	}								\
+} while (0)
+
+/* Number of data blocks of the disk of each case */
+#define CASE_BLOCKS 1024
+
+struct test_case {
+	const char *name;
+	int (*func)(const char *diskname);
+};
+
+/* Fill @buf with @len bytes of a pattern that depends on @seed and offsets */
+static void fill(uint8_t *buf, size_t len, size_t offset, unsigned int seed)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (uint8_t)((offset + i) * 31 + seed * 7 + (offset + i) / 251);
+}
+
+/* Whether @buf holds what fill() puts at @offset with @seed */
+static int filled(const uint8_t *buf, size_t len, size_t offset, unsigned int seed)
+{
+	uint8_t *expected = malloc(len);
+	int same;
+
+	if (!expected)
+		die("Cannot allocate memory");
+	fill(expected, len, offset, seed);
+	same = !memcmp(buf, expected, len);
+	free(expected);
+	return same;
+}
+
+/*
+ * Create file @filename and write @len bytes of the pattern of @seed to it,
+ * return its file descriptor
+ */
+static int file_make(const char *filename, size_t len, unsigned int seed)
+{
+	uint8_t *buf = malloc(len);
+	int fd;
+
+	if (!buf)
+		die("Cannot allocate memory");
+	fill(buf, len, 0, seed);
+	if (fs_create(filename) || (fd = fs_open(filename)) < 0
+	    || fs_write(fd, buf, len) != (int)len)
+		fd = -1;
+	free(buf);
+	return fd;
+}
+
+/* Whether @len bytes at @offset of @fd hold the pattern of @seed */
+static int file_holds(int fd, size_t len, size_t offset, unsigned int seed)
+{
+	uint8_t *buf = malloc(len);
+	int same;
+
+	if (!buf)
+		die("Cannot allocate memory");
+	same = fs_pread(fd, buf, len, offset) == (int)len
+		&& filled(buf, len, offset, seed);
+	free(buf);
+	return same;
+}
+
+/* Clones share their blocks until either one is written */
+static int case_clone(const char *diskname)
+{
+	uint8_t buf[100];
+	int src, dst;
+
+	(void)diskname;
+	src = file_make("src", 3 * BLOCK_SIZE + 500, 1);
+	check(src >= 0);
+	check(fs_close(src) == 0);
+	check(fs_clone("src", "dst") == 0);
+	check(fs_clone("src", "dst") == -1);
+
+	/* A write through the clone is not seen through the source */
+	dst = fs_open("dst");
+	src = fs_open("src");
+	check(dst >= 0 && src >= 0);
+	check(fs_stat(dst) == 3 * BLOCK_SIZE + 500);
+	fill(buf, sizeof(buf), BLOCK_SIZE + 10, 2);
+	check(fs_pwrite(dst, buf, sizeof(buf), BLOCK_SIZE + 10) == sizeof(buf));
+	check(file_holds(dst, 10, BLOCK_SIZE, 1));
+	check(file_holds(dst, sizeof(buf), BLOCK_SIZE + 10, 2));
+	check(file_holds(dst, 2 * BLOCK_SIZE, BLOCK_SIZE + 110, 1));
+	check(file_holds(src, 3 * BLOCK_SIZE + 500, 0, 1));
+
+	/* The clone keeps the shared blocks once the source is gone */
+	check(fs_close(src) == 0);
+	check(fs_delete("src") == 0);
+	check(file_holds(dst, BLOCK_SIZE + 10, 0, 1));
+	check(file_holds(dst, sizeof(buf), BLOCK_SIZE + 10, 2));
+	check(fs_close(dst) == 0);
+	return 0;
+}
+
+/* Compressed files read back what was appended, whatever the read sizes */
+static int case_compress(const char *diskname)
+{
+	size_t size = 3 * 8 * BLOCK_SIZE + 1234;
+	uint8_t *buf = malloc(size + 500);
+	int fd;
+
+	(void)diskname;
+	if (!buf)
+		die("Cannot allocate memory");
+	fill(buf, size + 500, 0, 3);
+	check(fs_create("log") == 0);
+	fd = fs_open("log");
+	check(fd >= 0);
+	check(fs_set_compression(fd, 1) == 0);
+	for (size_t done = 0; done < size; done += 1000) {
+		int len = size - done < 1000 ? size - done : 1000;
+		check(fs_write(fd, buf + done, len) == len);
+	}
+	check(fs_stat(fd) == (int)size);
+
+	/* Small reads within and across clusters */
+	for (size_t done = 0; done < size; done += 700)
+		check(file_holds(fd, size - done < 700 ? size - done : 700, done, 3));
+	check(file_holds(fd, 8 * BLOCK_SIZE + 200, 8 * BLOCK_SIZE - 100, 3));
+
+	/* Appending after a read of the last cluster shows the new data */
+	check(file_holds(fd, 100, size - 100, 3));
+	check(fs_write(fd, buf + size, 500) == 500);
+	check(file_holds(fd, 600, size - 100, 3));
+
+	/* Only the last cluster can be rewritten */
+	check(fs_pwrite(fd, buf, 100, 0) == -1);
+
+	/* A new file in the same directory entry is not read from the old one */
+	check(fs_close(fd) == 0);
+	check(fs_delete("log") == 0);
+	check(fs_create("log") == 0);
+	fd = fs_open("log");
+	check(fd >= 0);
+	check(fs_set_compression(fd, 1) == 0);
+	fill(buf, 5000, 0, 4);
+	check(fs_write(fd, buf, 5000) == 5000);
+	free(buf);
+	check(file_holds(fd, 5000, 0, 4));
+	check(fs_close(fd) == 0);
+	return 0;
+}
+
+/* Deduplicated files share identical blocks, each one keeps its content */
+static int case_dedup(const char *diskname)
+{
+	static uint8_t block[BLOCK_SIZE], other[BLOCK_SIZE];
+	int fd1, fd2, fd;
+
+	(void)diskname;
+	check(fs_create("d1") == 0 && fs_create("d2") == 0);
+	fd1 = fs_open("d1");
+	fd2 = fs_open("d2");
+	check(fd1 >= 0 && fd2 >= 0);
+	check(fs_set_dedup(fd1, 1) == 0 && fs_set_dedup(fd2, 1) == 0);
+	for (int i = 0; i < 4; i++) {
+		fill(block, BLOCK_SIZE, i * BLOCK_SIZE, 5);
+		check(fs_write(fd1, block, BLOCK_SIZE) == BLOCK_SIZE);
+		check(fs_write(fd2, block, BLOCK_SIZE) == BLOCK_SIZE);
+	}
+	/* Blocks of zeros are not stored, but read back */
+	memset(block, 0, BLOCK_SIZE);
+	check(fs_write(fd1, block, BLOCK_SIZE) == BLOCK_SIZE);
+	check(fs_pread(fd1, other, BLOCK_SIZE, 4 * BLOCK_SIZE) == BLOCK_SIZE);
+	check(!memcmp(block, other, BLOCK_SIZE));
+
+	/* Rewriting a shared block of one file leaves the other one alone */
+	fill(block, 100, BLOCK_SIZE, 6);
+	check(fs_pwrite(fd1, block, 100, BLOCK_SIZE) == 100);
+	check(file_holds(fd1, 100, BLOCK_SIZE, 6));
+	check(file_holds(fd2, 4 * BLOCK_SIZE, 0, 5));
+	check(fs_close(fd1) == 0);
+	check(fs_delete("d1") == 0);
+	check(file_holds(fd2, 4 * BLOCK_SIZE, 0, 5));
+	check(fs_close(fd2) == 0);
+
+	/* A block linked by more slots than a 16-bit count holds is kept */
+	if ((size_t)65537 * BLOCK_SIZE > INT_MAX)
+		return 0;
+	check(fs_create("many") == 0);
+	fd = fs_open("many");
+	check(fd >= 0);
+	check(fs_set_dedup(fd, 1) == 0);
+	fill(block, BLOCK_SIZE, 0, 7);
+	for (int i = 0; i < 65537; i++)
+		check(fs_write(fd, block, BLOCK_SIZE) == BLOCK_SIZE);
+	fill(other, BLOCK_SIZE, 0, 8);
+	check(fs_pwrite(fd, other, BLOCK_SIZE, 0) == BLOCK_SIZE);
+	check(file_holds(fd, BLOCK_SIZE, 0, 8));
+	check(fs_pread(fd, other, BLOCK_SIZE, 100 * BLOCK_SIZE) == BLOCK_SIZE);
+	check(!memcmp(block, other, BLOCK_SIZE));
+	check(fs_close(fd) == 0);
+	return 0;
+}
+
+/* Writes past the end of a file leave holes that read as zeros */
+static int case_sparse(const char *diskname)
+{
+	static uint8_t zeros[8 * BLOCK_SIZE], buf[8 * BLOCK_SIZE];
+	int fd;
+
+	(void)diskname;
+	fd = file_make("sparse", 2 * BLOCK_SIZE + 10, 9);
+	check(fd >= 0);
+	fill(buf, 100, 10 * BLOCK_SIZE + 5, 10);
+	check(fs_pwrite(fd, buf, 100, 10 * BLOCK_SIZE + 5) == 100);
+	check(fs_stat(fd) == 10 * BLOCK_SIZE + 105);
+
+	/* The content written before the hole is kept */
+	check(file_holds(fd, 2 * BLOCK_SIZE + 10, 0, 9));
+	check(fs_pread(fd, buf, 8 * BLOCK_SIZE, 2 * BLOCK_SIZE + 10) == 8 * BLOCK_SIZE);
+	check(!memcmp(buf, zeros, 8 * BLOCK_SIZE - 10));
+	check(file_holds(fd, 100, 10 * BLOCK_SIZE + 5, 10));
+	check(fs_seek(fd, 0, FS_SEEK_HOLE) == 3 * BLOCK_SIZE);
+	check(fs_seek(fd, 3 * BLOCK_SIZE, FS_SEEK_DATA) == 10 * BLOCK_SIZE);
+
+	/* Filling the hole */
+	fill(buf, BLOCK_SIZE, 5 * BLOCK_SIZE, 11);
+	check(fs_pwrite(fd, buf, BLOCK_SIZE, 5 * BLOCK_SIZE) == BLOCK_SIZE);
+	check(file_holds(fd, BLOCK_SIZE, 5 * BLOCK_SIZE, 11));
+	check(fs_seek(fd, 3 * BLOCK_SIZE, FS_SEEK_DATA) == 5 * BLOCK_SIZE);
+	check(fs_close(fd) == 0);
+	return 0;
+}
+
+/* Concurrent appenders, and the records each one appends */
+#define APPEND_THREADS 8
+#define APPEND_RECORDS 200
+#define APPEND_RECORD_SIZE 300
+
+struct appender {
+	pthread_t thread;
+	uint32_t id;
+	int ret;
+};
+
+static void *append_thread(void *arg)
+{
+	struct appender *a = arg;
+	uint8_t record[APPEND_RECORD_SIZE];
+	int fd = fs_open_flags("log", FS_OPEN_APPEND);
+
+	a->ret = fd < 0 ? -1 : 0;
+	for (uint32_t seq = 0; seq < APPEND_RECORDS && !a->ret; seq++) {
+		fill(record, sizeof(record), 0, a->id * APPEND_RECORDS + seq);
+		memcpy(record, &a->id, sizeof(a->id));
+		memcpy(record + sizeof(a->id), &seq, sizeof(seq));
+		if (fs_write(fd, record, sizeof(record)) != sizeof(record))
+			a->ret = -1;
+	}
+	if (fd >= 0 && fs_close(fd))
+		a->ret = -1;
+	return NULL;
+}
+
+/* Concurrent appends each land whole, in the order of each appender */
+static int case_append(const char *diskname)
+{
+	struct appender appenders[APPEND_THREADS];
+	uint32_t next[APPEND_THREADS] = { 0 };
+	uint8_t record[APPEND_RECORD_SIZE];
+	int fd;
+
+	(void)diskname;
+	check(fs_create("log") == 0);
+	for (uint32_t i = 0; i < APPEND_THREADS; i++) {
+		appenders[i].id = i;
+		if (pthread_create(&appenders[i].thread, NULL, append_thread, &appenders[i]))
+			die("Cannot start thread");
+	}
+	for (int i = 0; i < APPEND_THREADS; i++) {
+		pthread_join(appenders[i].thread, NULL);
+		check(appenders[i].ret == 0);
+	}
+
+	fd = fs_open("log");
+	check(fd >= 0);
+	check(fs_stat(fd) == APPEND_THREADS * APPEND_RECORDS * APPEND_RECORD_SIZE);
+	for (int i = 0; i < APPEND_THREADS * APPEND_RECORDS; i++) {
+		uint32_t id, seq;
+
+		check(fs_read(fd, record, sizeof(record)) == sizeof(record));
+		memcpy(&id, record, sizeof(id));
+		memcpy(&seq, record + sizeof(id), sizeof(seq));
+		check(id < APPEND_THREADS && seq == next[id]++);
+		check(filled(record + 2 * sizeof(uint32_t), sizeof(record) - 2 * sizeof(uint32_t),
+			     2 * sizeof(uint32_t), id * APPEND_RECORDS + seq));
+	}
+	check(fs_close(fd) == 0);
+	return 0;
+}
+
+/* Superblock of a disk, read from its image without mounting it */
+struct image_superblock {
+	uint64_t signature;
+	uint16_t total_blocks;
+	uint16_t rootdir_blk_index;
+	uint16_t datablk_start_index;
+	uint16_t datablk_amount;
+	uint8_t fat_amount;
+} __attribute__((packed));
+
+/* Read block @block of the image of @diskname into @buf */
+static int image_read(const char *diskname, size_t block, void *buf)
+{
+	FILE *image = fopen(diskname, "rb");
+	int ret;
+
+	if (!image)
+		return -1;
+	ret = fseek(image, block * BLOCK_SIZE, SEEK_SET)
+		|| fread(buf, BLOCK_SIZE, 1, image) != 1 ? -1 : 0;
+	fclose(image);
+	return ret;
+}
+
+/*
+ * Whether the unmounted image of @diskname has no data block in use, nor any
+ * data written to its data blocks
+ */
+static int image_unused(const char *diskname)
+{
+	static uint8_t buf[BLOCK_SIZE], zeros[BLOCK_SIZE];
+	struct image_superblock sb;
+	uint16_t *fat = (uint16_t *)buf;
+
+	if (image_read(diskname, 0, buf))
+		return 0;
+	memcpy(&sb, buf, sizeof(sb));
+	for (size_t i = 0; i < sb.datablk_amount; i++) {
+		if (i % (BLOCK_SIZE / 2) == 0 && image_read(diskname, 1 + i / (BLOCK_SIZE / 2), buf))
+			return 0;
+		/* The first entry is reserved */
+		if (i && fat[i % (BLOCK_SIZE / 2)])
+			return 0;
+	}
+	for (size_t i = 0; i < sb.datablk_amount; i++)
+		if (image_read(diskname, sb.datablk_start_index + i, buf)
+		    || memcmp(buf, zeros, BLOCK_SIZE))
+			return 0;
+	return 1;
+}
+
+/* Buffered writes read back the same before and after they get blocks */
+static int case_delalloc(const char *diskname)
+{
+	static uint8_t zeros[4 * BLOCK_SIZE], buf[4 * BLOCK_SIZE];
+	int fd;
+
+	/* A file deleted before its data is written back never gets blocks */
+	fd = file_make("gone", 8 * BLOCK_SIZE, 12);
+	check(fd >= 0);
+	check(file_holds(fd, 8 * BLOCK_SIZE, 0, 12));
+	check(fs_close(fd) == 0);
+	check(fs_delete("gone") == 0);
+	check(fs_umount() == 0);
+	check(image_unused(diskname));
+	check(fs_mount(diskname) == 0);
+
+	/* Writes past the end of the buffered data leave zeros behind */
+	fd = file_make("hole", 100, 13);
+	check(fd >= 0);
+	fill(buf, 100, 2000, 13);
+	check(fs_pwrite(fd, buf, 100, 2000) == 100);
+	fill(buf, 100, 3 * BLOCK_SIZE + 50, 13);
+	check(fs_pwrite(fd, buf, 100, 3 * BLOCK_SIZE + 50) == 100);
+	for (int synced = 0; synced < 2; synced++) {
+		check(file_holds(fd, 100, 0, 13));
+		check(fs_pread(fd, buf, 1900, 100) == 1900 && !memcmp(buf, zeros, 1900));
+		check(file_holds(fd, 100, 2000, 13));
+		check(fs_pread(fd, buf, 3 * BLOCK_SIZE - 2050, 2100) == 3 * BLOCK_SIZE - 2050);
+		check(!memcmp(buf, zeros, 3 * BLOCK_SIZE - 2050));
+		check(file_holds(fd, 100, 3 * BLOCK_SIZE + 50, 13));
+		check(fs_sync() == 0);
+	}
+	check(fs_close(fd) == 0);
+
+	/* Reads and writes across the end of the allocated blocks */
+	fd = file_make("edge", 2 * BLOCK_SIZE + 500, 14);
+	check(fd >= 0);
+	check(fs_sync() == 0);
+	fill(buf, 2 * BLOCK_SIZE, 2 * BLOCK_SIZE + 500, 14);
+	check(fs_write(fd, buf, 2 * BLOCK_SIZE) == 2 * BLOCK_SIZE);
+	check(file_holds(fd, BLOCK_SIZE + 1000, 2 * BLOCK_SIZE, 14));
+	fill(buf, 200, 2 * BLOCK_SIZE + 400, 15);
+	check(fs_pwrite(fd, buf, 200, 2 * BLOCK_SIZE + 400) == 200);
+	for (int synced = 0; synced < 2; synced++) {
+		check(file_holds(fd, 2 * BLOCK_SIZE + 400, 0, 14));
+		check(file_holds(fd, 200, 2 * BLOCK_SIZE + 400, 15));
+		check(file_holds(fd, 2 * BLOCK_SIZE - 100, 2 * BLOCK_SIZE + 600, 14));
+		check(fs_sync() == 0);
+	}
+	check(fs_close(fd) == 0);
+	return 0;
+}
+
+/* Writable mappings and fs_read()/fs_write() see each other's writes */
+static int case_mmap(const char *diskname)
+{
+	uint8_t buf[300];
+	uint8_t *map;
+	int fd;
+
+	(void)diskname;
+	fd = file_make("mapped", 4 * BLOCK_SIZE, 16);
+	check(fd >= 0);
+	check(fs_sync() == 0);
+
+	map = fs_mmap(fd, BLOCK_SIZE, 2 * BLOCK_SIZE, FS_MMAP_WRITE);
+	check(map != NULL);
+	check(filled(map, 2 * BLOCK_SIZE, BLOCK_SIZE, 16));
+	fill(map + 100, 300, BLOCK_SIZE + 100, 17);
+	check(file_holds(fd, 300, BLOCK_SIZE + 100, 17));
+	fill(buf, sizeof(buf), 2 * BLOCK_SIZE, 18);
+	check(fs_pwrite(fd, buf, sizeof(buf), 2 * BLOCK_SIZE) == sizeof(buf));
+	check(filled(map + BLOCK_SIZE, sizeof(buf), 2 * BLOCK_SIZE, 18));
+	check(fs_close(fd) == 0);
+	check(fs_delete("mapped") == -1);
+	check(fs_munmap(map) == 0);
+
+	/* Unaligned read-only mappings */
+	fd = fs_open("mapped");
+	check(fd >= 0);
+	map = fs_mmap(fd, 100, BLOCK_SIZE + 5000, 0);
+	check(map != NULL);
+	check(filled(map, 300, 100, 16));
+	check(filled(map + BLOCK_SIZE, 300, BLOCK_SIZE + 100, 17));
+	check(filled(map + 2 * BLOCK_SIZE - 100, 300, 2 * BLOCK_SIZE, 18));
+	check(fs_munmap(map) == 0);
+	check(fs_mmap(fd, 3 * BLOCK_SIZE, BLOCK_SIZE + 1, 0) == NULL);
+	check(fs_close(fd) == 0);
+	check(fs_delete("mapped") == 0);
+	return 0;
+}
+
+/* Copied ranges land at their destination and are copied on write */
+static int case_copy_range(const char *diskname)
+{
+	uint8_t *buf = malloc(2 * BLOCK_SIZE);
+	int src, whole, part;
+
+	(void)diskname;
+	if (!buf)
+		die("Cannot allocate memory");
+	src = file_make("src", 3 * BLOCK_SIZE + 500, 20);
+	check(src >= 0);
+	check(fs_create("whole") == 0 && fs_create("part") == 0);
+	whole = fs_open("whole");
+	part = fs_open("part");
+	check(whole >= 0 && part >= 0);
+
+	/* A whole file copied to an empty one */
+	check(fs_copy_range(src, 0, whole, 0, 4 * BLOCK_SIZE)
+	      == 3 * BLOCK_SIZE + 500);
+	check(fs_stat(whole) == 3 * BLOCK_SIZE + 500);
+	check(file_holds(whole, 3 * BLOCK_SIZE + 500, 0, 20));
+	fill(buf, 100, BLOCK_SIZE, 21);
+	check(fs_pwrite(whole, buf, 100, BLOCK_SIZE) == 100);
+	check(file_holds(whole, 100, BLOCK_SIZE, 21));
+	check(file_holds(src, 3 * BLOCK_SIZE + 500, 0, 20));
+
+	/* Unaligned ranges, and ranges that overlap in the same file */
+	check(fs_copy_range(src, 100, part, 50, 2 * BLOCK_SIZE)
+	      == 2 * BLOCK_SIZE);
+	check(fs_stat(part) == 2 * BLOCK_SIZE + 50);
+	check(fs_pread(part, buf, 2 * BLOCK_SIZE, 50) == 2 * BLOCK_SIZE);
+	check(filled(buf, 2 * BLOCK_SIZE, 100, 20));
+	check(fs_pread(part, buf, 50, 0) == 50);
+	check(!buf[0] && !memcmp(buf, buf + 1, 49));
+	check(fs_copy_range(src, 0, src, 100, BLOCK_SIZE) == -1);
+	check(fs_copy_range(src, 3 * BLOCK_SIZE, part, 0, BLOCK_SIZE) == 500);
+	check(fs_pread(part, buf, 500, 0) == 500);
+	check(filled(buf, 500, 3 * BLOCK_SIZE, 20));
+
+	/* The copies outlive their source */
+	check(fs_close(src) == 0);
+	check(fs_delete("src") == 0);
+	check(file_holds(whole, BLOCK_SIZE, 0, 20));
+	check(file_holds(whole, 100, BLOCK_SIZE, 21));
+	check(fs_pread(part, buf, 2 * BLOCK_SIZE, 0) == 2 * BLOCK_SIZE);
+	check(filled(buf, 500, 3 * BLOCK_SIZE, 20));
+	check(filled(buf + 500, 2 * BLOCK_SIZE - 500, 550, 20));
+	check(fs_close(whole) == 0 && fs_close(part) == 0);
+	free(buf);
+	return 0;
+}
+
+/* Blocks of the virtual disk file that the host has allocated */
+static long long image_blocks(const char *diskname)
+{
+	struct stat st;
+
+	if (stat(diskname, &st))
+		die("Cannot stat disk");
+	return (long long)st.st_blocks;
+}
+
+/* Freed blocks are punched out of the virtual disk file */
+static int case_trim(const char *diskname)
+{
+	long long before;
+	int fd;
+
+	fd = file_make("kept", 4 * BLOCK_SIZE + 10, 22);
+	check(fd >= 0);
+	check(fs_close(fd) == 0);
+	fd = file_make("big", 64 * BLOCK_SIZE, 23);
+	check(fd >= 0);
+	check(fs_close(fd) == 0);
+	check(fs_sync() == 0);
+	before = image_blocks(diskname);
+	check(fs_delete("big") == 0);
+	check(fs_trim() > 0);
+	check(image_blocks(diskname) < before);
+
+	/* Discarding mounts punch them out as they are freed */
+	check(fs_umount() == 0);
+	check(fs_mount_flags(diskname, FS_MOUNT_DISCARD) == 0);
+	fd = file_make("big", 64 * BLOCK_SIZE, 24);
+	check(fd >= 0);
+	check(fs_close(fd) == 0);
+	check(fs_sync() == 0);
+	before = image_blocks(diskname);
+	check(fs_delete("big") == 0);
+	check(fs_sync() == 0);
+	check(image_blocks(diskname) < before);
+
+	fd = fs_open("kept");
+	check(fd >= 0);
+	check(file_holds(fd, 4 * BLOCK_SIZE + 10, 0, 22));
+	check(fs_close(fd) == 0);
+	return 0;
+}
+
+static struct test_case cases[] = {
+	{ "clone",	case_clone },
+	{ "compress",	case_compress },
+	{ "dedup",	case_dedup },
+	{ "sparse",	case_sparse },
+	{ "append",	case_append },
+	{ "delalloc",	case_delalloc },
+	{ "mmap",	case_mmap },
+	{ "copy_range",	case_copy_range },
+	{ "trim",	case_trim },
+};
+
+/* Run @test on a freshly formatted @diskname, return whether it passed */
+static int case_run(const char *diskname, struct test_case *test)
+{
+	int ret, errors;
+
+	if (fs_format(diskname, CASE_BLOCKS, 0))
+		die("Cannot format disk");
+	if (fs_mount(diskname))
+		die("Cannot mount disk");
+	ret = test->func(diskname);
+	/* A failed case may leave files open */
+	for (int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+		fs_close(fd);
+	errors = fs_fsck(0);
+	if (errors)
+		test_error("%s: fs_fsck() returned %d", test->name, errors);
+	if (fs_umount())
+		die("Cannot unmount disk");
+	printf("%-12s %s\n", test->name, ret || errors ? "FAILED" : "ok");
+	return !ret && !errors;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t i;
+	int failed = 0;
+
+	if (argc < 2)
+		die("Usage: <diskname> [case...]");
+
+	if (argc == 2) {
+		for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+			failed += !case_run(argv[1], &cases[i]);
+		return failed != 0;
+	}
+	for (int arg = 2; arg < argc; arg++) {
+		for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+			if (!strcmp(argv[arg], cases[i].name))
+				break;
+		if (i == sizeof(cases) / sizeof(cases[0]))
+			die("Unknown case '%s'", argv[arg]);
+		failed += !case_run(argv[1], &cases[i]);
+	}
+	return failed != 0;
+}
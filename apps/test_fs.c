@@ -1,12 +1,17 @@
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -348,29 +353,26 @@ void thread_fs_cat(void *arg)
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
+	/* Scan the file in place, without copying it into a buffer first */
+	buf = fs_mmap(fs_fd, 0, stat, 0);
 	if (!buf) {
-		perror("malloc");
 		fs_umount();
-		die("Cannot malloc");
+		die("Cannot map file");
 	}
-
-	read = fs_read(fs_fd, buf, stat);
+	read = stat;
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
 		die("Cannot close file");
 	}
 
-	if (fs_umount())
-		die("cannot unmount diskname");
-
 	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
 	printf("Content of the file:\n");
 	fwrite(buf, 1, stat, stdout);
 	fflush(stdout);
 
-	free(buf);
+	if (fs_munmap(buf) || fs_umount())
+		die("cannot unmount diskname");
 }
 
 void thread_fs_rm(void *arg)
@@ -499,6 +501,493 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+static volatile sig_atomic_t defrag_interrupted;
+
+static void defrag_sigint(int signum)
+{
+	(void)signum;
+	defrag_interrupted = 1;
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t step = 64;
+	int ret, steps = 0;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<blocks per step>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		step = strtoul(t_arg->argv[1], NULL, 0);
+	if (!step)
+		die("invalid step size");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	printf("Before:\n");
+	fs_frag_info();
+
+	/* Relocate blocks in small steps so that a ^C leaves a consistent FS */
+	signal(SIGINT, defrag_sigint);
+	do {
+		ret = fs_defrag(step);
+		steps++;
+	} while (ret == 1 && !defrag_interrupted);
+	signal(SIGINT, SIG_DFL);
+
+	if (ret < 0) {
+		fs_umount();
+		die("Cannot defragment");
+	}
+
+	printf("After:\n");
+	fs_frag_info();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (ret == 1)
+		printf("Defragmentation interrupted after %d steps, "
+			   "run again to resume\n", steps);
+	else
+		printf("Defragmentation complete (%d steps)\n", steps);
+}
+
+/*
+ * Bulk import and export: host I/O and file system I/O run in different
+ * threads, connected by a queue of fixed-size chunks. The number of chunks is
+ * bounded, so memory use does not depend on the amount of data moved. All the
+ * fs_*() calls happen in the main thread, which sees the chunks of each file in
+ * order.
+ */
+
+/* Size of each chunk of file data */
+#define BULK_CHUNK_SIZE (256 * 1024)
+/* Number of chunks, in use or free */
+#define BULK_CHUNK_COUNT 32
+/* Number of threads doing host I/O */
+#define BULK_THREADS 4
+
+struct bulk_file {
+	/* Path on the host */
+	char *path;
+	char name[FS_FILENAME_LEN];
+	/* Host file descriptor, and number of its chunks not written yet */
+	int fd;
+	int pending;
+	/* Whether the file could not be transferred entirely */
+	int failed;
+};
+
+struct bulk_chunk {
+	struct bulk_file *file;
+	size_t offset;
+	size_t len;
+	/* Whether this is the last chunk of the file */
+	int last;
+	char *buf;
+};
+
+/* Blocking FIFO of chunks, closed once its producers are done */
+struct bulk_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct bulk_chunk *chunks[BULK_CHUNK_COUNT];
+	int head, count;
+	int closed;
+};
+
+struct bulk_job {
+	struct bulk_file *files;
+	int file_count;
+	/* Next file to be handled by a host I/O thread */
+	int next_file;
+	/* Number of host I/O threads still running */
+	int running;
+	/* Free chunks, and chunks filled with data */
+	struct bulk_queue free, full;
+	/* Progress */
+	int files_done;
+	size_t bytes_done;
+	double start, last_report;
+};
+
+static double bulk_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bulk_queue_init(struct bulk_queue *q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->head = q->count = q->closed = 0;
+}
+
+static void bulk_queue_push(struct bulk_queue *q, struct bulk_chunk *chunk)
+{
+	pthread_mutex_lock(&q->lock);
+	q->chunks[(q->head + q->count++) % BULK_CHUNK_COUNT] = chunk;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Oldest chunk of @q, NULL once @q is empty and closed */
+static struct bulk_chunk *bulk_queue_pop(struct bulk_queue *q)
+{
+	struct bulk_chunk *chunk = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while (!q->count && !q->closed)
+		pthread_cond_wait(&q->cond, &q->lock);
+	if (q->count) {
+		chunk = q->chunks[q->head];
+		q->head = (q->head + 1) % BULK_CHUNK_COUNT;
+		q->count--;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return chunk;
+}
+
+static void bulk_queue_close(struct bulk_queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void bulk_init(struct bulk_job *job)
+{
+	job->next_file = 0;
+	job->running = BULK_THREADS;
+	job->files_done = 0;
+	job->bytes_done = 0;
+	bulk_queue_init(&job->free);
+	bulk_queue_init(&job->full);
+	for (int i = 0; i < BULK_CHUNK_COUNT; i++) {
+		struct bulk_chunk *chunk = malloc(sizeof(*chunk));
+		if (!chunk || !(chunk->buf = malloc(BULK_CHUNK_SIZE)))
+			die_perror("malloc");
+		bulk_queue_push(&job->free, chunk);
+	}
+	job->start = job->last_report = bulk_now();
+}
+
+static void bulk_run(struct bulk_job *job, void *(*host_thread)(void *),
+		     void (*fs_loop)(struct bulk_job *))
+{
+	pthread_t threads[BULK_THREADS];
+
+	for (int i = 0; i < BULK_THREADS; i++)
+		if (pthread_create(&threads[i], NULL, host_thread, job))
+			die("Cannot start thread");
+	fs_loop(job);
+	for (int i = 0; i < BULK_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	struct bulk_chunk *chunk;
+	bulk_queue_close(&job->free);
+	while ((chunk = bulk_queue_pop(&job->free))) {
+		free(chunk->buf);
+		free(chunk);
+	}
+}
+
+static void bulk_report(struct bulk_job *job, int final)
+{
+	double now = bulk_now();
+	double elapsed = now - job->start;
+
+	/* Refresh the progress line at most once per second */
+	if (!final && now - job->last_report < 1.0)
+		return;
+	job->last_report = now;
+	fprintf(stderr, "\r%d/%d files, %.1f MiB, %.1f MiB/s", job->files_done,
+		job->file_count, job->bytes_done / (1024.0 * 1024.0),
+		elapsed > 0 ? job->bytes_done / (1024.0 * 1024.0) / elapsed : 0);
+	if (final)
+		fprintf(stderr, " in %.2f s\n", elapsed);
+}
+
+/* Add file @name, at host path @dir/@name, to @job */
+static void bulk_add(struct bulk_job *job, const char *dir, const char *name)
+{
+	/* The file system has a single flat directory */
+	if (strlen(name) >= FS_FILENAME_LEN) {
+		test_fs_error("Skipping '%s/%s', name too long", dir, name);
+		return;
+	}
+	job->files = realloc(job->files, (job->file_count + 1) * sizeof(*job->files));
+	if (!job->files)
+		die_perror("realloc");
+	struct bulk_file *file = &job->files[job->file_count++];
+	memset(file, 0, sizeof(*file));
+	file->path = malloc(strlen(dir) + strlen(name) + 2);
+	if (!file->path)
+		die_perror("malloc");
+	sprintf(file->path, "%s/%s", dir, name);
+	strcpy(file->name, name);
+}
+
+/* Add the regular files found under host directory @dir to @job */
+static void bulk_collect(struct bulk_job *job, const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+
+	if (!d) {
+		test_fs_error("Cannot open directory '%s'", dir);
+		return;
+	}
+	while ((de = readdir(d))) {
+		struct stat st;
+		char path[PATH_MAX];
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (lstat(path, &st))
+			continue;
+		if (S_ISDIR(st.st_mode))
+			bulk_collect(job, path);
+		else if (S_ISREG(st.st_mode))
+			bulk_add(job, dir, de->d_name);
+	}
+	closedir(d);
+}
+
+/* Read host files into chunks, one file at a time per thread */
+static void *bulk_import_thread(void *arg)
+{
+	struct bulk_job *job = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&job->next_file, 1, __ATOMIC_RELAXED))
+	       < job->file_count) {
+		struct bulk_file *file = &job->files[i];
+		int fd = open(file->path, O_RDONLY);
+		size_t offset = 0;
+		struct bulk_chunk *chunk;
+		ssize_t len;
+
+		if (fd < 0)
+			file->failed = 1;
+		do {
+			chunk = bulk_queue_pop(&job->free);
+			len = fd < 0 ? 0 : read(fd, chunk->buf, BULK_CHUNK_SIZE);
+			if (len < 0) {
+				file->failed = 1;
+				len = 0;
+			}
+			chunk->file = file;
+			chunk->offset = offset;
+			chunk->len = len;
+			chunk->last = len == 0;
+			offset += len;
+			bulk_queue_push(&job->full, chunk);
+		} while (!chunk->last);
+		if (fd >= 0)
+			close(fd);
+	}
+
+	/* The last thread to finish lets the file system side stop */
+	if (__atomic_sub_fetch(&job->running, 1, __ATOMIC_RELAXED) == 0)
+		bulk_queue_close(&job->full);
+	return NULL;
+}
+
+/* Write the chunks to the file system, in the order they were read */
+static void bulk_import_loop(struct bulk_job *job)
+{
+	struct bulk_chunk *chunk;
+
+	while ((chunk = bulk_queue_pop(&job->full))) {
+		struct bulk_file *file = chunk->file;
+
+		/* The first chunk of a file creates it */
+		if (chunk->offset == 0 && !file->failed) {
+			if (fs_create(file->name) || (file->fd = fs_open(file->name)) < 0) {
+				test_fs_error("Cannot create file '%s'", file->name);
+				file->failed = 1;
+				file->fd = -1;
+			}
+		} else if (chunk->offset == 0) {
+			file->fd = -1;
+		}
+		if (file->fd >= 0 && chunk->len
+		    && (size_t)fs_write(file->fd, chunk->buf, chunk->len) != chunk->len) {
+			test_fs_error("Cannot write file '%s', is the disk full?", file->name);
+			file->failed = 1;
+		}
+		job->bytes_done += chunk->len;
+		if (chunk->last) {
+			if (file->fd >= 0)
+				fs_close(file->fd);
+			job->files_done += !file->failed;
+		}
+		bulk_queue_push(&job->free, chunk);
+		bulk_report(job, 0);
+	}
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct bulk_job job = { 0 };
+	char *diskname;
+	int failed = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory>");
+
+	diskname = t_arg->argv[0];
+	bulk_collect(&job, t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	bulk_init(&job);
+	bulk_run(&job, bulk_import_thread, bulk_import_loop);
+	bulk_report(&job, 1);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	for (int i = 0; i < job.file_count; i++) {
+		failed += job.files[i].failed;
+		free(job.files[i].path);
+	}
+	free(job.files);
+	printf("Imported %d files, %d failed\n", job.file_count - failed, failed);
+}
+
+/* Write the chunks read from the file system to the host files */
+static void *bulk_export_thread(void *arg)
+{
+	struct bulk_job *job = arg;
+	struct bulk_chunk *chunk;
+
+	while ((chunk = bulk_queue_pop(&job->full))) {
+		struct bulk_file *file = chunk->file;
+
+		if (pwrite(file->fd, chunk->buf, chunk->len, chunk->offset)
+		    != (ssize_t)chunk->len)
+			file->failed = 1;
+		/* Whoever writes the last pending chunk closes the file */
+		if (__atomic_sub_fetch(&file->pending, 1, __ATOMIC_ACQ_REL) == 0)
+			close(file->fd);
+		bulk_queue_push(&job->free, chunk);
+	}
+	return NULL;
+}
+
+/* Read each file from the file system into chunks */
+static void bulk_export_loop(struct bulk_job *job)
+{
+	for (int i = 0; i < job->file_count; i++) {
+		struct bulk_file *file = &job->files[i];
+		int fs_fd = fs_open(file->name);
+		int size = fs_fd < 0 ? -1 : fs_stat(fs_fd);
+
+		if (size < 0) {
+			test_fs_error("Cannot open file '%s'", file->name);
+			file->failed = 1;
+			if (fs_fd >= 0)
+				fs_close(fs_fd);
+			continue;
+		}
+		file->fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (file->fd < 0) {
+			test_fs_error("Cannot create host file '%s'", file->path);
+			file->failed = 1;
+			fs_close(fs_fd);
+			continue;
+		}
+
+		/* Chunks are counted upfront, an empty file still has one */
+		file->pending = size ? (size + BULK_CHUNK_SIZE - 1) / BULK_CHUNK_SIZE : 1;
+		for (size_t offset = 0; offset < (size_t)size || !offset; offset += BULK_CHUNK_SIZE) {
+			struct bulk_chunk *chunk = bulk_queue_pop(&job->free);
+			int len = size ? fs_read(fs_fd, chunk->buf, BULK_CHUNK_SIZE) : 0;
+
+			if (len < 0) {
+				file->failed = 1;
+				len = 0;
+			}
+			chunk->file = file;
+			chunk->offset = offset;
+			chunk->len = len;
+			chunk->last = offset + BULK_CHUNK_SIZE >= (size_t)size;
+			job->bytes_done += len;
+			bulk_queue_push(&job->full, chunk);
+			bulk_report(job, 0);
+			if (!size)
+				break;
+		}
+		fs_close(fs_fd);
+		job->files_done++;
+	}
+	bulk_queue_close(&job->full);
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct bulk_job job = { 0 };
+	char *diskname, *dir;
+	int failed = 0;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory> [<filename>...]");
+
+	diskname = t_arg->argv[0];
+	dir = t_arg->argv[1];
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		die_perror("mkdir");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* Files are named on the command line, all of them by default */
+	if (t_arg->argc > 2) {
+		for (int i = 2; i < t_arg->argc; i++)
+			bulk_add(&job, dir, t_arg->argv[i]);
+	} else {
+		struct fs_dir *fs_dir = fs_opendir(0);
+		struct fs_dirent dirent;
+
+		if (!fs_dir) {
+			fs_umount();
+			die("Cannot list files");
+		}
+		while (fs_readdir(fs_dir, &dirent) == 1)
+			bulk_add(&job, dir, dirent.name);
+		fs_closedir(fs_dir);
+	}
+
+	bulk_init(&job);
+	bulk_run(&job, bulk_export_thread, bulk_export_loop);
+	bulk_report(&job, 1);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	for (int i = 0; i < job.file_count; i++) {
+		failed += job.files[i].failed;
+		free(job.files[i].path);
+	}
+	free(job.files);
+	printf("Exported %d files, %d failed\n", job.file_count - failed, failed);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -517,6 +1006,9 @@ static struct {
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
+	{ "defrag",	thread_fs_defrag },
+	{ "import",	thread_fs_import },
+	{ "export",	thread_fs_export },
 	{ "script",	thread_fs_script }
 };
 
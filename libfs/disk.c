@@ -1,8 +1,16 @@
+#define _GNU_SOURCE /* for O_DIRECT and fallocate() */
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "disk.h"
@@ -10,75 +18,939 @@
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Maximum number of image files of a striped disk */
+#define DISK_MAX_IMAGES 16
+/* Default stripe unit, in blocks */
+#define DEFAULT_STRIPE_BLOCKS 16
+/* Smaller striped transfers are not worth waking the workers for */
+#define PARALLEL_MIN_BLOCKS 32
+
+/* Size of the areas the buffer pool is carved from, one huge page */
+#define POOL_AREA_SIZE (2 * 1024 * 1024)
+/* Number of blocks staged at once for unaligned direct I/O */
+#define STAGING_BLOCKS 32
+
+/* Size of the block cache */
+#define CACHE_SIZE (8 * 1024 * 1024)
+#define CACHE_BLOCKS (CACHE_SIZE / BLOCK_SIZE)
+/* Dirty blocks past which writers wait for the flusher, and past which the
+ * flusher writes blocks back whatever their age */
+#define DIRTY_LIMIT (CACHE_BLOCKS / 2)
+#define DIRTY_BACKGROUND (CACHE_BLOCKS / 4)
+/* Age past which dirty blocks are written back, in milliseconds */
+#define DIRTY_EXPIRE_MS 1000
+/* Interval between the checks of the flusher, in milliseconds */
+#define FLUSH_INTERVAL_MS 200
+/* Most blocks written back at once */
+#define FLUSH_MAX_BLOCKS ((1024 * 1024) / BLOCK_SIZE)
+/* Prefetch requests waiting for the prefetcher, more are dropped */
+#define PREFETCH_QUEUE_SIZE 64
+/* Longest transfer of the prefetcher */
+#define PREFETCH_MAX_BLOCKS 32
+/* Longest transfer the scheduler merges requests into */
+#define SCHED_MAX_BLOCKS ((1024 * 1024) / BLOCK_SIZE)
+/* Blocks a stream transfers in a row before yielding to the other streams */
+#define SCHED_QUANTUM_BLOCKS ((128 * 1024 + BLOCK_SIZE - 1) / BLOCK_SIZE)
+/* Age past which a request is served first, in milliseconds */
+#define SCHED_EXPIRE_MS 100
+/* Stream of the writes of the flusher */
+#define FLUSH_STREAM (-1)
+/* Most writable mappings of blocks at once */
+#define MAP_MAX_RANGES 64
+
+/* Image files of a disk, parsed from its name */
+struct disk_spec {
+	/* Copy of the name, which the file names point into */
+	char *buf;
+	char *names[DISK_MAX_IMAGES];
+	int count;
+	size_t stripe;
+};
+
+/* Transfer of the blocks of one image file, part of a striped transfer */
+struct stripe_job {
+	struct iovec *iov;
+	int iovcnt;
+	off_t offset;
+	int write;
+	int ret;
+	/* Whether the worker of the image file has yet to perform the job */
+	int pending;
+};
 
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
-	int fd;
+	/* File descriptor of each image file, 0 of them if no disk is open */
+	int fds[DISK_MAX_IMAGES];
+	int count;
+	/* Number of consecutive blocks stored in one image file */
+	size_t stripe;
 	/* Block count */
 	size_t bcount;
+	/* BLOCK_DISK_* flags the disk was opened with */
+	int flags;
+	/* Alignment of the buffers of direct transfers */
+	size_t align;
+	/* Aligned copy of unaligned buffers, with BLOCK_DISK_DIRECT only */
+	uint8_t *staging;
+	pthread_mutex_t staging_lock;
+
+	/* Workers transferring the stripes of each image file in parallel */
+	pthread_t workers[DISK_MAX_IMAGES];
+	struct stripe_job jobs[DISK_MAX_IMAGES];
+	/* Held during a striped transfer, which owns the jobs */
+	pthread_mutex_t transfer_lock;
+	/* Protects the fields below and the pending flags of the jobs */
+	pthread_mutex_t job_lock;
+	pthread_cond_t job_cond;
+	pthread_cond_t done_cond;
+	int pending;
+	int stopping;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk = {
+	.staging_lock = PTHREAD_MUTEX_INITIALIZER,
+	.transfer_lock = PTHREAD_MUTEX_INITIALIZER,
+	.job_lock = PTHREAD_MUTEX_INITIALIZER,
+	.job_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
 
-int block_disk_open(const char *diskname)
+/* Transfer waiting for the scheduler */
+struct io_request {
+	size_t block;
+	size_t count;
+	uint8_t *buf;
+	int write;
+	/* Stream of the thread that made the request (see block_stream()) */
+	int stream;
+	/* Time at which the request was queued, in milliseconds */
+	uint64_t queued;
+	int ret;
+	int done;
+	struct io_request *next;
+};
+
+/* Cached copy of one block */
+struct cache_entry {
+	size_t block;
+	uint8_t *data;
+	int valid;
+	/* Whether the copy is newer than the block on disk */
+	int dirty;
+	/* Incremented by each write to the copy */
+	unsigned int version;
+	/* Time at which the copy became dirty, in milliseconds */
+	uint64_t dirtied;
+	/* Next entry of the same hash bucket */
+	struct cache_entry *hash_next;
+	/* Neighbours in the list of clean entries, or in the one of dirty entries */
+	struct cache_entry *prev, *next;
+};
+
+struct cache_list {
+	struct cache_entry *head, *tail;
+};
+
+/* Blocks mapped by block_map() */
+struct map_range {
+	size_t block;
+	size_t count;
+};
+
+/* Range of blocks to prefetch, for stream @stream */
+struct prefetch_request {
+	size_t block;
+	size_t count;
+	int stream;
+};
+
+/*
+ * Cache of the most recently used blocks, shared by all threads. Written
+ * blocks stay dirty in the cache until the flusher writes them back, once
+ * they are old enough or too many, merging adjacent blocks into single
+ * writes. Dirty entries are listed from the oldest, clean ones in LRU order,
+ * from the most recently used one to the next one to be reused: blocks
+ * advised as not reused are moved, or inserted, at that end.
+ */
+static struct {
+	struct cache_entry entries[CACHE_BLOCKS];
+	struct cache_entry *buckets[CACHE_BLOCKS];
+	struct cache_list lru;
+	struct cache_list dirty;
+	int dirty_count;
+	/* Memory of the cached copies, NULL if no disk is open */
+	uint8_t *area;
+	/* Incremented by each write to the disk, so that a read that overlaps
+	 * with one does not cache what it read */
+	unsigned long writes;
+	pthread_mutex_t lock;
+
+	/* Writes dirty blocks back in the background */
+	pthread_t flusher;
+	/* Wakes the flusher up before its next check */
+	pthread_cond_t flush_cond;
+	/* Signaled when the flusher wrote blocks back */
+	pthread_cond_t clean_cond;
+	/* Number of threads waiting for every dirty block to be written back */
+	int syncing;
+	/* Whether writing blocks back failed since the last sync */
+	int flush_error;
+	/* Blocks mapped writable, which are not cached while they are, so that
+	 * reads and writes go to the blocks the mappings show */
+	struct map_range mapped[MAP_MAX_RANGES];
+	int mapped_count;
+
+	/* Copies of the blocks the flusher writes back, sorted by block */
+	uint8_t *flush_buf;
+	struct cache_entry *batch[FLUSH_MAX_BLOCKS];
+	unsigned int batch_versions[FLUSH_MAX_BLOCKS];
+	/* One write per run of adjacent blocks of the batch */
+	struct io_request runs[FLUSH_MAX_BLOCKS];
+
+	/* Reads the blocks advised as needed soon in the background */
+	pthread_t prefetcher;
+	/* Buffer of the prefetcher, which only keeps the cached copies */
+	uint8_t *buf;
+	struct prefetch_request queue[PREFETCH_QUEUE_SIZE];
+	int queue_head, queue_len;
+	pthread_cond_t queue_cond;
+	int stopping;
+} cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.flush_cond = PTHREAD_COND_INITIALIZER,
+	.clean_cond = PTHREAD_COND_INITIALIZER,
+	.queue_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Elevator shared by the transfers of all threads. Requests wait in a queue,
+ * oldest first, while another transfer is in progress, and are then served by
+ * increasing block from the end of the last transfer, the lowest one once past
+ * the last: the requests that follow the one served, in the same direction,
+ * are merged into a single transfer. The cache never has a read and a write
+ * of the same block in flight, so requests can be reordered freely. To keep
+ * one large scan or write-back from holding the disk, a stream that
+ * transferred SCHED_QUANTUM_BLOCKS in a row yields to the other streams
+ * waiting, and requests waiting for SCHED_EXPIRE_MS are served first.
+ */
+static struct {
+	struct io_request *queue;
+	/* Whether a thread is transferring requests */
+	int busy;
+	/* Block following the last transfer */
+	size_t position;
+	/* Stream served last, and blocks it transferred in a row */
+	int stream;
+	size_t served;
+	/* Requests of the transfer in progress, and their merged copy */
+	struct io_request *batch[SCHED_MAX_BLOCKS];
+	uint8_t *buf;
+	pthread_mutex_t lock;
+	/* Signaled when a transfer completes */
+	pthread_cond_t done_cond;
+} sched = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Stream of the requests of the calling thread */
+static __thread int current_stream;
+
+/* Pool of aligned block buffers, linked through their first bytes */
+static struct {
+	void *free;
+	pthread_mutex_t lock;
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Map @size bytes of memory aligned on a block, backed by huge pages if
+ * @hugepages and possible
+ */
+static void *area_map(size_t size, int hugepages)
 {
-	int fd;
-	struct stat st;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t extra = BLOCK_SIZE > page ? BLOCK_SIZE - page : 0;
+	uint8_t *area = MAP_FAILED;
+	size_t head;
+
+	/* Huge pages are larger than any block, thus aligned */
+	if (hugepages)
+		area = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (area == MAP_FAILED) {
+		/* Blocks can be larger than pages, trim the misaligned ends */
+		area = mmap(NULL, size + extra, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (area == MAP_FAILED)
+			return NULL;
+		head = (BLOCK_SIZE - (uintptr_t)area % BLOCK_SIZE) % BLOCK_SIZE;
+		if (head)
+			munmap(area, head);
+		if (extra > head)
+			munmap(area + head + size, extra - head);
+		area += head;
+		/* No huge page reserved, transparent ones may still do */
+		if (hugepages)
+			madvise(area, size, MADV_HUGEPAGE);
+	}
+	return area;
+}
+
+void *block_buffer_get(void)
+{
+	void *buf;
+
+	pthread_mutex_lock(&pool.lock);
+	if (!pool.free) {
+		uint8_t *area = area_map(POOL_AREA_SIZE,
+					 disk.flags & BLOCK_DISK_HUGEPAGES);
+
+		if (!area) {
+			pthread_mutex_unlock(&pool.lock);
+			return NULL;
+		}
+		/* Areas are never unmapped, their buffers return to the pool */
+		for (size_t i = 0; i < POOL_AREA_SIZE; i += BLOCK_SIZE) {
+			*(void **)(area + i) = pool.free;
+			pool.free = area + i;
+		}
+	}
+	buf = pool.free;
+	pool.free = *(void **)buf;
+	pthread_mutex_unlock(&pool.lock);
+	return buf;
+}
+
+void block_buffer_put(void *buf)
+{
+	if (!buf)
+		return;
+	pthread_mutex_lock(&pool.lock);
+	*(void **)buf = pool.free;
+	pool.free = buf;
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* Whether @buf can be transferred as is */
+static int is_aligned(const void *buf)
+{
+	return !(disk.flags & BLOCK_DISK_DIRECT) || (uintptr_t)buf % disk.align == 0;
+}
+
+/*
+ * Parse @diskname, which names one image file, or several separated by commas
+ * and optionally followed by ":<stripe unit in blocks>"
+ */
+static int spec_parse(const char *diskname, struct disk_spec *spec)
+{
+	char *colon, *save, *name;
 
 	if (!diskname) {
 		block_error("invalid file diskname");
 		return -1;
 	}
+	spec->buf = strdup(diskname);
+	if (!spec->buf) {
+		perror("strdup");
+		return -1;
+	}
+	spec->count = 0;
+	spec->stripe = DEFAULT_STRIPE_BLOCKS;
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
+	colon = strrchr(spec->buf, ':');
+	if (colon && colon[1] && !colon[1 + strspn(colon + 1, "0123456789")]) {
+		spec->stripe = strtoul(colon + 1, NULL, 10);
+		*colon = '\0';
+	}
+	for (name = strtok_r(spec->buf, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		if (spec->count == DISK_MAX_IMAGES) {
+			block_error("more than %d image files", DISK_MAX_IMAGES);
+			goto err;
+		}
+		spec->names[spec->count++] = name;
+	}
+	if (!spec->count || !spec->stripe) {
+		block_error("invalid file diskname '%s'", diskname);
+		goto err;
+	}
+	return 0;
+
+err:
+	free(spec->buf);
+	return -1;
+}
+
+int block_disk_create(const char *diskname, size_t bcount)
+{
+	struct disk_spec spec;
+	size_t image_bcount = bcount;
+	int fd;
+
+	if (spec_parse(diskname, &spec))
+		return -1;
+
+	/* Striped images hold the same whole number of stripes each */
+	if (spec.count > 1) {
+		size_t round = spec.stripe * spec.count;
+
+		image_bcount = (bcount + round - 1) / round * spec.stripe;
+	}
+
+	for (int i = 0; i < spec.count; i++) {
+		if ((fd = open(spec.names[i], O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+			perror("open");
+			free(spec.buf);
+			return -1;
+		}
+
+		/* Sparse file: no block is actually allocated on the host */
+		if (ftruncate(fd, image_bcount * BLOCK_SIZE)) {
+			perror("ftruncate");
+			close(fd);
+			free(spec.buf);
+			return -1;
+		}
+
+		close(fd);
+	}
+
+	free(spec.buf);
+	return 0;
+}
+
+/*
+ * Transfer the buffers of @iov from or to image file @fd at byte @offset, with
+ * as few system calls as possible
+ */
+static int fd_transfer(int fd, struct iovec *iov, int iovcnt, off_t offset,
+		       int write)
+{
+	ssize_t ret;
+
+	/* Positional transfers, so that concurrent callers don't share a file offset */
+	while (iovcnt > 0) {
+		int n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+		if (write)
+			ret = pwritev(fd, iov, n, offset);
+		else
+			ret = preadv(fd, iov, n, offset);
+		if (ret < 0) {
+			perror(write ? "pwritev" : "preadv");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk");
+			return -1;
+		}
+		offset += ret;
+		/* Skip what was transferred, partial transfers resume mid-buffer */
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+static void job_run(int image)
+{
+	struct stripe_job *job = &disk.jobs[image];
+
+	job->ret = fd_transfer(disk.fds[image], job->iov, job->iovcnt,
+			       job->offset, job->write);
+}
+
+/* Worker of image file @arg, performing its part of the striped transfers */
+static void *stripe_worker(void *arg)
+{
+	int image = (intptr_t)arg;
+
+	pthread_mutex_lock(&disk.job_lock);
+	for (;;) {
+		while (!disk.jobs[image].pending && !disk.stopping)
+			pthread_cond_wait(&disk.job_cond, &disk.job_lock);
+		if (disk.stopping)
+			break;
+		pthread_mutex_unlock(&disk.job_lock);
+		job_run(image);
+		pthread_mutex_lock(&disk.job_lock);
+		disk.jobs[image].pending = 0;
+		if (--disk.pending == 0)
+			pthread_cond_signal(&disk.done_cond);
+	}
+	pthread_mutex_unlock(&disk.job_lock);
+	return NULL;
+}
+
+/* Stop the first @count workers and close the first @count image files */
+static void images_close(int count)
+{
+	pthread_mutex_lock(&disk.job_lock);
+	disk.stopping = 1;
+	pthread_cond_broadcast(&disk.job_cond);
+	pthread_mutex_unlock(&disk.job_lock);
+	for (int i = 0; i < count; i++) {
+		if (disk.count > 1)
+			pthread_join(disk.workers[i], NULL);
+		close(disk.fds[i]);
+	}
+	disk.stopping = 0;
+}
+
+/* Defined with the transfers below */
+static int sched_submit(struct io_request *reqs, int n);
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Unlink @e from @list */
+static void list_remove(struct cache_list *list, struct cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		list->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		list->tail = e->prev;
+}
+
+/* Link @e at the head of @list, or at its tail if @tail */
+static void list_insert(struct cache_list *list, struct cache_entry *e, int tail)
+{
+	if (tail) {
+		e->prev = list->tail;
+		e->next = NULL;
+		if (list->tail)
+			list->tail->next = e;
+		else
+			list->head = e;
+		list->tail = e;
+	} else {
+		e->prev = NULL;
+		e->next = list->head;
+		if (list->head)
+			list->head->prev = e;
+		else
+			list->tail = e;
+		list->head = e;
+	}
+}
+
+static struct cache_entry **cache_bucket(size_t block)
+{
+	return &cache.buckets[block % CACHE_BLOCKS];
+}
+
+/* Entry caching block @block, NULL if none */
+static struct cache_entry *cache_find(size_t block)
+{
+	struct cache_entry *e;
+
+	for (e = *cache_bucket(block); e; e = e->hash_next)
+		if (e->block == block)
+			return e;
+	return NULL;
+}
+
+/* Stop caching the block of clean entry @e, which is then the next one reused */
+static void cache_drop(struct cache_entry *e)
+{
+	struct cache_entry **p = cache_bucket(e->block);
+
+	while (*p != e)
+		p = &(*p)->hash_next;
+	*p = e->hash_next;
+	e->valid = 0;
+	list_remove(&cache.lru, e);
+	list_insert(&cache.lru, e, 1);
+}
+
+/* Whether block @block is mapped writable, and not to be cached */
+static int cache_bypassed(size_t block)
+{
+	for (int i = 0; i < cache.mapped_count; i++)
+		if (block >= cache.mapped[i].block
+		    && block < cache.mapped[i].block + cache.mapped[i].count)
+			return 1;
+	return 0;
+}
+
+/*
+ * Reuse the least recently used clean entry for block @block, which is not
+ * cached. Writers keep the dirty blocks under DIRTY_LIMIT, so there is one.
+ */
+static struct cache_entry *cache_alloc(size_t block)
+{
+	struct cache_entry *e = cache.lru.tail;
+
+	if (e->valid)
+		cache_drop(e);
+	e->block = block;
+	e->valid = 1;
+	e->hash_next = *cache_bucket(block);
+	*cache_bucket(block) = e;
+	return e;
+}
+
+static int batch_cmp(const void *a, const void *b)
+{
+	const struct cache_entry *x = *(struct cache_entry * const *)a;
+	const struct cache_entry *y = *(struct cache_entry * const *)b;
+
+	return x->block < y->block ? -1 : x->block > y->block;
+}
+
+/*
+ * Write back the oldest dirty blocks, only the expired ones unless @all, with
+ * one request per run of adjacent blocks. Called with the cache lock held,
+ * which is released during the writes.
+ */
+static void cache_flush(int all)
+{
+	uint64_t now = now_ms();
+	struct cache_entry *e;
+	int n = 0, runs = 0, error;
+
+	for (e = cache.dirty.head; e && n < FLUSH_MAX_BLOCKS; e = e->next) {
+		if (!all && now - e->dirtied < DIRTY_EXPIRE_MS)
+			break;
+		cache.batch[n++] = e;
+	}
+	qsort(cache.batch, n, sizeof(*cache.batch), batch_cmp);
+	/* Dirty entries are not reused, they stay valid meanwhile */
+	for (int i = 0; i < n; i++) {
+		memcpy(cache.flush_buf + (size_t)i * BLOCK_SIZE, cache.batch[i]->data, BLOCK_SIZE);
+		cache.batch_versions[i] = cache.batch[i]->version;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	/* All at once, so that the scheduler fits reads in between */
+	for (int i = 0, run; i < n; i += run) {
+		for (run = 1; i + run < n; run++)
+			if (cache.batch[i + run]->block != cache.batch[i]->block + run)
+				break;
+		cache.runs[runs++] = (struct io_request){
+			.block = cache.batch[i]->block,
+			.count = run,
+			.buf = cache.flush_buf + (size_t)i * BLOCK_SIZE,
+			.write = 1,
+		};
+	}
+	error = sched_submit(cache.runs, runs);
+
+	pthread_mutex_lock(&cache.lock);
+	cache.writes++;
+	/* The blocks written again or discarded meanwhile are left as they are,
+	 * the lost ones are dropped */
+	for (int i = 0; i < n; i++) {
+		e = cache.batch[i];
+		if (e->version != cache.batch_versions[i])
+			continue;
+		list_remove(&cache.dirty, e);
+		e->dirty = 0;
+		cache.dirty_count--;
+		list_insert(&cache.lru, e, 0);
+		if (error)
+			cache_drop(e);
+	}
+	if (error)
+		cache.flush_error = 1;
+	pthread_cond_broadcast(&cache.clean_cond);
+}
+
+/* Write dirty blocks back in the background, and all of them before stopping */
+static void *flush_thread(void *arg)
+{
+	(void)arg;
+	current_stream = FLUSH_STREAM;
+
+	pthread_mutex_lock(&cache.lock);
+	for (;;) {
+		int all = cache.stopping || cache.syncing || cache.dirty_count >= DIRTY_BACKGROUND;
+		struct cache_entry *oldest = cache.dirty.head;
+		struct timespec ts;
+
+		if (oldest && (all || now_ms() - oldest->dirtied >= DIRTY_EXPIRE_MS)) {
+			cache_flush(all);
+			continue;
+		}
+		if (cache.stopping)
+			break;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&cache.flush_cond, &cache.lock, &ts);
+	}
+	pthread_mutex_unlock(&cache.lock);
+	return NULL;
+}
+
+/* Read blocks in the background, as long as the cache is open */
+static void *prefetch_thread(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&cache.lock);
+	for (;;) {
+		struct prefetch_request req;
+
+		while (!cache.queue_len && !cache.stopping)
+			pthread_cond_wait(&cache.queue_cond, &cache.lock);
+		if (cache.stopping)
+			break;
+		req = cache.queue[cache.queue_head];
+		cache.queue_head = (cache.queue_head + 1) % PREFETCH_QUEUE_SIZE;
+		cache.queue_len--;
+		pthread_mutex_unlock(&cache.lock);
+		current_stream = req.stream;
+		/* Reading through the cache skips the blocks already cached */
+		for (size_t i = 0; i < req.count; i += PREFETCH_MAX_BLOCKS) {
+			size_t n = req.count - i < PREFETCH_MAX_BLOCKS ?
+				   req.count - i : PREFETCH_MAX_BLOCKS;
+
+			if (block_read_range(req.block + i, n, cache.buf))
+				break;
+		}
+		pthread_mutex_lock(&cache.lock);
+	}
+	pthread_mutex_unlock(&cache.lock);
+	return NULL;
+}
+
+/* Set up an empty cache and start its threads */
+static int cache_open(void)
+{
+	cache.area = area_map(CACHE_SIZE, disk.flags & BLOCK_DISK_HUGEPAGES);
+	if (!cache.area)
 		return -1;
+	cache.buf = area_map(PREFETCH_MAX_BLOCKS * BLOCK_SIZE, 0);
+	if (!cache.buf)
+		goto err_area;
+	cache.flush_buf = area_map(FLUSH_MAX_BLOCKS * BLOCK_SIZE, 0);
+	if (!cache.flush_buf)
+		goto err_buf;
+	sched.buf = area_map(SCHED_MAX_BLOCKS * BLOCK_SIZE, 0);
+	if (!sched.buf)
+		goto err_flush_buf;
+	sched.position = 0;
+	sched.stream = 0;
+	sched.served = 0;
+
+	cache.lru.head = cache.lru.tail = NULL;
+	cache.dirty.head = cache.dirty.tail = NULL;
+	cache.dirty_count = 0;
+	cache.flush_error = 0;
+	cache.mapped_count = 0;
+	memset(cache.buckets, 0, sizeof(cache.buckets));
+	for (int i = 0; i < CACHE_BLOCKS; i++) {
+		cache.entries[i].data = cache.area + (size_t)i * BLOCK_SIZE;
+		cache.entries[i].valid = 0;
+		cache.entries[i].dirty = 0;
+		list_insert(&cache.lru, &cache.entries[i], 1);
+	}
+	cache.queue_len = 0;
+	if (pthread_create(&cache.flusher, NULL, flush_thread, NULL))
+		goto err_sched_buf;
+	if (pthread_create(&cache.prefetcher, NULL, prefetch_thread, NULL)) {
+		pthread_mutex_lock(&cache.lock);
+		cache.stopping = 1;
+		pthread_cond_signal(&cache.flush_cond);
+		pthread_mutex_unlock(&cache.lock);
+		pthread_join(cache.flusher, NULL);
+		cache.stopping = 0;
+		goto err_sched_buf;
 	}
+	return 0;
+
+err_sched_buf:
+	munmap(sched.buf, SCHED_MAX_BLOCKS * BLOCK_SIZE);
+err_flush_buf:
+	munmap(cache.flush_buf, FLUSH_MAX_BLOCKS * BLOCK_SIZE);
+err_buf:
+	munmap(cache.buf, PREFETCH_MAX_BLOCKS * BLOCK_SIZE);
+err_area:
+	munmap(cache.area, CACHE_SIZE);
+	cache.area = NULL;
+	return -1;
+}
+
+/*
+ * Write the dirty blocks back, stop the threads and forget the cached blocks.
+ * Return -1 if some blocks could not be written back since the last sync.
+ */
+static int cache_close(void)
+{
+	int ret;
+
+	if (!cache.area)
+		return 0;
+	pthread_mutex_lock(&cache.lock);
+	cache.stopping = 1;
+	pthread_cond_signal(&cache.flush_cond);
+	pthread_cond_signal(&cache.queue_cond);
+	pthread_mutex_unlock(&cache.lock);
+	pthread_join(cache.prefetcher, NULL);
+	pthread_join(cache.flusher, NULL);
+	cache.stopping = 0;
+	ret = cache.flush_error ? -1 : 0;
+	munmap(sched.buf, SCHED_MAX_BLOCKS * BLOCK_SIZE);
+	munmap(cache.flush_buf, FLUSH_MAX_BLOCKS * BLOCK_SIZE);
+	munmap(cache.buf, PREFETCH_MAX_BLOCKS * BLOCK_SIZE);
+	munmap(cache.area, CACHE_SIZE);
+	cache.area = NULL;
+	return ret;
+}
+
+int block_disk_open(const char *diskname)
+{
+	return block_disk_open_flags(diskname, 0);
+}
+
+int block_disk_open_flags(const char *diskname, int flags)
+{
+	struct disk_spec spec;
+	struct stat st;
+	off_t size = 0;
+	int i, fd;
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
-		perror("open");
+	if (disk.count) {
+		block_error("disk already open");
 		return -1;
 	}
 
-	if (fstat(fd, &st)) {
-		perror("fstat");
+	/* Direct transfers start on the 4 KiB sectors of most devices */
+	if (flags & BLOCK_DISK_DIRECT && BLOCK_SIZE < 4096) {
+		block_error("direct I/O needs blocks of at least 4 KiB");
 		return -1;
 	}
 
-	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	if (spec_parse(diskname, &spec))
 		return -1;
+	disk.count = spec.count;
+	disk.align = 4096;
+	disk.stripe = spec.stripe;
+
+	for (i = 0; i < spec.count; i++) {
+		/* Direct I/O skips the host page cache, not all file systems allow it */
+		if ((fd = open(spec.names[i], O_RDWR | (flags & BLOCK_DISK_DIRECT ? O_DIRECT : 0),
+			       0644)) < 0) {
+			perror("open");
+			goto err;
+		}
+
+		if (fstat(fd, &st)) {
+			perror("fstat");
+			close(fd);
+			goto err;
+		}
+
+		/* The disk image's size should be a multiple of the block size */
+		if (st.st_size % BLOCK_SIZE != 0) {
+			block_error("size '%zu' is not multiple of '%d'",
+				    st.st_size, BLOCK_SIZE);
+			close(fd);
+			goto err;
+		}
+
+		/* Striped images hold the same whole number of stripes each */
+		if (spec.count > 1 && ((i && st.st_size != size)
+				       || st.st_size % (spec.stripe * BLOCK_SIZE))) {
+			block_error("image '%s' does not match the stripes of the others",
+				    spec.names[i]);
+			close(fd);
+			goto err;
+		}
+		size = st.st_size;
+
+		/*
+		 * Buffers aligned on the I/O size of the host's file system
+		 * suit its devices, as long as they are within a block
+		 */
+		if (st.st_blksize > (blksize_t)disk.align && st.st_blksize <= BLOCK_SIZE
+		    && !(st.st_blksize & (st.st_blksize - 1)))
+			disk.align = st.st_blksize;
+
+		disk.fds[i] = fd;
+		if (spec.count > 1
+		    && pthread_create(&disk.workers[i], NULL, stripe_worker, (void *)(intptr_t)i)) {
+			block_error("cannot start worker");
+			close(fd);
+			goto err;
+		}
+	}
+
+	if (flags & BLOCK_DISK_DIRECT) {
+		disk.staging = area_map(STAGING_BLOCKS * BLOCK_SIZE,
+					flags & BLOCK_DISK_HUGEPAGES);
+		if (!disk.staging) {
+			perror("mmap");
+			goto err;
+		}
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.bcount = size / BLOCK_SIZE * spec.count;
+	disk.flags = flags;
+	if (cache_open()) {
+		block_error("cannot set up the block cache");
+		if (disk.staging)
+			munmap(disk.staging, STAGING_BLOCKS * BLOCK_SIZE);
+		disk.staging = NULL;
+		disk.flags = 0;
+		goto err;
+	}
+	free(spec.buf);
 
 	return 0;
+
+err:
+	images_close(i);
+	disk.count = 0;
+	free(spec.buf);
+	return -1;
 }
 
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	int ret;
+
+	if (!disk.count) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	ret = cache_close();
+	images_close(disk.count);
+	if (disk.staging)
+		munmap(disk.staging, STAGING_BLOCKS * BLOCK_SIZE);
 
-	disk.fd = INVALID_FD;
+	disk.count = 0;
+	disk.staging = NULL;
+	disk.flags = 0;
 
-	return 0;
+	return ret;
 }
 
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.count) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -86,59 +958,588 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
-int block_write(size_t block, const void *buf)
+/* Check that blocks @block to @block + @count - 1 can be accessed */
+static int range_check(size_t block, size_t count)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.count) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	if (block + count > disk.bcount || block + count < block) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block + count - 1, disk.bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	return 0;
+}
+
+/*
+ * Transfer blocks @block to @block + @count - 1 from or to @buf. The stripes
+ * of a striped disk are gathered into one transfer per image file, and the
+ * image files are transferred in parallel.
+ */
+static int range_transfer(size_t block, size_t count, void *buf, int write)
+{
+	size_t first = block / disk.stripe, last = (block + count - 1) / disk.stripe;
+	struct iovec single = { buf, count * BLOCK_SIZE }, *iov;
+	int n = disk.count, used = 0, handed_off = 0, ret = 0, inline_image = -1;
+
+	if (!count)
+		return 0;
+	if (n == 1)
+		return fd_transfer(disk.fds[0], &single, 1, block * BLOCK_SIZE, write);
+
+	iov = malloc((last - first + 1) * sizeof(*iov));
+	if (!iov) {
+		perror("malloc");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
-		return -1;
+	pthread_mutex_lock(&disk.transfer_lock);
+	for (int i = 0; i < n; i++) {
+		struct stripe_job *job = &disk.jobs[i];
+
+		job->iov = iov + used;
+		job->iovcnt = 0;
+		job->write = write;
+		job->ret = 0;
+		/* The stripes of an image file are contiguous in that file */
+		for (size_t s = first + (i + n - first % n) % n; s <= last; s += n) {
+			size_t start = s * disk.stripe > block ? s * disk.stripe : block;
+			size_t end = (s + 1) * disk.stripe < block + count ?
+				     (s + 1) * disk.stripe : block + count;
+
+			if (!job->iovcnt)
+				job->offset = (s / n * disk.stripe + start - s * disk.stripe)
+					      * BLOCK_SIZE;
+			iov[used].iov_base = (char *)buf + (start - block) * BLOCK_SIZE;
+			iov[used].iov_len = (end - start) * BLOCK_SIZE;
+			used++;
+			job->iovcnt++;
+		}
+		if (!job->iovcnt)
+			continue;
+		/* The caller performs the first job itself, workers the others */
+		if (inline_image < 0) {
+			inline_image = i;
+			continue;
+		}
+		if (count < PARALLEL_MIN_BLOCKS)
+			job_run(i);
+		else
+			handed_off++;
 	}
 
-	return 0;
+	if (handed_off) {
+		pthread_mutex_lock(&disk.job_lock);
+		for (int i = inline_image + 1; i < n; i++) {
+			if (disk.jobs[i].iovcnt) {
+				disk.jobs[i].pending = 1;
+				disk.pending++;
+			}
+		}
+		pthread_cond_broadcast(&disk.job_cond);
+		pthread_mutex_unlock(&disk.job_lock);
+	}
+	job_run(inline_image);
+	if (handed_off) {
+		pthread_mutex_lock(&disk.job_lock);
+		while (disk.pending)
+			pthread_cond_wait(&disk.done_cond, &disk.job_lock);
+		pthread_mutex_unlock(&disk.job_lock);
+	}
+	for (int i = 0; i < n; i++)
+		if (disk.jobs[i].iovcnt && disk.jobs[i].ret)
+			ret = -1;
+	pthread_mutex_unlock(&disk.transfer_lock);
+
+	free(iov);
+	return ret;
 }
 
-int block_read(size_t block, void *buf)
+/* Unlink @req from the queue of the scheduler */
+static void sched_remove(struct io_request *req)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	struct io_request **p = &sched.queue;
+
+	while (*p != req)
+		p = &(*p)->next;
+	*p = req->next;
+}
+
+/* Next request to serve, the queue being not empty */
+static struct io_request *sched_pick(void)
+{
+	struct io_request *r, *next = NULL, *lowest = NULL;
+	int others = 0;
+
+	if (now_ms() - sched.queue->queued >= SCHED_EXPIRE_MS)
+		return sched.queue;
+	for (r = sched.queue; r; r = r->next)
+		if (r->stream != sched.stream)
+			others = 1;
+	for (r = sched.queue; r; r = r->next) {
+		if (others && r->stream == sched.stream
+		    && sched.served >= SCHED_QUANTUM_BLOCKS)
+			continue;
+		if (r->block >= sched.position && (!next || r->block < next->block))
+			next = r;
+		if (!lowest || r->block < lowest->block)
+			lowest = r;
+	}
+	return next ? next : lowest;
+}
+
+/*
+ * Transfer the next request, merged with the ones that follow it, and mark
+ * them done. Called with the scheduler lock held, which is released during
+ * the transfer.
+ */
+static void sched_dispatch(void)
+{
+	struct io_request *first = sched_pick(), *r;
+	size_t end = first->block + first->count;
+	uint8_t *p;
+	int n = 0, ret;
+
+	sched_remove(first);
+	sched.batch[n++] = first;
+	for (;;) {
+		for (r = sched.queue; r; r = r->next)
+			if (r->write == first->write && r->block == end
+			    && end + r->count - first->block <= SCHED_MAX_BLOCKS)
+				break;
+		if (!r)
+			break;
+		sched_remove(r);
+		sched.batch[n++] = r;
+		end += r->count;
+	}
+	if (first->stream != sched.stream) {
+		sched.stream = first->stream;
+		sched.served = 0;
+	}
+	sched.served += end - first->block;
+	sched.position = end;
+	sched.busy = 1;
+	pthread_mutex_unlock(&sched.lock);
+
+	/* Merged requests go through a copy, as one transfer */
+	if (n == 1) {
+		ret = range_transfer(first->block, first->count, first->buf, first->write);
+	} else {
+		p = sched.buf;
+		for (int i = 0; i < n && first->write; i++) {
+			memcpy(p, sched.batch[i]->buf, sched.batch[i]->count * BLOCK_SIZE);
+			p += sched.batch[i]->count * BLOCK_SIZE;
+		}
+		ret = range_transfer(first->block, end - first->block, sched.buf,
+				     first->write);
+		p = sched.buf;
+		for (int i = 0; i < n && !first->write && !ret; i++) {
+			memcpy(sched.batch[i]->buf, p, sched.batch[i]->count * BLOCK_SIZE);
+			p += sched.batch[i]->count * BLOCK_SIZE;
+		}
+	}
+
+	pthread_mutex_lock(&sched.lock);
+	for (int i = 0; i < n; i++) {
+		sched.batch[i]->ret = ret;
+		sched.batch[i]->done = 1;
+	}
+	sched.busy = 0;
+	pthread_cond_broadcast(&sched.done_cond);
+}
+
+/* Queue the @n requests of @reqs, and wait until they are all transferred */
+static int sched_submit(struct io_request *reqs, int n)
+{
+	uint64_t now = now_ms();
+	struct io_request **tail;
+	int ret = 0;
+
+	pthread_mutex_lock(&sched.lock);
+	for (tail = &sched.queue; *tail; tail = &(*tail)->next)
+		;
+	for (int i = 0; i < n; i++) {
+		reqs[i].stream = current_stream;
+		reqs[i].queued = now;
+		reqs[i].done = 0;
+		reqs[i].next = NULL;
+		*tail = &reqs[i];
+		tail = &reqs[i].next;
+	}
+	/* The thread that finds the disk idle transfers for all the others */
+	for (int i = 0; i < n; i++) {
+		while (!reqs[i].done) {
+			if (!sched.busy)
+				sched_dispatch();
+			else
+				pthread_cond_wait(&sched.done_cond, &sched.lock);
+		}
+		if (reqs[i].ret)
+			ret = -1;
+	}
+	pthread_mutex_unlock(&sched.lock);
+	return ret;
+}
+
+static int range_read(size_t block, size_t count, void *buf)
+{
+	struct io_request req = { .block = block, .count = count, .buf = buf };
+
+	return sched_submit(&req, 1);
+}
+
+/* Read @count blocks into @buf, copying them if it cannot be transferred as is */
+static int disk_read(size_t block, size_t count, void *buf)
+{
+	int ret = 0;
+
+	if (is_aligned(buf))
+		return range_read(block, count, buf);
+
+	pthread_mutex_lock(&disk.staging_lock);
+	for (size_t i = 0; i < count && !ret; i += STAGING_BLOCKS) {
+		size_t n = count - i < STAGING_BLOCKS ? count - i : STAGING_BLOCKS;
+
+		ret = range_read(block + i, n, disk.staging);
+		if (!ret)
+			memcpy((uint8_t *)buf + i * BLOCK_SIZE, disk.staging,
+			       n * BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&disk.staging_lock);
+	return ret;
+}
+
+/*
+ * Call @fn on the part of each image file that holds blocks @block to @block +
+ * @count - 1, with argument @arg. Return -1 if any of the calls fails.
+ */
+static int host_ranges(size_t block, size_t count,
+		       int (*fn)(int fd, off_t offset, off_t len, int arg), int arg)
+{
+	size_t first = block / disk.stripe, last = (block + count - 1) / disk.stripe;
+	int n = disk.count, ret = 0;
+
+	if (n == 1)
+		return fn(disk.fds[0], block * BLOCK_SIZE, count * BLOCK_SIZE, arg) ? -1 : 0;
+	for (size_t s = first; s <= last; s++) {
+		size_t start = s * disk.stripe > block ? s * disk.stripe : block;
+		size_t end = (s + 1) * disk.stripe < block + count ?
+			     (s + 1) * disk.stripe : block + count;
+
+		if (fn(disk.fds[s % n],
+		       (s / n * disk.stripe + start - s * disk.stripe) * BLOCK_SIZE,
+		       (end - start) * BLOCK_SIZE, arg))
+			ret = -1;
+	}
+	return ret;
+}
+
+/* Give the host advice @advice about blocks @block to @block + @count - 1 */
+static void host_advise(size_t block, size_t count, int advice)
+{
+	host_ranges(block, count, posix_fadvise, advice);
+}
+
+static int punch_hole(int fd, off_t offset, off_t len, int arg)
+{
+	(void)arg;
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+}
+
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+	if (range_check(block, count))
 		return -1;
+
+	/* The flusher writes the blocks back, later and in larger requests */
+	pthread_mutex_lock(&cache.lock);
+	for (size_t i = 0; i < count; i++) {
+		struct cache_entry *e = cache_find(block + i);
+
+		/* Mapped blocks are written through, for the mappings to show */
+		if (cache.mapped_count && cache_bypassed(block + i)) {
+			struct io_request req = {
+				.block = block + i,
+				.count = 1,
+				.buf = (uint8_t *)buf + i * BLOCK_SIZE,
+				.write = 1,
+			};
+
+			cache.writes++;
+			pthread_mutex_unlock(&cache.lock);
+			if (sched_submit(&req, 1))
+				return -1;
+			pthread_mutex_lock(&cache.lock);
+			continue;
+		}
+		if (!e || !e->dirty) {
+			/* Only wait for the flusher past the limit */
+			while (cache.dirty_count >= DIRTY_LIMIT) {
+				pthread_cond_signal(&cache.flush_cond);
+				pthread_cond_wait(&cache.clean_cond, &cache.lock);
+			}
+			e = cache_find(block + i);
+			if (!e)
+				e = cache_alloc(block + i);
+			if (!e->dirty) {
+				list_remove(&cache.lru, e);
+				e->dirty = 1;
+				e->dirtied = now_ms();
+				list_insert(&cache.dirty, e, 1);
+				if (++cache.dirty_count == DIRTY_BACKGROUND)
+					pthread_cond_signal(&cache.flush_cond);
+			}
+		}
+		memcpy(e->data, (const uint8_t *)buf + i * BLOCK_SIZE, BLOCK_SIZE);
+		e->version++;
 	}
+	pthread_mutex_unlock(&cache.lock);
+	return 0;
+}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+int block_sync(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache.lock);
+	cache.syncing++;
+	pthread_cond_signal(&cache.flush_cond);
+	while (cache.dirty_count)
+		pthread_cond_wait(&cache.clean_cond, &cache.lock);
+	cache.syncing--;
+	ret = cache.flush_error ? -1 : 0;
+	cache.flush_error = 0;
+	pthread_mutex_unlock(&cache.lock);
+	return ret;
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	size_t i = 0;
+
+	if (range_check(block, count))
 		return -1;
+
+	/* Copy the cached blocks, and read each run of the others at once */
+	while (i < count) {
+		uint8_t *dst = (uint8_t *)buf + i * BLOCK_SIZE;
+		struct cache_entry *e;
+		unsigned long writes;
+		size_t n = 0;
+
+		pthread_mutex_lock(&cache.lock);
+		while (i < count && (e = cache_find(block + i)) != NULL) {
+			memcpy(dst, e->data, BLOCK_SIZE);
+			if (!e->dirty) {
+				list_remove(&cache.lru, e);
+				list_insert(&cache.lru, e, 0);
+			}
+			dst += BLOCK_SIZE;
+			i++;
+		}
+		while (i + n < count && !cache_find(block + i + n))
+			n++;
+		writes = cache.writes;
+		pthread_mutex_unlock(&cache.lock);
+		if (!n)
+			break;
+
+		if (disk_read(block + i, n, dst))
+			return -1;
+
+		/* Blocks written meanwhile are cached already, and newer */
+		pthread_mutex_lock(&cache.lock);
+		if (cache.writes == writes) {
+			for (size_t j = 0; j < n; j++) {
+				if (cache_find(block + i + j) || cache_bypassed(block + i + j))
+					continue;
+				e = cache_alloc(block + i + j);
+				memcpy(e->data, dst + j * BLOCK_SIZE, BLOCK_SIZE);
+				list_remove(&cache.lru, e);
+				list_insert(&cache.lru, e, 0);
+			}
+		}
+		pthread_mutex_unlock(&cache.lock);
+		i += n;
 	}
+	return 0;
+}
+
+int block_advise(size_t block, size_t count, int advice)
+{
+	if (range_check(block, count))
+		return -1;
+
+	pthread_mutex_lock(&cache.lock);
+	switch (advice) {
+	case BLOCK_ADVISE_WILLNEED:
+		/* The prefetcher is best effort, and forgets what does not fit */
+		if (count && cache.queue_len < PREFETCH_QUEUE_SIZE) {
+			struct prefetch_request *req = &cache.queue[
+				(cache.queue_head + cache.queue_len) % PREFETCH_QUEUE_SIZE];
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+			req->block = block;
+			req->count = count;
+			req->stream = current_stream;
+			cache.queue_len++;
+			pthread_cond_signal(&cache.queue_cond);
+		}
+		break;
+	case BLOCK_ADVISE_DONTNEED:
+	case BLOCK_ADVISE_NOREUSE:
+		/* Dirty blocks stay until written back */
+		for (size_t i = 0; i < count; i++) {
+			struct cache_entry *e = cache_find(block + i);
+
+			if (!e || e->dirty)
+				continue;
+			if (advice == BLOCK_ADVISE_DONTNEED) {
+				cache_drop(e);
+			} else {
+				list_remove(&cache.lru, e);
+				list_insert(&cache.lru, e, 1);
+			}
+		}
+		break;
+	default:
+		pthread_mutex_unlock(&cache.lock);
 		return -1;
 	}
+	pthread_mutex_unlock(&cache.lock);
+
+	/* The host caches the disk too, unless accessed directly */
+	if (!(disk.flags & BLOCK_DISK_DIRECT) && advice != BLOCK_ADVISE_WILLNEED && count)
+		host_advise(block, count, advice == BLOCK_ADVISE_DONTNEED ?
+			    POSIX_FADV_DONTNEED : POSIX_FADV_NOREUSE);
+	return 0;
+}
+
+void block_stream(int stream)
+{
+	current_stream = stream;
+}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+int block_discard(size_t block, size_t count)
+{
+	if (range_check(block, count))
 		return -1;
+	if (!count)
+		return 0;
+
+	/* The content of the blocks is dead, even the one not written back yet */
+	pthread_mutex_lock(&cache.lock);
+	for (size_t i = 0; i < count; i++) {
+		struct cache_entry *e = cache_find(block + i);
+
+		if (!e)
+			continue;
+		if (e->dirty) {
+			list_remove(&cache.dirty, e);
+			e->dirty = 0;
+			e->version++;
+			cache.dirty_count--;
+			list_insert(&cache.lru, e, 0);
+		}
+		cache_drop(e);
+	}
+	pthread_cond_broadcast(&cache.clean_cond);
+	pthread_mutex_unlock(&cache.lock);
+
+	return host_ranges(block, count, punch_hole, 0);
+}
+
+/* Stop keeping blocks @block to @block + @count - 1, mapped writable, out of
+ * the cache */
+static void map_range_remove(size_t block, size_t count)
+{
+	pthread_mutex_lock(&cache.lock);
+	for (int i = 0; i < cache.mapped_count; i++) {
+		if (cache.mapped[i].block == block && cache.mapped[i].count == count) {
+			cache.mapped[i] = cache.mapped[--cache.mapped_count];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+void *block_map(size_t block, size_t count, int writable)
+{
+	size_t stripe = block / disk.stripe, offset = block * BLOCK_SIZE;
+	int fd, n = disk.count;
+	void *addr;
+
+	if (range_check(block, count) || !count)
+		return NULL;
+
+	/* Only the blocks of one stripe, the host caches, can be shared with it */
+	if (disk.flags & BLOCK_DISK_DIRECT)
+		return NULL;
+	fd = disk.fds[0];
+	if (n > 1) {
+		if ((block + count - 1) / disk.stripe != stripe)
+			return NULL;
+		fd = disk.fds[stripe % n];
+		offset = (stripe / n * disk.stripe + block - stripe * disk.stripe) * BLOCK_SIZE;
+	}
+	if (offset % sysconf(_SC_PAGESIZE))
+		return NULL;
+
+	/* Writable mappings keep their blocks out of the cache until unmapped,
+	 * so that the cache neither shows nor writes back stale copies */
+	if (writable) {
+		pthread_mutex_lock(&cache.lock);
+		if (cache.mapped_count == MAP_MAX_RANGES) {
+			pthread_mutex_unlock(&cache.lock);
+			return NULL;
+		}
+		cache.mapped[cache.mapped_count++] = (struct map_range){ block, count };
+		pthread_mutex_unlock(&cache.lock);
+	}
+
+	/* The mapping shows the image, without the dirty cached blocks */
+	addr = MAP_FAILED;
+	if (!block_sync())
+		addr = mmap(NULL, count * BLOCK_SIZE, PROT_READ | (writable ? PROT_WRITE : 0),
+			    MAP_SHARED, fd, offset);
+	if (writable) {
+		pthread_mutex_lock(&cache.lock);
+		for (size_t i = 0; i < count; i++) {
+			struct cache_entry *e = cache_find(block + i);
+
+			if (e && !e->dirty)
+				cache_drop(e);
+		}
+		pthread_mutex_unlock(&cache.lock);
+		if (addr == MAP_FAILED)
+			map_range_remove(block, count);
 	}
+	return addr == MAP_FAILED ? NULL : addr;
+}
 
+int block_unmap(void *addr, size_t block, size_t count, int writable)
+{
+	if (range_check(block, count))
+		return -1;
+
+	if (munmap(addr, count * BLOCK_SIZE))
+		return -1;
+	/* The blocks can be cached again */
+	if (writable)
+		map_range_remove(block, count);
 	return 0;
 }
 
+int block_write(size_t block, const void *buf)
+{
+	return block_write_range(block, 1, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return block_read_range(block, 1, buf);
+}
@@ -3,8 +3,46 @@
 
 #include <stddef.h> /* for size_t definition */
 
+/*
+ * log2 of the block size, chosen when building with BLOCK_SHIFT=<n> (e.g. make
+ * clean && make BLOCK_SHIFT=16 for 64 KiB blocks). As the size is a constant,
+ * the offset arithmetic compiles to shifts and masks for any of them.
+ */
+#ifndef BLOCK_SHIFT
+#define BLOCK_SHIFT 12
+#endif
+#if BLOCK_SHIFT < 10 || BLOCK_SHIFT > 16
+#error "BLOCK_SHIFT must be between 10 (1 KiB blocks) and 16 (64 KiB blocks)"
+#endif
+
 /** Size of a disk block in bytes */
-#define BLOCK_SIZE 4096
+#define BLOCK_SIZE (1 << BLOCK_SHIFT)
+
+/*
+ * A virtual disk is either one image file, or several image files striped
+ * together (RAID-0): @diskname then lists them separated by commas, in the same
+ * order each time, optionally followed by ":<stripe unit>", e.g.
+ * "/nvme0/fs.img,/nvme1/fs.img:32". Consecutive groups of stripe unit blocks
+ * (16 by default) go to the image files in turn, and the blocks of a
+ * multi-block transfer that are stored in different image files are
+ * transferred in parallel.
+ */
+
+/**
+ * block_disk_create - Create virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @bcount: Number of blocks of the virtual disk
+ *
+ * Create virtual disk file @diskname, or truncate it if it already exists, so
+ * that it contains @bcount blocks. The file is sized with ftruncate(): blocks
+ * read back as zeros until they are written and do not use any space on the
+ * host's file system. The image files of a striped disk each get the same whole
+ * number of stripes, which may round the disk up to more than @bcount blocks.
+ *
+ * Return: -1 if @diskname is invalid, or if the virtual disk file cannot be
+ * created or resized. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t bcount);
 
 /**
  * block_disk_open - Open virtual disk file
@@ -19,10 +57,39 @@
  */
 int block_disk_open(const char *diskname);
 
+/** block_disk_open_flags() flag: bypass the host's page cache */
+#define BLOCK_DISK_DIRECT 0x1
+/** block_disk_open_flags() flag: back the buffers with huge pages if possible */
+#define BLOCK_DISK_HUGEPAGES 0x2
+
+/**
+ * block_disk_open_flags - Open virtual disk file with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of %BLOCK_DISK_* flags
+ *
+ * Same as block_disk_open(), with options. With %BLOCK_DISK_DIRECT, blocks
+ * are transferred with O_DIRECT and are not cached by the host: only the
+ * block cache holds them, and the latency of each access does not depend on the
+ * host's memory pressure. Buffers read into that are not aligned on the I/O
+ * size of the host's file system (at least 4 KiB), unlike the ones of
+ * block_buffer_get(), are then filled through an aligned buffer.
+ * With %BLOCK_DISK_HUGEPAGES, the buffers of block_buffer_get() and the
+ * aligned copies are backed by huge pages when the host has some available.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * (e.g., the host's file system does not support O_DIRECT) or is already
+ * open, or if %BLOCK_DISK_DIRECT is requested with blocks smaller than 4 KiB.
+ * 0 otherwise.
+ */
+int block_disk_open_flags(const char *diskname, int flags);
+
 /**
  * block_disk_close - Close virtual disk file
  *
- * Return: -1 if there was no virtual disk file opened. 0 otherwise.
+ * Write the dirty blocks back to the virtual disk, then close it.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if some blocks could
+ * not be written back since the last block_sync(). 0 otherwise.
  */
 int block_disk_close(void);
 
@@ -40,10 +107,10 @@ int block_disk_count(void);
  * @buf: Data buffer to write in the block
  *
  * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
- * block @block.
+ * block @block. The block is written to the block cache, and written back to
+ * the virtual disk later, as described in block_sync().
  *
- * Return: -1 if @block is out of bounds or inaccessible or if the writing
- * operation fails. 0 otherwise.
+ * Return: -1 if @block is out of bounds or inaccessible. 0 otherwise.
  */
 int block_write(size_t block, const void *buf);
 
@@ -60,5 +127,158 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_range - Write contiguous blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count times %BLOCK_SIZE bytes) in the
+ * virtual disk's blocks @block to @block + @count - 1. Like block_write(), the
+ * blocks are written back later.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible. 0
+ * otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_sync - Write the dirty blocks back to disk
+ *
+ * Written blocks stay dirty in the block cache until a background thread
+ * writes them back to the virtual disk: once they have been dirty for a second,
+ * or as soon as a quarter of the cache is dirty. Adjacent dirty blocks are
+ * written back with a single I/O request. Writers only wait for the write-back
+ * once half of the cache is dirty. block_sync() waits until no block is dirty
+ * anymore.
+ *
+ * Return: -1 if some blocks could not be written back since the last
+ * block_sync(), in which case their content is lost. 0 otherwise.
+ */
+int block_sync(void);
+
+/**
+ * block_read_range - Read contiguous blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count times %BLOCK_SIZE bytes) into buffer @buf, with a single I/O
+ * request.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/** block_advise() advice: the blocks will be read soon */
+#define BLOCK_ADVISE_WILLNEED 1
+/** block_advise() advice: the blocks will not be read again soon */
+#define BLOCK_ADVISE_DONTNEED 2
+/** block_advise() advice: the blocks are read once */
+#define BLOCK_ADVISE_NOREUSE 3
+
+/**
+ * block_advise - Advise the block cache about the use of blocks
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @advice: One of the %BLOCK_ADVISE_* values
+ *
+ * The most recently used blocks are cached in memory. With
+ * %BLOCK_ADVISE_WILLNEED, blocks @block to @block + @count - 1 are read into
+ * the cache in the background. With %BLOCK_ADVISE_DONTNEED, they are dropped
+ * from the cache, and with %BLOCK_ADVISE_NOREUSE, they are the first ones to
+ * be evicted from it, which dirty blocks only are once written back. Both are
+ * also passed on to the host's page cache, unless the disk was opened with
+ * %BLOCK_DISK_DIRECT.
+ *
+ * Return: -1 if any of the blocks is out of bounds, or if @advice is invalid.
+ * 0 otherwise.
+ */
+int block_advise(size_t block, size_t count, int advice);
+
+/**
+ * block_stream - Set the stream of the calling thread's requests
+ * @stream: Stream of the requests, such as a file descriptor
+ *
+ * The transfers of all threads go through an elevator that serves them by
+ * increasing block and merges adjacent ones. It shares the disk between
+ * streams: one that transferred many blocks in a row yields to the others.
+ * Set the stream of the subsequent requests of the calling thread, and of the
+ * prefetches it advises (see block_advise()). Threads start with stream 0.
+ */
+void block_stream(int stream);
+
+/**
+ * block_discard - Discard blocks of the disk
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Tell the virtual disk that the content of blocks @block to @block + @count -
+ * 1 is not needed anymore: their cached copies are dropped, even the dirty
+ * ones, and the blocks are punched out of the virtual disk file, which then
+ * takes less space on the host. Discarded blocks read as zeros.
+ *
+ * Return: -1 if any of the blocks is out of bounds, or if the host's file
+ * system cannot punch holes in files. 0 otherwise.
+ */
+int block_discard(size_t block, size_t count);
+
+/**
+ * block_map - Map blocks of the disk in memory
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @writable: Whether the mapping can be written to
+ *
+ * Map blocks @block to @block + @count - 1 of the virtual disk in memory,
+ * straight from the virtual disk file, so that they can be accessed without
+ * any copy. Only blocks accessed through the host's page cache, from a single
+ * virtual disk file and at an offset aligned on the host's pages in it, can
+ * be mapped. The dirty blocks of the cache are written back first. Writes
+ * through the mapping reach the virtual disk file directly. Until the blocks
+ * of a writable mapping are unmapped, they are not cached: block_read() reads
+ * them through the mapped file, and block_write() writes them through, so
+ * both stay coherent with the mapping. The ones of a read-only mapping are
+ * only visible in it once written back.
+ *
+ * Return: the address of the mapping, or NULL if the blocks are out of bounds
+ * or cannot be mapped.
+ */
+void *block_map(size_t block, size_t count, int writable);
+
+/**
+ * block_unmap - Unmap blocks of the disk
+ * @addr: Address returned by block_map()
+ * @block: Index of the first block mapped
+ * @count: Number of blocks mapped
+ * @writable: Whether the mapping could be written to
+ *
+ * Unmap the blocks mapped by block_map(), which are cached again once no
+ * writable mapping shows them.
+ *
+ * Return: -1 if the blocks are out of bounds, or if @addr is not a mapping of
+ * @count blocks. 0 otherwise.
+ */
+int block_unmap(void *addr, size_t block, size_t count, int writable);
+
+/**
+ * block_buffer_get - Get a block buffer
+ *
+ * Get a buffer of %BLOCK_SIZE bytes aligned on %BLOCK_SIZE, which can be
+ * transferred to and from a disk opened with %BLOCK_DISK_DIRECT without a copy.
+ * Buffers come from a pool that grows as needed and is shared by all threads.
+ *
+ * Return: NULL if memory cannot be allocated. Otherwise the buffer, with an
+ * undefined content.
+ */
+void *block_buffer_get(void);
+
+/**
+ * block_buffer_put - Return a block buffer to the pool
+ * @buf: Buffer returned by block_buffer_get(), or NULL
+ */
+void block_buffer_put(void *buf);
+
 #endif /* _DISK_H */
 
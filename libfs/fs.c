@@ -1,461 +1,3614 @@
-#include <assert.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-
-#include "disk.h"
-#include "fs.h"
-
-struct superblock {
-	uint64_t signature;
-	uint16_t total_blocks;
-	uint16_t rootdir_blk_index;
-	uint16_t datablk_start_index;
-	uint16_t datablk_amount;
-	uint8_t  fat_amount;
-	uint8_t  unused[4079];
-}__attribute__((packed));
-
-uint16_t FAT[8192];
-
-struct entry {
-	uint8_t  filename[FS_FILENAME_LEN];
-	uint32_t file_size;
-	uint16_t datablk_start_index;
-	uint8_t  unused[10];
-}__attribute__((packed));
-
-struct root_directory {
-	struct entry entry_array[FS_FILE_MAX_COUNT];
-}__attribute__((packed));
-
-struct file_descriptor {
-	struct entry *entry;
-	size_t offset;
-};
-
-// global
-struct superblock superblock;
-struct root_directory root_directory;
-struct file_descriptor fd_table[FS_OPEN_MAX_COUNT];
-uint8_t bounce[BLOCK_SIZE];
-
-// helper functs
-uint16_t FAT_iterator(uint16_t block_index, uint16_t count)
-{
-	for (uint16_t i = 0; i < count; ++i) {
-		block_index = FAT[block_index];
-	}
-	return block_index;
-}
-
-int block_create(int fd){
-	int index = 0;
-	for (int i = 0; i < superblock.fat_amount * 2048; i++ ) {
-		if (FAT[i] == 0) {
-			index = i;
-			break;
-		}
-		if (FAT[i] != 0 && i == (superblock.fat_amount*2048) -1) {
-			return -1;
-		}
-	}
-	fd_table[fd].entry->datablk_start_index = index;
-	FAT[index] = 0xFFFF;
-	return index;
-}
-
-int rdir_free_blocks() {
-	int counter = FS_FILE_MAX_COUNT;
-	for (int i = 0; i <FS_FILE_MAX_COUNT; i++) {
-		if (root_directory.entry_array[i].filename[0] == '\0') {
-			continue;
-		}else {
-		counter --;
-		}
-	}
-	return counter;
-}
-
-int fat_free_blocks() {
-	int counter = superblock.datablk_amount;
-	for (int i = 0; i <superblock.datablk_amount; i++) {
-		if (FAT[i] == '\0') {
-			continue;
-		}else {
-			counter --;
-		}
-	}
-	return counter;
-}
-
-int fs_mount(const char *diskname)
-{
-	int opendisk = block_disk_open(diskname);
-	int error_flag = 0;
-	if (opendisk == - 1) {
-		return -1;	
-	}
-	error_flag = block_read(0, &superblock);
-	if (error_flag != 0) {
-		return -1;
-	}
-
-	error_flag = block_read(superblock.rootdir_blk_index, &root_directory);
-	if (error_flag != 0) {
-		return -1;
-	}
-
-	for ( int i = 0; i < superblock.fat_amount; ++i) {
-		error_flag = block_read(i+1, &(FAT[(i * BLOCK_SIZE/2)]));
-		if (error_flag != 0) {
-			return -1;
-		}
-	}
-	// check signature == ECS150FS
-	if (superblock.signature != 0x5346303531534345) {
-		return -1;
-	}
-	return 0;
-}
-
-int fs_umount(void)
-{
-	// No FS mounted
-	if (!superblock.signature || superblock.signature != 0x5346303531534345) {
-		return -1;
-	}
-	int error_flag = 0;
-	error_flag = block_write(superblock.rootdir_blk_index, &root_directory);
-	if (error_flag != 0) {
-		return -1;
-	}
-	for (int i = 0; i < superblock.fat_amount; ++i) {
-		error_flag = block_write(i + 1, &(FAT[i * (BLOCK_SIZE/2)]));
-		if (error_flag != 0) {
-			return -1;
-		}
-	}
-
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
-		if (fd_table[i].entry != NULL){
-			return -1;
-		}
-	}
-	superblock = (const struct superblock){ 0 };
-	memset(FAT, 0, sizeof(FAT));
-	root_directory = (const struct root_directory){ 0 };
-	memset(bounce, 0, sizeof(bounce));
-	return 0;
-}
-
-int fs_info(void)
-{
-	int rdir_free = rdir_free_blocks();
-	int fat_free = fat_free_blocks();
-	fprintf(stdout, "FS Info:\n");
-	fprintf(stdout, "total_blk_count=%d\n",		superblock.total_blocks);
-	fprintf(stdout, "fat_blk_count=%d\n",		superblock.fat_amount);
-	fprintf(stdout, "rdir_blk=%d\n",		superblock.rootdir_blk_index);
-	fprintf(stdout, "data_blk=%d\n",		superblock.datablk_start_index);
-	fprintf(stdout, "data_blk_count=%d\n",		superblock.datablk_amount);
-	fprintf(stdout, "fat_free_ratio=%d/%d\n",	fat_free,	superblock.datablk_amount); 
-	fprintf(stdout, "rdir_free_ratio=%d/%d\n",	rdir_free,	FS_FILE_MAX_COUNT);
-	return 0;
-}
-
-int fs_create(const char *filename)
-{
-	// FS not mounted
-	if (!superblock.signature || superblock.signature != 0x5346303531534345) {
-		return -1;
-	}
-	// filename invalid or filename is too long
-	int filename_length = strlen(filename);
-	if (!filename || filename_length >= FS_FILENAME_LEN) {
-		return -1;
-	}
-	int index = 0;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-		if (root_directory.entry_array[i].filename[0] == '\0') {
-			index = i;
-			break;
-		}
-		// filename already exist
-		if (!strcmp(filename, (char*) root_directory.entry_array[i].filename)) {
-			return -1;
-		}
-	}
-	strcpy((char*)root_directory.entry_array[index].filename, filename);
-	root_directory.entry_array[index].file_size = 0;
-	root_directory.entry_array[index].datablk_start_index = 0xFFFF;  // FAT EOC = 0xFFFF
-	return 0;
-}
-
-int fs_delete(const char *filename)
-{
-	// FS not mounted
-	if (!superblock.signature || superblock.signature != 0x5346303531534345) {
-		return -1;
-	}
-	// filename is invalid
-	if (!filename || filename == NULL) {
-		return -1;
-	}
-	// check if filename is opened
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
-		if (!strcmp((char*)fd_table[i].entry->filename, filename)) {
-			return -1;
-		}
-	}
-	int index = -1;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-		if (strcmp((char*)root_directory.entry_array[i].filename, filename) == 0) {
-			index = i;
-			break;
-		}
-	}
-	// if no file named filename
-	if (index == -1) {
-		return -1;
-	}
-	root_directory.entry_array[index].filename[0] = '\0';
-	root_directory.entry_array[index].file_size = 0;
-	if (root_directory.entry_array[index].datablk_start_index != 0xffff) {
-		int delete_index = root_directory.entry_array[index].datablk_start_index;
-		while (delete_index != 0xffff) {
-			int FAT_num = FAT[delete_index];
-			FAT[delete_index] = 0x0;
-			delete_index = FAT_num;
-		}
-	}
-	root_directory.entry_array[index].datablk_start_index = '\0';
-	return 0;
-}
-
-int fs_ls(void)
-{
-	// FS not mounted
-	if (!superblock.signature || superblock.signature != 0x5346303531534345) {
-		return -1;
-	}
-	fprintf(stdout, "FS Ls:\n");
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		fprintf(stdout, "file: %s, size: %d, data_blk: %d\n", 
-			root_directory.entry_array[i].filename, 
-			root_directory.entry_array[i].file_size, 
-			root_directory.entry_array[i].datablk_start_index);
-	}
-	return 0;
-}
-
-int fs_open(const char *filename)
-{
-	// No FS mounted
-	if (!superblock.signature || superblock.signature != 0x5346303531534345) {
-		return -1;
-	}
-	// filename invalid
-	if (!filename || filename == NULL) {
-		return -1;
-	}
-	int fd_table_index;
-	int file_index = 0;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
-		if (strcmp((char*)root_directory.entry_array[i].filename, filename) == 0) {
-			file_index = i;
-			break;
-		}
-	}
-	for (int j = 0; j < FS_OPEN_MAX_COUNT; ++j) {
-		if (fd_table[j].entry == NULL) {
-			fd_table_index = j;
-			break;
-		}
-		// there are already %FS_OPEN_MAX_COUNT files currently open
-		if (j == FS_OPEN_MAX_COUNT) {
-			return -1;
-		}
-	}
-	fd_table[fd_table_index].entry = &(root_directory.entry_array[file_index]);
-	return fd_table_index;
-}
-
-int fs_close(int fd)
-{
-	// No FS mounted
-	if (!superblock.signature || superblock.signature != 0x5346303531534345) {
-		return -1;
-	}
-	// if file descriptor @fd is invalid (out of bounds or not currently open)
-	if (fd >= FS_OPEN_MAX_COUNT || !fd_table[fd].entry) {
-		return -1;
-	}
-	fd_table[fd].entry = NULL;
-	fd_table[fd].offset = 0;
-	return 0;
-}
-
-int fs_stat(int fd)
-{
-	// No FS mounted
-	if (!superblock.signature || superblock.signature != 0x5346303531534345) {
-		return -1;
-	}
-	// if file descriptor @fd is invalid (out of bounds or not currently open)
-	if (fd >= FS_OPEN_MAX_COUNT || !fd_table[fd].entry) {
-		return -1;
-	}
-	return fd_table[fd].entry -> file_size;
-}
-
-int fs_lseek(int fd, size_t offset)
-{
-	// No FS mounted
-	if (!superblock.signature || superblock.signature != 0x5346303531534345) {
-		return -1;
-	}
-	// if file descriptor @fd is invalid (out of bounds or not currently open)
-	if (fd >= FS_OPEN_MAX_COUNT || !fd_table[fd].entry) {
-		return -1;
-	}
-	// if @offset is larger than the current file size
-	size_t current_file_size = fs_stat(fd);
-	if (current_file_size < offset) {
-		return -1;
-	}
-	fd_table[fd].offset = offset;
-	return 0;
-}
-
-int fs_write(int fd, void *buf, size_t count)
-{
-	if (fd >= FS_OPEN_MAX_COUNT ) { 
-		return -1;
-	}
-	if (superblock.signature != 0x5346303531534345) {
-		return -1;
-	}
-	if (fd_table[fd].entry == NULL ) {
-		return -1;
-	}
-	if (buf == NULL) {
-		return -1;
-	}
-        if (count == 0){
-		return 0;
-	}
-	uint32_t total_written_count = 0;
-	uint16_t offset_in_one_block = fd_table[fd].offset % BLOCK_SIZE;
-	uint16_t current_index;
-	uint16_t iteration_written_count;
-	int finish_flag = 0;
-	// checkif exist data block.
-	if (fd_table[fd].entry->datablk_start_index == 0xFFFF) {
-		current_index = block_create(fd);
-	} else {
-		current_index = FAT_iterator(fd_table[fd].entry->datablk_start_index, fd_table[fd].offset / BLOCK_SIZE);
-	}
-	while (finish_flag != 1) {
-		if ( count - total_written_count >= (unsigned int)BLOCK_SIZE - offset_in_one_block) {
-				iteration_written_count = (unsigned int)BLOCK_SIZE - offset_in_one_block;
-		} else {
-				iteration_written_count = count - total_written_count;
-		}
-		//read whole block into bounce
-		block_read(current_index +superblock.datablk_start_index, &bounce );
-		//copy the aimed area of data into bounce correct position
-		memcpy(&bounce[offset_in_one_block], buf+total_written_count, iteration_written_count);
-		//write back bounce into datablock
-
-		block_write(current_index +superblock.datablk_start_index, &bounce );
-		//iterate through FAT[] or create new FAT entry
-		if (FAT[current_index] == 0xFFFF) {
-			int free_index;
-			for (int i = 1; i < superblock.fat_amount * (BLOCK_SIZE/2); i++) {
-				if (FAT[i] == 0){
-					free_index = i;
-					break;
-				}
-			}
-			FAT[current_index] = free_index;
-			FAT[free_index] = 0xFFFF;
-			current_index = free_index;
-		} else {
-			current_index = FAT_iterator(current_index, 1);
-		}
-		total_written_count += iteration_written_count;
-		//update file offset to the end of the current position
-		fd_table[fd].offset += iteration_written_count;
-		//since after 1st dblock, their offset are at the beginning of the block
-		offset_in_one_block = 0;
-
-		if(count - total_written_count == 0) {
-			finish_flag =1;
-		}
-	}
-	// update file size by using offset(end of the file)
-	if (fd_table[fd].entry->file_size < fd_table[fd].offset) {
-		fd_table[fd].entry->file_size = fd_table[fd].offset;
-	}
-	return total_written_count;
-}
-
-int fs_read(int fd, void *buf, size_t count)
-{
-	if (fd >= FS_OPEN_MAX_COUNT ) { 
-		return -1;
-	}
-	if (superblock.signature != 0x5346303531534345) {
-		return -1;
-	}
-	if (fd_table[fd].entry == NULL ) {
-		return -1;
-	}
-	if (buf == NULL) {
-		return -1;
-	}
-        if (count == 0){
-		return 0;
-	}
-	uint32_t total_read_count = 0;
-	uint16_t offset_in_one_block = fd_table[fd].offset % BLOCK_SIZE;
-	uint16_t current_index;
-	uint16_t iteration_read_count;
-	uint32_t file_size = fd_table[fd].entry->file_size - fd_table[fd].offset;
-	int finish_flag = 0;
-	if (fd_table[fd].entry->file_size == 0) {
-		finish_flag = 1;
-	}
-	current_index = FAT_iterator(fd_table[fd].entry->datablk_start_index, fd_table[fd].offset / BLOCK_SIZE);
-	while(finish_flag != 1) {
-		//In this way the amount of data each iteration will be restricted according to its size
-		if ( count - total_read_count >= (unsigned int)BLOCK_SIZE - offset_in_one_block) {
-				iteration_read_count = (unsigned int)BLOCK_SIZE - offset_in_one_block;
-		} else {
-				iteration_read_count = count - total_read_count;
-		}
-		// Handler small file if the file size is smaller than the iteration read count
-		if (iteration_read_count > file_size) {
-			iteration_read_count = file_size;
-		}
-		//read block into bounce buffer
-		block_read(current_index + superblock.datablk_start_index, &bounce);
-		//copy aimed area memory into buffer size : iteration__read_count position: offset_in_one_block
-		memcpy(buf + total_read_count, &bounce[offset_in_one_block], iteration_read_count);
-		total_read_count += iteration_read_count;
-		fd_table[fd].offset += iteration_read_count;
-		//for the following the offset in one block should be 0
-		offset_in_one_block = 0;
-		if (count - total_read_count == 0 ){
-			finish_flag = 1;
-		}
-		if (FAT[current_index] == 0xFFFF) {
-			break;
-		} else {
-			current_index = FAT_iterator(current_index,1);
-		}
-	}
-	return total_read_count;
-}
+#define _GNU_SOURCE /* for PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP */
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_trace.h"
+#include "lz.h"
+
+struct superblock {
+	uint64_t signature;
+	uint16_t total_blocks;
+	uint16_t rootdir_blk_index;
+	uint16_t datablk_start_index;
+	uint16_t datablk_amount;
+	uint8_t  fat_amount;
+	/* Number of free data blocks, only valid if state is FS_STATE_CLEAN */
+	uint16_t free_blk_count;
+	uint8_t  state;
+	/* log2 of the block size, 0 in images from other tools, which use
+	 * 4 KiB blocks */
+	uint8_t  block_shift;
+	uint8_t  unused[BLOCK_SIZE - 21];
+}__attribute__((packed));
+
+/* Superblock signature, "ECS150FS" */
+#define FS_SIGNATURE 0x5346303531534345
+
+/* Superblock states. Images from other tools leave the state at 0, which is
+ * handled as FS_STATE_DIRTY */
+#define FS_STATE_CLEAN 0x01	/* unmounted properly */
+#define FS_STATE_DIRTY 0x02	/* mounted, or not unmounted properly */
+
+/* FAT special values */
+#define FAT_FREE 0x0000
+#define FAT_MAPPED 0xFFFE
+#define FAT_EOC  0xFFFF
+
+/* FAT entries per FAT block, and most FAT blocks a FS can have */
+#define FAT_BLOCK_ENTRIES (BLOCK_SIZE / 2)
+#define FAT_MAX_AMOUNT ((FS_DATA_BLK_MAX_COUNT + FAT_BLOCK_ENTRIES - 1) / FAT_BLOCK_ENTRIES)
+
+// aligned, like the metadata below, so that direct I/O needs no copy, and
+// covering whole blocks
+uint16_t FAT[FAT_MAX_AMOUNT * FAT_BLOCK_ENTRIES] __attribute__((aligned(BLOCK_SIZE)));
+
+/* Number of links (FAT entries and directory entries) to each data block,
+ * rebuilt at mount time. A block linked more than once is shared between
+ * clones and must be copied before being modified. The map slots of
+ * deduplicated files can link one block far more than 65535 times. */
+uint32_t refcount[FS_DATA_BLK_MAX_COUNT];
+
+/* Entry flags */
+#define ENTRY_SHARED 0x01	/* file may share data blocks with clones */
+#define ENTRY_COMPRESSED 0x02	/* file content is stored compressed */
+#define ENTRY_DEDUP 0x04	/* file content is stored deduplicated */
+#define ENTRY_SPARSE 0x08	/* file content is stored through a map, with holes */
+/* Files whose content is stored through a map */
+#define ENTRY_MAPPED (ENTRY_DEDUP | ENTRY_SPARSE)
+
+struct entry {
+	uint8_t  filename[FS_FILENAME_LEN];
+	uint32_t file_size;
+	uint16_t datablk_start_index;
+	uint8_t  flags;
+	uint8_t  unused[9];
+}__attribute__((packed));
+
+/* The root directory takes several blocks when they are smaller than 4 KiB,
+ * and is padded to a whole block when they are larger */
+#define ROOTDIR_BLOCKS \
+	((FS_FILE_MAX_COUNT * sizeof(struct entry) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+struct root_directory {
+	struct entry entry_array[FS_FILE_MAX_COUNT];
+	uint8_t padding[ROOTDIR_BLOCKS * BLOCK_SIZE - FS_FILE_MAX_COUNT * sizeof(struct entry)];
+}__attribute__((packed));
+
+/* Compressed files are split in clusters of CLUSTER_SIZE bytes that are
+ * compressed independently and packed back to back in a stream. The stream
+ * follows an index block at the head of the FAT chain, which locates each
+ * cluster so that any offset can be read by decompressing a single cluster. */
+#define CLUSTER_SIZE (8 * BLOCK_SIZE)
+#define CLUSTER_MAX_COUNT (BLOCK_SIZE / 4 - 1)
+
+struct cluster_index {
+	/* Size of the compressed stream in bytes */
+	uint32_t stream_size;
+	/* Offset of each cluster in the stream */
+	uint32_t cluster_start[CLUSTER_MAX_COUNT];
+}__attribute__((packed));
+
+/* Mapped files hold a map in their FAT chain, with one slot per block of
+ * content: the data block that stores it, or 0 for a hole, which reads as
+ * zeros. Data blocks are marked as FAT_MAPPED in the FAT. The data blocks of
+ * deduplicated files are shared by all the slots of all the deduplicated files
+ * that have the same content, the ones of sparse files only between clones. */
+#define MAP_SLOT_COUNT (BLOCK_SIZE / 2)
+#define DEDUP_BUCKET_COUNT 4096
+
+/* Content hash of each mapped block, and hash table of the mapped blocks,
+ * rebuilt at mount time */
+uint64_t dedup_hash[FS_DATA_BLK_MAX_COUNT];
+uint16_t dedup_next[FS_DATA_BLK_MAX_COUNT];
+uint16_t dedup_bucket[DEDUP_BUCKET_COUNT];
+
+struct file_descriptor {
+	struct entry *entry;
+	size_t offset;
+	/* FS_OPEN_* flags */
+	int flags;
+	/* Access pattern advised: FS_ADVISE_NORMAL, _SEQUENTIAL or _RANDOM */
+	int pattern;
+	/* End of the content read ahead, with FS_ADVISE_SEQUENTIAL */
+	size_t readahead_end;
+	/* Range advised with FS_ADVISE_NOREUSE */
+	size_t noreuse_start, noreuse_end;
+};
+
+/* Content read ahead of sequential reads */
+#define READAHEAD_SIZE (32 * BLOCK_SIZE)
+
+// global
+struct superblock superblock __attribute__((aligned(BLOCK_SIZE)));
+struct root_directory root_directory __attribute__((aligned(BLOCK_SIZE)));
+struct file_descriptor fd_table[FS_OPEN_MAX_COUNT];
+
+/* Most mappings fs_mmap() keeps at once */
+#define MAPPING_MAX_COUNT 64
+
+/* Mapping of a file range returned by fs_mmap(): the disk blocks that hold it
+ * when they are contiguous, else a copy of the range */
+struct file_mapping {
+	/* Address returned by fs_mmap(), NULL if the slot is free */
+	uint8_t *addr;
+	struct entry *entry;
+	size_t offset;
+	size_t len;
+	/* FS_MMAP_* flags */
+	int flags;
+	/* Disk blocks mapped with block_map(), none if the range was copied */
+	size_t block;
+	size_t block_count;
+};
+
+struct file_mapping mappings[MAPPING_MAX_COUNT];
+/* Number of free data blocks */
+int fat_free_count;
+/* Whether the link counts of mapped blocks and dedup_hash are loaded */
+int map_loaded;
+
+/* Data written past the allocated blocks of plain files is buffered with its
+ * offset only, and its blocks are allocated when it is flushed, all at once:
+ * files then get runs of contiguous blocks whatever the order of the writes,
+ * and files deleted before being flushed never get any. Free blocks are
+ * reserved for the buffered data, so that flushing it cannot fail. */
+struct delalloc {
+	/* Content from offset @start of the file, a multiple of BLOCK_SIZE, to
+	 * its end, in a buffer of @capacity bytes */
+	uint8_t *data;
+	size_t start;
+	size_t size;
+	size_t capacity;
+};
+
+struct delalloc delayed[FS_FILE_MAX_COUNT];
+/* Bytes buffered, and data blocks reserved for them, over all files */
+size_t delalloc_size;
+int delalloc_blocks;
+
+/* Most bytes buffered before all files are flushed */
+#define DELALLOC_MAX_SIZE (4 * 1024 * 1024)
+
+/* With FS_MOUNT_DISCARD, data blocks freed since the metadata was last written
+ * back, one bit per block. They are discarded with the next write-back, in
+ * runs, unless they were allocated again meanwhile. */
+int discard_enabled;
+uint8_t discard_pending[(FS_DATA_BLK_MAX_COUNT + 7) / 8];
+int discard_count;
+/* Whether writing back failed when the blocks were written back before a
+ * discard, which is then reported by the next fs_sync() or fs_umount() */
+int writeback_error;
+
+/* Serializes the fs_*() functions, which all share the state above. It is
+ * recursive since some of them call others. */
+static pthread_mutex_t fs_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+/* Number of fs_*() calls in progress in the thread holding fs_lock */
+static int fs_lock_depth;
+
+static void fs_unlock(pthread_mutex_t **lock)
+{
+	// the block requests of the next call are not made for this one's file
+	// descriptor
+	if (--fs_lock_depth == 0) {
+		block_stream(0);
+	}
+	pthread_mutex_unlock(*lock);
+}
+
+/* Hold fs_lock until the enclosing function returns */
+#define FS_LOCK() \
+	pthread_mutex_t *fs_lock_held __attribute__((cleanup(fs_unlock))) = \
+		(pthread_mutex_lock(&fs_lock), fs_lock_depth++, &fs_lock)
+
+/* Appends through FS_OPEN_APPEND file descriptors to each file of the root
+ * directory. An appender reserves its range at the end of the file and gets
+ * its blocks allocated with fs_lock held, then copies its whole blocks without
+ * fs_lock, in parallel with the other appenders, and finally publishes its
+ * range. Ranges are published in the order they were reserved, so the file
+ * size never covers data that is still being copied. */
+struct append_state {
+	/* End of the ranges reserved, only valid while appenders are copying */
+	size_t reserved;
+	/* End of the ranges published */
+	size_t published;
+	/* Number of appenders between reservation and publication */
+	int copying;
+	/* Whether one of them failed, the file size then stops growing until
+	 * they are all done */
+	int failed;
+};
+
+struct append_state appends[FS_FILE_MAX_COUNT];
+/* Number of appenders copying, to any file */
+int appends_copying;
+/* Signaled when an appender publishes its range */
+static pthread_cond_t append_cond = PTHREAD_COND_INITIALIZER;
+
+// wait for the next append_cond signal, releasing fs_lock meanwhile: the
+// calling fs_*() function must hold it once
+static void append_cond_wait(void)
+{
+	assert(fs_lock_depth == 1);
+	fs_lock_depth--;
+	pthread_cond_wait(&append_cond, &fs_lock);
+	fs_lock_depth++;
+}
+
+// wait until no appender copies data to root directory entry @file, or to any
+// file if @file is -1, so that the blocks of the file(s) can be moved or freed
+static void append_wait(int file)
+{
+	while (file < 0 ? appends_copying : appends[file].copying) {
+		append_cond_wait();
+	}
+}
+
+/* Trace being recorded, NULL if not tracing */
+static FILE *trace_file;
+/* Time at which the trace started */
+static struct timespec trace_epoch;
+
+// whether the current call is to be recorded: the calls made by other fs_*()
+// functions are not, replaying the outer call makes them again
+static int trace_enabled(void)
+{
+	return trace_file && fs_lock_depth == 1;
+}
+
+// timestamp @record and append it to the trace, followed by @name and @name2
+static void trace_write(struct fs_trace_record *record, const char *name, const char *name2)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record->time = (now.tv_sec - trace_epoch.tv_sec) * 1000000000ULL
+		       + now.tv_nsec - trace_epoch.tv_nsec;
+	// longer names are invalid, they stay invalid when truncated
+	record->name_len = name ? strnlen(name, FS_FILENAME_LEN) : 0;
+	record->name2_len = name2 ? strnlen(name2, FS_FILENAME_LEN) : 0;
+	if (fwrite(record, sizeof(*record), 1, trace_file) != 1
+	    || fwrite(name, 1, record->name_len, trace_file) != record->name_len
+	    || fwrite(name2, 1, record->name2_len, trace_file) != record->name2_len) {
+		// a trace with missing calls would not replay the same workload
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+}
+
+// start recording a trace to host file @tracename
+static int trace_open(const char *tracename)
+{
+	struct fs_trace_header header = {
+		.magic = FS_TRACE_MAGIC,
+		.version = FS_TRACE_VERSION,
+	};
+	trace_file = fopen(tracename, "w");
+	if (!trace_file) {
+		return -1;
+	}
+	if (fwrite(&header, sizeof(header), 1, trace_file) != 1) {
+		fclose(trace_file);
+		trace_file = NULL;
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+	return 0;
+}
+
+// record a call to @op in the trace, if any
+static void trace(uint8_t op, int fd, size_t count, size_t offset, int arg,
+		  const char *name, const char *name2)
+{
+	if (!trace_enabled()) {
+		return;
+	}
+	struct fs_trace_record record = {
+		.offset = offset,
+		.count = count > UINT32_MAX ? UINT32_MAX : count,
+		.fd = fd,
+		.op = op,
+		.arg = arg,
+	};
+	trace_write(&record, name, name2);
+}
+
+// helper functs
+// set FAT entry @block to @value, keeping count of the free data blocks
+static void fat_set(uint16_t block, uint16_t value)
+{
+	if (block < superblock.datablk_amount) {
+		fat_free_count += (value == FAT_FREE) - (FAT[block] == FAT_FREE);
+		if (discard_enabled && value == FAT_FREE && FAT[block] != FAT_FREE
+		    && !(discard_pending[block / 8] & 1 << block % 8)) {
+			discard_pending[block / 8] |= 1 << block % 8;
+			discard_count++;
+		}
+	}
+	FAT[block] = value;
+}
+
+// whether @block is a valid link to a data block
+static int fat_is_block(uint16_t block)
+{
+	return block != 0 && block < superblock.datablk_amount;
+}
+
+// recount the links to each data block
+static void refcount_rebuild(void)
+{
+	memset(refcount, 0, sizeof(refcount));
+	for (int i = 1; i < superblock.datablk_amount; ++i) {
+		if (fat_is_block(FAT[i])) {
+			refcount[FAT[i]]++;
+		}
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		struct entry *entry = &root_directory.entry_array[i];
+		if (entry->filename[0] != '\0' && fat_is_block(entry->datablk_start_index)) {
+			refcount[entry->datablk_start_index]++;
+		}
+	}
+}
+
+// index of the root directory entry named @filename, -1 if none
+static int rdir_lookup(const char *filename)
+{
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		if (root_directory.entry_array[i].filename[0] != '\0'
+		    && !strcmp((char*)root_directory.entry_array[i].filename, filename)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// find a free data block, starting from @hint so that files grow into
+// contiguous runs whenever possible, -1 if the disk is full or its free blocks
+// are reserved for buffered data
+static int fat_alloc(uint16_t hint)
+{
+	if (fat_free_count <= delalloc_blocks) {
+		return -1;
+	}
+	// data block 0 is reserved
+	if (hint == 0 || hint >= superblock.datablk_amount) {
+		hint = 1;
+	}
+	for (int i = hint; i < superblock.datablk_amount; i++) {
+		if (FAT[i] == FAT_FREE) {
+			return i;
+		}
+	}
+	for (int i = 1; i < hint; i++) {
+		if (FAT[i] == FAT_FREE) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// whether @fd is an open file descriptor of the mounted file system
+static int fd_is_valid(int fd)
+{
+	return superblock.signature == FS_SIGNATURE && fd >= 0
+		&& fd < FS_OPEN_MAX_COUNT && fd_table[fd].entry != NULL;
+}
+
+// make the block requests of the current call, and the prefetches it advises,
+// for @fd, so that the disk scheduler shares the disk fairly between file
+// descriptors
+static void fd_stream(int fd)
+{
+	block_stream(fd + 1);
+}
+
+// whether the file described by @entry, or any file if @entry is NULL, is
+// mapped, only counting the mappings of disk blocks if @direct, and the ones
+// with all of the FS_MMAP_* flags @flags
+static int file_mapped(struct entry *entry, int direct, int flags)
+{
+	for (int i = 0; i < MAPPING_MAX_COUNT; ++i) {
+		struct file_mapping *m = &mappings[i];
+		if (m->addr && (!entry || m->entry == entry) && (!direct || m->block_count)
+		    && (m->flags & flags) == flags) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// make sure that the first @count blocks of the file described by @entry are
+// only linked once, by copying them from the first shared one on: since a FAT
+// block has a single successor, every block past a shared one is shared too
+static int file_unshare(struct entry *entry, size_t count)
+{
+	uint8_t data[BLOCK_SIZE];
+	uint16_t previous = FAT_EOC;
+	uint16_t block = entry->datablk_start_index;
+	int shared = 0;
+
+	for (size_t i = 0; i < count && fat_is_block(block); ++i) {
+		shared = shared || refcount[block] > 1;
+		if (shared) {
+			int copy = fat_alloc(previous == FAT_EOC ? block : previous + 1);
+			if (copy < 0) {
+				return -1;
+			}
+			if (block_read(block + superblock.datablk_start_index, data)
+			    || block_write(copy + superblock.datablk_start_index, data)) {
+				return -1;
+			}
+			// the copy takes over this file's link to the shared block
+			fat_set(copy, FAT[block]);
+			if (fat_is_block(FAT[block])) {
+				refcount[FAT[block]]++;
+			}
+			refcount[copy] = 1;
+			refcount[block]--;
+			if (previous == FAT_EOC) {
+				entry->datablk_start_index = copy;
+			} else {
+				fat_set(previous, copy);
+			}
+			block = copy;
+		}
+		previous = block;
+		block = FAT[block];
+	}
+	return 0;
+}
+
+// number of runs of contiguous blocks in the chain starting at @block
+static unsigned int chain_extents(uint16_t block)
+{
+	unsigned int extents = 0;
+	uint16_t prev = FAT_EOC;
+	for (int n = 0; fat_is_block(block) && n < superblock.datablk_amount; ++n) {
+		if (block != prev + 1) {
+			extents++;
+		}
+		prev = block;
+		block = FAT[block];
+	}
+	return extents;
+}
+
+// write @count bytes of @buf at @offset of the FAT chain of @entry,
+// extending the chain if needed
+static int chain_write(struct entry *entry, const void *buf, size_t count, size_t offset)
+{
+	uint32_t total_written_count = 0;
+	uint32_t offset_in_one_block = offset % BLOCK_SIZE;
+	uint16_t current_index = FAT_EOC;
+	uint32_t iteration_written_count;
+	uint8_t *bounce = block_buffer_get();
+	if (!bounce) {
+		return 0;
+	}
+	// copy-on-write: get private copies of the blocks about to be modified,
+	// including the current last one whose FAT entry changes if the file grows
+	if (file_unshare(entry, (offset + count + BLOCK_SIZE - 1) / BLOCK_SIZE)) {
+		block_buffer_put(bounce);
+		return 0;
+	}
+	// walk to the block holding the offset, current_index trails one block
+	// behind so that the chain can be extended once the walk reaches its end
+	uint16_t next_index = entry->datablk_start_index;
+	size_t i = 0;
+	for (; i < offset / BLOCK_SIZE && next_index != FAT_EOC; ++i) {
+		current_index = next_index;
+		next_index = FAT[current_index];
+	}
+	// a chain ending before the offset is extended with blocks of zeros
+	memset(bounce, 0, BLOCK_SIZE);
+	for (; i < offset / BLOCK_SIZE; ++i) {
+		int free_index = fat_alloc(current_index + 1);
+		if (free_index < 0
+		    || block_write(free_index + superblock.datablk_start_index, bounce)) {
+			block_buffer_put(bounce);
+			return 0;
+		}
+		fat_set(free_index, FAT_EOC);
+		refcount[free_index] = 1;
+		if (current_index == FAT_EOC) {
+			entry->datablk_start_index = free_index;
+		} else {
+			fat_set(current_index, free_index);
+		}
+		current_index = free_index;
+	}
+	while (total_written_count < count) {
+		int fresh_block = 0;
+		if (next_index == FAT_EOC) {
+			int free_index = fat_alloc(current_index + 1);
+			if (free_index < 0) {
+				// disk is full, write as many bytes as possible
+				break;
+			}
+			fat_set(free_index, FAT_EOC);
+			refcount[free_index] = 1;
+			if (current_index == FAT_EOC) {
+				entry->datablk_start_index = free_index;
+			} else {
+				fat_set(current_index, free_index);
+			}
+			next_index = free_index;
+			fresh_block = 1;
+		}
+		current_index = next_index;
+		if ( count - total_written_count >= (unsigned int)BLOCK_SIZE - offset_in_one_block) {
+				iteration_written_count = (unsigned int)BLOCK_SIZE - offset_in_one_block;
+		} else {
+				iteration_written_count = count - total_written_count;
+		}
+		if (iteration_written_count == BLOCK_SIZE) {
+			// whole blocks: batch the physically contiguous ones, extending
+			// the chain in place while the following block is free and not
+			// reserved for buffered data
+			uint16_t first_index = current_index;
+			size_t run = 1;
+			while (count - total_written_count - run * BLOCK_SIZE >= BLOCK_SIZE) {
+				uint16_t following = current_index + 1;
+				if (FAT[current_index] == FAT_EOC && following < superblock.datablk_amount
+				    && FAT[following] == FAT_FREE && fat_free_count > delalloc_blocks) {
+					fat_set(current_index, following);
+					fat_set(following, FAT_EOC);
+					refcount[following] = 1;
+				} else if (FAT[current_index] != following) {
+					break;
+				}
+				current_index = following;
+				run++;
+			}
+			if (block_write_range(first_index + superblock.datablk_start_index, run,
+					      (const uint8_t *)buf + total_written_count)) {
+				break;
+			}
+			total_written_count += run * BLOCK_SIZE;
+		} else {
+			if (fresh_block) {
+				// a freshly allocated block holds no file data yet
+				memset(bounce, 0, BLOCK_SIZE);
+			} else {
+				//read whole block into bounce
+				block_read(current_index + superblock.datablk_start_index, bounce);
+			}
+			//copy the aimed area of data into bounce correct position
+			memcpy(&bounce[offset_in_one_block], (const uint8_t *)buf + total_written_count,
+			       iteration_written_count);
+			//write back bounce into datablock
+			if (block_write(current_index + superblock.datablk_start_index, bounce)) {
+				break;
+			}
+			total_written_count += iteration_written_count;
+		}
+		next_index = FAT[current_index];
+		//since after 1st dblock, their offset are at the beginning of the block
+		offset_in_one_block = 0;
+	}
+	block_buffer_put(bounce);
+	return total_written_count;
+}
+
+// read up to @count bytes at @offset of the FAT chain of @entry into @buf
+static int chain_read(struct entry *entry, void *buf, size_t count, size_t offset)
+{
+	// bounce buffer from the pool, taken when the first partial block is read
+	uint8_t *block = NULL;
+	uint32_t total_read_count = 0;
+	uint32_t offset_in_one_block = offset % BLOCK_SIZE;
+	uint32_t iteration_read_count;
+	uint16_t current_index = entry->datablk_start_index;
+	for (size_t i = 0; i < offset / BLOCK_SIZE && current_index != FAT_EOC; ++i) {
+		current_index = FAT[current_index];
+	}
+	while (total_read_count < count) {
+		if (current_index == FAT_EOC || current_index >= superblock.datablk_amount) {
+			// chain shorter than the file size
+			break;
+		}
+		if ( count - total_read_count >= (unsigned int)BLOCK_SIZE - offset_in_one_block) {
+				iteration_read_count = (unsigned int)BLOCK_SIZE - offset_in_one_block;
+		} else {
+				iteration_read_count = count - total_read_count;
+		}
+		if (iteration_read_count == BLOCK_SIZE) {
+			// whole blocks: batch the physically contiguous ones and read
+			// them straight into the caller's buffer
+			uint16_t first_index = current_index;
+			size_t run = 1;
+			while (count - total_read_count - run * BLOCK_SIZE >= BLOCK_SIZE
+			       && FAT[current_index] == current_index + 1) {
+				current_index++;
+				run++;
+			}
+			if (block_read_range(first_index + superblock.datablk_start_index, run,
+					     (uint8_t *)buf + total_read_count)) {
+				break;
+			}
+			total_read_count += run * BLOCK_SIZE;
+		} else {
+			//read block into bounce buffer
+			if ((!block && !(block = block_buffer_get()))
+			    || block_read(current_index + superblock.datablk_start_index, block)) {
+				break;
+			}
+			//copy aimed area memory into buffer size : iteration__read_count position: offset_in_one_block
+			memcpy((uint8_t *)buf + total_read_count, &block[offset_in_one_block], iteration_read_count);
+			total_read_count += iteration_read_count;
+		}
+		//for the following the offset in one block should be 0
+		offset_in_one_block = 0;
+		current_index = FAT[current_index];
+	}
+	block_buffer_put(block);
+	return total_read_count;
+}
+
+int rdir_free_blocks() {
+	int counter = FS_FILE_MAX_COUNT;
+	for (int i = 0; i <FS_FILE_MAX_COUNT; i++) {
+		if (root_directory.entry_array[i].filename[0] == '\0') {
+			continue;
+		}else {
+		counter --;
+		}
+	}
+	return counter;
+}
+
+int fat_free_blocks() {
+	int counter = superblock.datablk_amount;
+	for (int i = 0; i <superblock.datablk_amount; i++) {
+		if (FAT[i] == '\0') {
+			continue;
+		}else {
+			counter --;
+		}
+	}
+	return counter;
+}
+
+// drop one link to @block, freeing it and the rest of its chain when they
+// are no longer linked
+static void chain_release(uint16_t block)
+{
+	while (fat_is_block(block) && --refcount[block] == 0) {
+		uint16_t next = FAT[block];
+		fat_set(block, FAT_FREE);
+		block = next;
+	}
+}
+
+// cut the FAT chain of @entry after its first @count blocks
+static void chain_truncate(struct entry *entry, size_t count)
+{
+	uint16_t block = entry->datablk_start_index;
+	if (count == 0) {
+		entry->datablk_start_index = FAT_EOC;
+		chain_release(block);
+		return;
+	}
+	for (size_t i = 1; i < count && fat_is_block(block); ++i) {
+		block = FAT[block];
+	}
+	if (fat_is_block(block) && FAT[block] != FAT_EOC) {
+		uint16_t rest = FAT[block];
+		fat_set(block, FAT_EOC);
+		chain_release(rest);
+	}
+}
+
+// make the FAT chain of @entry at least @count blocks long, allocating the
+// missing blocks right after its last one so that they are contiguous
+// whenever possible
+static int chain_extend(struct entry *entry, size_t count)
+{
+	uint16_t last = FAT_EOC;
+	uint16_t block = entry->datablk_start_index;
+	size_t i = 0;
+	for (; i < count && fat_is_block(block); ++i) {
+		last = block;
+		block = FAT[block];
+	}
+	for (; i < count; ++i) {
+		int free_index = fat_alloc(last == FAT_EOC ? 0 : last + 1);
+		if (free_index < 0) {
+			return -1;
+		}
+		fat_set(free_index, FAT_EOC);
+		refcount[free_index] = 1;
+		if (last == FAT_EOC) {
+			entry->datablk_start_index = free_index;
+		} else {
+			fat_set(last, free_index);
+		}
+		last = free_index;
+	}
+	return 0;
+}
+
+// find the longest run of free data blocks, up to @count blocks long, and set
+// @length to its length: the run starting at @hint if it is long enough, else
+// the first one that is, -1 if the disk is full
+static int fat_alloc_run(uint16_t hint, size_t count, size_t *length)
+{
+	size_t best_length = 0;
+	int best = -1;
+	if (hint > 0 && hint < superblock.datablk_amount) {
+		size_t n = 0;
+		while (n < count && hint + n < superblock.datablk_amount
+		       && FAT[hint + n] == FAT_FREE) {
+			n++;
+		}
+		if (n == count) {
+			*length = n;
+			return hint;
+		}
+		best_length = n;
+		best = n ? hint : -1;
+	}
+	// data block 0 is reserved
+	for (int i = 1; i < superblock.datablk_amount && best_length < count;) {
+		if (FAT[i] != FAT_FREE) {
+			i++;
+			continue;
+		}
+		size_t n = 0;
+		while (n < count && i + n < superblock.datablk_amount && FAT[i + n] == FAT_FREE) {
+			n++;
+		}
+		if (n > best_length) {
+			best_length = n;
+			best = i;
+		}
+		i += n;
+	}
+	*length = best_length;
+	return best;
+}
+
+// allocate the blocks of the data buffered for the file described by @entry,
+// and write it
+static int delalloc_flush(struct entry *entry)
+{
+	struct delalloc *d = &delayed[entry - root_directory.entry_array];
+	if (!d->size) {
+		return 0;
+	}
+	size_t block_count = (d->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	// the blocks reserved are the ones allocated now
+	delalloc_blocks -= block_count;
+	delalloc_size -= d->size;
+
+	// the chain was made private when the data was buffered
+	uint16_t last = FAT_EOC;
+	uint16_t block = entry->datablk_start_index;
+	for (size_t i = 0; i < d->start / BLOCK_SIZE && fat_is_block(block); ++i) {
+		last = block;
+		block = FAT[block];
+	}
+	size_t done = 0;
+	int error = 0;
+	while (done < block_count && !error) {
+		size_t run;
+		int first = fat_alloc_run(last == FAT_EOC ? 0 : last + 1, block_count - done, &run);
+		if (first < 0) {
+			error = 1;
+			break;
+		}
+		for (size_t i = 0; i < run; ++i) {
+			fat_set(first + i, i + 1 < run ? first + i + 1 : FAT_EOC);
+			refcount[first + i] = 1;
+		}
+		if (last == FAT_EOC) {
+			entry->datablk_start_index = first;
+		} else {
+			fat_set(last, first);
+		}
+		last = first + run - 1;
+		// the buffer is zeroed past the data, up to a whole block
+		error = block_write_range(first + superblock.datablk_start_index, run,
+					  d->data + done * BLOCK_SIZE);
+		done += run;
+	}
+	if (error && entry->file_size > d->start + done * BLOCK_SIZE) {
+		// the rest of the data is lost
+		entry->file_size = d->start + done * BLOCK_SIZE;
+	}
+	free(d->data);
+	*d = (const struct delalloc){ 0 };
+	return error ? -1 : 0;
+}
+
+// flush the data buffered for all the files, in one pass
+static int delalloc_flush_all(void)
+{
+	int error = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT && delalloc_size; ++i) {
+		if (delalloc_flush(&root_directory.entry_array[i])) {
+			error = -1;
+		}
+	}
+	return error;
+}
+
+// drop the data buffered for the file described by @entry, which is deleted
+static void delalloc_discard(struct entry *entry)
+{
+	struct delalloc *d = &delayed[entry - root_directory.entry_array];
+	delalloc_blocks -= (d->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	delalloc_size -= d->size;
+	free(d->data);
+	*d = (const struct delalloc){ 0 };
+}
+
+// write @count bytes of @buf at @offset of the plain file described by
+// @entry: in place within its allocated blocks, into its buffer past them
+static int delalloc_write(struct entry *entry, const void *buf, size_t count, size_t offset)
+{
+	struct delalloc *d = &delayed[entry - root_directory.entry_array];
+	size_t allocated = d->size ? d->start
+		: (entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	// writes leaving a hole fill it with blocks of zeros right away
+	if (offset + count <= allocated || offset > entry->file_size) {
+		return chain_write(entry, buf, count, offset);
+	}
+	size_t head = offset < allocated ? allocated - offset : 0;
+	if (head) {
+		size_t written_count = chain_write(entry, buf, head, offset);
+		if (written_count < head) {
+			return written_count;
+		}
+	} else if ((entry->flags & ENTRY_SHARED)
+		   && file_unshare(entry, allocated / BLOCK_SIZE)) {
+		// the FAT entry of the last block changes at flush time
+		return -1;
+	}
+	size_t start = offset + head;
+	count -= head;
+	if (!d->size) {
+		d->start = allocated;
+	}
+	size_t end = start - d->start + count;
+	size_t size = end > d->size ? end : d->size;
+	if (delalloc_size + size - d->size > DELALLOC_MAX_SIZE) {
+		// flushing makes room, larger writes are not buffered
+		delalloc_flush_all();
+		int written_count = count > DELALLOC_MAX_SIZE
+			? chain_write(entry, (const uint8_t *)buf + head, count, start)
+			: delalloc_write(entry, (const uint8_t *)buf + head, count, start);
+		return written_count < 0 ? (int)head : (int)head + written_count;
+	}
+
+	// only buffer as much as the free blocks left can hold
+	size_t reserved = (d->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t available = reserved
+		+ (fat_free_count > delalloc_blocks ? fat_free_count - delalloc_blocks : 0);
+	if (size > available * BLOCK_SIZE) {
+		size = available * BLOCK_SIZE;
+		if (size <= start - d->start) {
+			return head;
+		}
+		count = size - (start - d->start);
+		end = size;
+	}
+	size_t capacity = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+	if (capacity > d->capacity) {
+		if (capacity < 2 * d->capacity) {
+			capacity = 2 * d->capacity;
+		}
+		uint8_t *data = realloc(d->data, capacity);
+		if (!data) {
+			return head;
+		}
+		memset(data + d->capacity, 0, capacity - d->capacity);
+		d->data = data;
+		d->capacity = capacity;
+	}
+	memcpy(d->data + (start - d->start), (const uint8_t *)buf + head, count);
+	delalloc_blocks += (size + BLOCK_SIZE - 1) / BLOCK_SIZE - reserved;
+	delalloc_size += size - d->size;
+	d->size = size;
+	return head + count;
+}
+
+// read @count bytes at @offset of the plain file described by @entry, which
+// are all within its size, from its allocated blocks and from its buffer
+static int delalloc_read(struct entry *entry, void *buf, size_t count, size_t offset)
+{
+	struct delalloc *d = &delayed[entry - root_directory.entry_array];
+	if (!d->size || offset + count <= d->start) {
+		return chain_read(entry, buf, count, offset);
+	}
+	size_t head = offset < d->start ? d->start - offset : 0;
+	if (head) {
+		size_t read_count = chain_read(entry, buf, head, offset);
+		if (read_count < head) {
+			return read_count;
+		}
+	}
+	memcpy((uint8_t *)buf + head, d->data + (offset + head - d->start), count - head);
+	return count;
+}
+
+// link the file described by @dst, which is empty, to the chain of the one
+// described by @src: both files then share its blocks, which get copied on
+// write
+static void chain_share(struct entry *src, struct entry *dst)
+{
+	dst->file_size = src->file_size;
+	dst->datablk_start_index = src->datablk_start_index;
+	if (fat_is_block(src->datablk_start_index)) {
+		refcount[src->datablk_start_index]++;
+	}
+	src->flags |= ENTRY_SHARED;
+	dst->flags = src->flags;
+}
+
+// compressed size of cluster @i of the compressed file described by @entry
+static uint32_t cluster_length(struct entry *entry, const struct cluster_index *index, uint32_t i)
+{
+	uint32_t cluster_count = (entry->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+	uint32_t end = i + 1 < cluster_count ? index->cluster_start[i + 1] : index->stream_size;
+	return end - index->cluster_start[i];
+}
+
+// decompress cluster @i, @length bytes long, of the compressed file described
+// by @entry into @data
+static int cluster_load(struct entry *entry, const struct cluster_index *index,
+			uint32_t i, uint8_t *data, uint32_t length)
+{
+	uint32_t packed_length = cluster_length(entry, index, i);
+	if (packed_length > length) {
+		return -1;
+	}
+	// clusters that do not compress are stored as is
+	if (packed_length == length) {
+		int read_count = chain_read(entry, data, length, BLOCK_SIZE + index->cluster_start[i]);
+		return (uint32_t)read_count == length ? 0 : -1;
+	}
+	uint8_t *packed = malloc(packed_length);
+	if (!packed) {
+		return -1;
+	}
+	int ret = -1;
+	if ((uint32_t)chain_read(entry, packed, packed_length,
+				 BLOCK_SIZE + index->cluster_start[i]) == packed_length
+	    && lz_decompress(packed, packed_length, data, length) == (int)length) {
+		ret = 0;
+	}
+	free(packed);
+	return ret;
+}
+
+/* Index of the compressed file last read, and its last decompressed cluster,
+ * so that reads smaller than a cluster neither read the index nor decompress
+ * the cluster again. Dropped whenever the file changes. */
+static struct {
+	/* Directory entry of the file, NULL if none */
+	struct entry *entry;
+	struct cluster_index index;
+	/* Cluster held in data, UINT32_MAX if none */
+	uint32_t cluster;
+	uint8_t data[CLUSTER_SIZE];
+} cluster_cache;
+
+// drop what cluster_cache holds about the file described by @entry, or about
+// any file if @entry is NULL
+static void cluster_cache_drop(struct entry *entry)
+{
+	if (!entry || cluster_cache.entry == entry) {
+		cluster_cache.entry = NULL;
+	}
+}
+
+// read @count bytes at @offset of the compressed file described by @entry,
+// decompressing only the clusters that hold them
+static int cfile_read(struct entry *entry, void *buf, size_t count, size_t offset)
+{
+	uint32_t total_read_count = 0;
+	if (cluster_cache.entry != entry) {
+		if (chain_read(entry, &cluster_cache.index, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+			cluster_cache.entry = NULL;
+			return 0;
+		}
+		cluster_cache.entry = entry;
+		cluster_cache.cluster = UINT32_MAX;
+	}
+	while (total_read_count < count) {
+		size_t position = offset + total_read_count;
+		uint32_t i = position / CLUSTER_SIZE;
+		uint32_t length = entry->file_size - i * CLUSTER_SIZE;
+		if (length > CLUSTER_SIZE) {
+			length = CLUSTER_SIZE;
+		}
+		if (cluster_cache.cluster != i) {
+			cluster_cache.cluster = UINT32_MAX;
+			if (cluster_load(entry, &cluster_cache.index, i, cluster_cache.data, length)) {
+				break;
+			}
+			cluster_cache.cluster = i;
+		}
+		uint32_t iteration_read_count = length - position % CLUSTER_SIZE;
+		if (iteration_read_count > count - total_read_count) {
+			iteration_read_count = count - total_read_count;
+		}
+		memcpy((uint8_t *)buf + total_read_count,
+		       &cluster_cache.data[position % CLUSTER_SIZE], iteration_read_count);
+		total_read_count += iteration_read_count;
+	}
+	return total_read_count;
+}
+
+// write @count bytes of @buf at @offset of the compressed file described by
+// @entry: only the last cluster can be rewritten, since the other ones are
+// packed in between their neighbours
+static int cfile_write(struct entry *entry, const void *buf, size_t count, size_t offset)
+{
+	struct cluster_index index = { 0 };
+	uint32_t total_written_count = 0;
+	uint32_t cluster_count = (entry->file_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+	uint32_t i = offset / CLUSTER_SIZE;
+	if (i + 1 < cluster_count) {
+		return -1;
+	}
+	cluster_cache_drop(entry);
+	if (entry->datablk_start_index == FAT_EOC) {
+		// new file, the index block heads the chain
+		if (chain_write(entry, &index, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+			return 0;
+		}
+	} else if (chain_read(entry, &index, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+		return -1;
+	}
+	uint8_t *data = malloc(CLUSTER_SIZE);
+	uint8_t *packed = malloc(CLUSTER_SIZE);
+	if (!data || !packed) {
+		free(data);
+		free(packed);
+		return -1;
+	}
+	uint32_t length = 0;
+	uint32_t stream_position = index.stream_size;
+	if (i < cluster_count) {
+		length = entry->file_size - i * CLUSTER_SIZE;
+		stream_position = index.cluster_start[i];
+		if (cluster_load(entry, &index, i, data, length)) {
+			count = 0;
+		}
+	}
+	for (; total_written_count < count && i < CLUSTER_MAX_COUNT; ++i) {
+		uint32_t in_cluster = (offset + total_written_count) % CLUSTER_SIZE;
+		uint32_t iteration_written_count = CLUSTER_SIZE - in_cluster;
+		if (iteration_written_count > count - total_written_count) {
+			iteration_written_count = count - total_written_count;
+		}
+		memcpy(&data[in_cluster], (const uint8_t *)buf + total_written_count,
+		       iteration_written_count);
+		if (length < in_cluster + iteration_written_count) {
+			length = in_cluster + iteration_written_count;
+		}
+		// keep the cluster raw unless compression saves space
+		int packed_length = lz_compress(data, length, packed, length - 1);
+		const uint8_t *stream_data = packed_length ? packed : data;
+		if (!packed_length) {
+			packed_length = length;
+		}
+		// the cluster is rewritten in place, make sure it cannot be lost
+		// half-way because the disk is full
+		int needed = 1 + (stream_position + packed_length + BLOCK_SIZE - 1) / BLOCK_SIZE
+			- (1 + (index.stream_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+		if (entry->flags & ENTRY_SHARED) {
+			needed += 1 + (index.stream_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		}
+		if (needed > 0 && fat_free_count < needed) {
+			break;
+		}
+		if (chain_write(entry, stream_data, packed_length,
+				BLOCK_SIZE + stream_position) != packed_length) {
+			break;
+		}
+		index.cluster_start[i] = stream_position;
+		stream_position += packed_length;
+		index.stream_size = stream_position;
+		total_written_count += iteration_written_count;
+		length = 0;
+	}
+	free(data);
+	free(packed);
+	if (chain_write(entry, &index, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+		return -1;
+	}
+	// the last cluster may have shrunk
+	chain_truncate(entry, 1 + (index.stream_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	return total_written_count;
+}
+
+// fast content hash of a data block
+static uint64_t block_hash(const uint8_t *data)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (int i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, &data[i], sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+	return hash;
+}
+
+static void dedup_insert(uint16_t block, uint64_t hash)
+{
+	uint16_t *bucket = &dedup_bucket[hash % DEDUP_BUCKET_COUNT];
+	dedup_hash[block] = hash;
+	dedup_next[block] = *bucket;
+	*bucket = block;
+}
+
+static void dedup_remove(uint16_t block)
+{
+	uint16_t *link = &dedup_bucket[dedup_hash[block] % DEDUP_BUCKET_COUNT];
+	while (*link != 0 && *link != block) {
+		link = &dedup_next[*link];
+	}
+	if (*link == block) {
+		*link = dedup_next[block];
+	}
+}
+
+// mapped block holding the same content as @data, 0 if none
+static uint16_t dedup_find(const uint8_t *data, uint64_t hash)
+{
+	uint8_t candidate[BLOCK_SIZE];
+	for (uint16_t block = dedup_bucket[hash % DEDUP_BUCKET_COUNT]; block != 0;
+	     block = dedup_next[block]) {
+		// hashes can collide, compare the actual content
+		if (dedup_hash[block] == hash
+		    && !block_read(block + superblock.datablk_start_index, candidate)
+		    && !memcmp(candidate, data, BLOCK_SIZE)) {
+			return block;
+		}
+	}
+	return 0;
+}
+
+// drop one slot's link to mapped @block, freeing it once no slot links to it
+static void mapped_release(uint16_t block)
+{
+	if (fat_is_block(block) && FAT[block] == FAT_MAPPED && --refcount[block] == 0) {
+		dedup_remove(block);
+		fat_set(block, FAT_FREE);
+	}
+}
+
+// store @data for a map slot currently holding @old, and return the block the
+// slot must now hold: an existing block with the same content when there is
+// one, -1 if the disk is full
+static int dedup_store(const uint8_t *data, uint16_t old, uint16_t hint)
+{
+	static const uint8_t zeros[BLOCK_SIZE];
+	if (!memcmp(data, zeros, BLOCK_SIZE)) {
+		mapped_release(old);
+		return 0;
+	}
+	uint64_t hash = block_hash(data);
+	uint16_t block = dedup_find(data, hash);
+	if (block != 0) {
+		if (block != old) {
+			refcount[block]++;
+			mapped_release(old);
+		}
+		return block;
+	}
+	if (fat_is_block(old) && FAT[old] == FAT_MAPPED && refcount[old] == 1) {
+		// nobody else links to the old content, overwrite it
+		if (block_write(old + superblock.datablk_start_index, data)) {
+			return -1;
+		}
+		dedup_remove(old);
+		dedup_insert(old, hash);
+		return old;
+	}
+	int free_index = fat_alloc(hint);
+	if (free_index < 0
+	    || block_write(free_index + superblock.datablk_start_index, data)) {
+		return -1;
+	}
+	fat_set(free_index, FAT_MAPPED);
+	refcount[free_index] = 1;
+	dedup_insert(free_index, hash);
+	mapped_release(old);
+	return free_index;
+}
+
+// store @data for a map slot of a sparse file currently holding @old, and
+// return the block the slot must now hold, -1 if the disk is full
+static int sparse_store(const uint8_t *data, uint16_t old, uint16_t hint)
+{
+	static const uint8_t zeros[BLOCK_SIZE];
+	if (!memcmp(data, zeros, BLOCK_SIZE)) {
+		mapped_release(old);
+		return 0;
+	}
+	// blocks shared with a clone are copied on write
+	if (fat_is_block(old) && FAT[old] == FAT_MAPPED && refcount[old] == 1) {
+		if (block_write(old + superblock.datablk_start_index, data)) {
+			return -1;
+		}
+		return old;
+	}
+	int free_index = fat_alloc(hint);
+	if (free_index < 0
+	    || block_write(free_index + superblock.datablk_start_index, data)) {
+		return -1;
+	}
+	fat_set(free_index, FAT_MAPPED);
+	refcount[free_index] = 1;
+	mapped_release(old);
+	return free_index;
+}
+
+// number of map blocks of the mapped file described by @entry
+static size_t mfile_map_count(struct entry *entry)
+{
+	size_t block_count = (entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	return (block_count + MAP_SLOT_COUNT - 1) / MAP_SLOT_COUNT;
+}
+
+// count the map slots linking to each mapped block and rebuild the hash table
+// of the blocks of deduplicated files from their content
+static int map_rebuild(void)
+{
+	uint16_t map[MAP_SLOT_COUNT];
+	uint8_t block[BLOCK_SIZE];
+	memset(dedup_bucket, 0, sizeof(dedup_bucket));
+	for (int i = 1; i < superblock.datablk_amount; ++i) {
+		if (FAT[i] == FAT_MAPPED) {
+			refcount[i] = 0;
+		}
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		struct entry *entry = &root_directory.entry_array[i];
+		if (entry->filename[0] == '\0' || !(entry->flags & ENTRY_MAPPED)) {
+			continue;
+		}
+		for (size_t j = 0; j < mfile_map_count(entry); ++j) {
+			if (chain_read(entry, map, BLOCK_SIZE, j * BLOCK_SIZE) != BLOCK_SIZE) {
+				return -1;
+			}
+			for (int slot = 0; slot < MAP_SLOT_COUNT; ++slot) {
+				uint16_t data_block = map[slot];
+				if (!fat_is_block(data_block) || FAT[data_block] != FAT_MAPPED) {
+					continue;
+				}
+				// hash each block when its first link is found
+				if (refcount[data_block]++ == 0 && entry->flags & ENTRY_DEDUP) {
+					if (block_read(data_block + superblock.datablk_start_index, block)) {
+						return -1;
+					}
+					dedup_insert(data_block, block_hash(block));
+				}
+			}
+		}
+	}
+	map_loaded = 1;
+	return 0;
+}
+
+// load the link counts and the index of mapped blocks on first use, which
+// spares reading all the maps at mount time
+static int map_load(void)
+{
+	return map_loaded ? 0 : map_rebuild();
+}
+
+// read @count bytes at @offset of the mapped file described by @entry
+static int mfile_read(struct entry *entry, void *buf, size_t count, size_t offset)
+{
+	uint16_t map[MAP_SLOT_COUNT];
+	uint8_t block[BLOCK_SIZE];
+	size_t map_index = SIZE_MAX;
+	uint32_t total_read_count = 0;
+	while (total_read_count < count) {
+		size_t position = offset + total_read_count;
+		size_t logical = position / BLOCK_SIZE;
+		if (logical / MAP_SLOT_COUNT != map_index) {
+			map_index = logical / MAP_SLOT_COUNT;
+			if (chain_read(entry, map, BLOCK_SIZE, map_index * BLOCK_SIZE) != BLOCK_SIZE) {
+				break;
+			}
+		}
+		size_t slot = logical % MAP_SLOT_COUNT;
+		uint32_t offset_in_one_block = position % BLOCK_SIZE;
+		uint32_t iteration_read_count = BLOCK_SIZE - offset_in_one_block;
+		if (iteration_read_count > count - total_read_count) {
+			iteration_read_count = count - total_read_count;
+		}
+		uint8_t *dst = (uint8_t *)buf + total_read_count;
+		if (map[slot] == 0) {
+			// block of zeros
+			memset(dst, 0, iteration_read_count);
+		} else if (iteration_read_count == BLOCK_SIZE) {
+			// batch the whole blocks that are contiguous on disk
+			size_t run = 1;
+			while (slot + run < MAP_SLOT_COUNT && map[slot + run] == map[slot] + run
+			       && count - total_read_count - run * BLOCK_SIZE >= BLOCK_SIZE) {
+				run++;
+			}
+			if (block_read_range(map[slot] + superblock.datablk_start_index, run, dst)) {
+				break;
+			}
+			iteration_read_count = run * BLOCK_SIZE;
+		} else {
+			if (block_read(map[slot] + superblock.datablk_start_index, block)) {
+				break;
+			}
+			memcpy(dst, &block[offset_in_one_block], iteration_read_count);
+		}
+		total_read_count += iteration_read_count;
+	}
+	return total_read_count;
+}
+
+// write @count bytes of @buf at @offset of the mapped file described by
+// @entry, leaving holes where no block was ever written. A deduplicated file
+// only stores the blocks that no other block has the same content as.
+static int mfile_write(struct entry *entry, const void *buf, size_t count, size_t offset)
+{
+	uint16_t map[MAP_SLOT_COUNT];
+	uint8_t block[BLOCK_SIZE];
+	size_t map_index = SIZE_MAX;
+	int map_dirty = 0;
+	uint32_t total_written_count = 0;
+	uint16_t hint = 1;
+	if (map_load()) {
+		return -1;
+	}
+	while (total_written_count < count) {
+		size_t position = offset + total_written_count;
+		size_t logical = position / BLOCK_SIZE;
+		if (logical / MAP_SLOT_COUNT != map_index) {
+			if (map_dirty && chain_write(entry, map, BLOCK_SIZE, map_index * BLOCK_SIZE)
+			    != BLOCK_SIZE) {
+				return -1;
+			}
+			map_dirty = 0;
+			map_index = logical / MAP_SLOT_COUNT;
+			if (map_index < mfile_map_count(entry)) {
+				if (chain_read(entry, map, BLOCK_SIZE, map_index * BLOCK_SIZE) != BLOCK_SIZE) {
+					return -1;
+				}
+			} else {
+				// the file grows into a new map block
+				memset(map, 0, sizeof(map));
+				map_dirty = 1;
+			}
+		}
+		uint16_t *slot = &map[logical % MAP_SLOT_COUNT];
+		uint32_t offset_in_one_block = position % BLOCK_SIZE;
+		uint32_t iteration_written_count = BLOCK_SIZE - offset_in_one_block;
+		if (iteration_written_count > count - total_written_count) {
+			iteration_written_count = count - total_written_count;
+		}
+		if (iteration_written_count < BLOCK_SIZE) {
+			if (*slot == 0) {
+				memset(block, 0, BLOCK_SIZE);
+			} else if (block_read(*slot + superblock.datablk_start_index, block)) {
+				break;
+			}
+		}
+		memcpy(&block[offset_in_one_block], (const uint8_t *)buf + total_written_count,
+		       iteration_written_count);
+		int stored = entry->flags & ENTRY_DEDUP ? dedup_store(block, *slot, hint)
+			     : sparse_store(block, *slot, hint);
+		if (stored < 0) {
+			// disk is full, write as many bytes as possible
+			break;
+		}
+		if (stored != *slot) {
+			*slot = stored;
+			map_dirty = 1;
+		}
+		if (stored != 0) {
+			hint = stored + 1;
+		}
+		total_written_count += iteration_written_count;
+	}
+	if (map_dirty && chain_write(entry, map, BLOCK_SIZE, map_index * BLOCK_SIZE) != BLOCK_SIZE) {
+		return -1;
+	}
+	return total_written_count;
+}
+
+// release the data blocks of the mapped file described by @entry
+static void mfile_release(struct entry *entry)
+{
+	uint16_t map[MAP_SLOT_COUNT];
+	// the blocks are leaked if their links cannot be counted, fs_fsck()
+	// reclaims them
+	if (map_load()) {
+		return;
+	}
+	for (size_t i = 0; i < mfile_map_count(entry); ++i) {
+		if (chain_read(entry, map, BLOCK_SIZE, i * BLOCK_SIZE) != BLOCK_SIZE) {
+			return;
+		}
+		for (int slot = 0; slot < MAP_SLOT_COUNT; ++slot) {
+			mapped_release(map[slot]);
+		}
+	}
+}
+
+// give the mapped file described by @dst a copy of the map of @src,
+// sharing all the data blocks
+static int mfile_clone(struct entry *src, struct entry *dst)
+{
+	uint16_t map[MAP_SLOT_COUNT];
+	if (map_load()) {
+		return -1;
+	}
+	for (size_t i = 0; i < mfile_map_count(src); ++i) {
+		if (chain_read(src, map, BLOCK_SIZE, i * BLOCK_SIZE) != BLOCK_SIZE
+		    || chain_write(dst, map, BLOCK_SIZE, i * BLOCK_SIZE) != BLOCK_SIZE) {
+			chain_truncate(dst, 0);
+			return -1;
+		}
+	}
+	// the new map links to the data blocks once more
+	for (size_t i = 0; i < mfile_map_count(src); ++i) {
+		chain_read(dst, map, BLOCK_SIZE, i * BLOCK_SIZE);
+		for (int slot = 0; slot < MAP_SLOT_COUNT; ++slot) {
+			if (fat_is_block(map[slot]) && FAT[map[slot]] == FAT_MAPPED) {
+				refcount[map[slot]]++;
+			}
+		}
+	}
+	return 0;
+}
+
+// link the data blocks of @count whole blocks from block @src_first of the
+// mapped file described by @src into the map of the one described by @dst,
+// from block @dst_first, and return the number of bytes linked
+static int mfile_share(struct entry *src, size_t src_first, struct entry *dst,
+		       size_t dst_first, size_t count)
+{
+	uint16_t src_map[MAP_SLOT_COUNT], dst_map[MAP_SLOT_COUNT];
+	size_t src_index = SIZE_MAX, dst_index = SIZE_MAX;
+	int dst_dirty = 0;
+	size_t i = 0;
+	if (map_load()) {
+		return -1;
+	}
+	for (; i < count; ++i) {
+		size_t src_logical = src_first + i, dst_logical = dst_first + i;
+		if (src_logical / MAP_SLOT_COUNT != src_index) {
+			src_index = src_logical / MAP_SLOT_COUNT;
+			if (chain_read(src, src_map, BLOCK_SIZE, src_index * BLOCK_SIZE) != BLOCK_SIZE) {
+				break;
+			}
+		}
+		if (dst_logical / MAP_SLOT_COUNT != dst_index) {
+			if (dst_dirty && chain_write(dst, dst_map, BLOCK_SIZE, dst_index * BLOCK_SIZE)
+			    != BLOCK_SIZE) {
+				return -1;
+			}
+			dst_dirty = 0;
+			dst_index = dst_logical / MAP_SLOT_COUNT;
+			if (dst_index < mfile_map_count(dst)) {
+				if (chain_read(dst, dst_map, BLOCK_SIZE, dst_index * BLOCK_SIZE) != BLOCK_SIZE) {
+					break;
+				}
+			} else {
+				// the file grows into a new map block
+				memset(dst_map, 0, sizeof(dst_map));
+				dst_dirty = 1;
+			}
+		}
+		uint16_t block = src_map[src_logical % MAP_SLOT_COUNT];
+		uint16_t *slot = &dst_map[dst_logical % MAP_SLOT_COUNT];
+		if (block != *slot) {
+			if (fat_is_block(block) && FAT[block] == FAT_MAPPED) {
+				refcount[block]++;
+			}
+			mapped_release(*slot);
+			*slot = block;
+			dst_dirty = 1;
+		}
+	}
+	if (dst_dirty && chain_write(dst, dst_map, BLOCK_SIZE, dst_index * BLOCK_SIZE) != BLOCK_SIZE) {
+		return -1;
+	}
+	return i * BLOCK_SIZE;
+}
+
+// first offset at or after @offset of the mapped file described by @entry
+// that is in a hole if @hole, or that holds data otherwise, -1 if none
+static long mfile_seek(struct entry *entry, size_t offset, int hole)
+{
+	uint16_t map[MAP_SLOT_COUNT];
+	size_t map_index = SIZE_MAX;
+	size_t block_count = (entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for (size_t logical = offset / BLOCK_SIZE; logical < block_count; ++logical) {
+		if (logical / MAP_SLOT_COUNT != map_index) {
+			map_index = logical / MAP_SLOT_COUNT;
+			if (chain_read(entry, map, BLOCK_SIZE, map_index * BLOCK_SIZE) != BLOCK_SIZE) {
+				return -1;
+			}
+		}
+		if ((map[logical % MAP_SLOT_COUNT] == 0) == hole) {
+			return logical * BLOCK_SIZE > offset ? logical * BLOCK_SIZE : offset;
+		}
+	}
+	// the end of the file is a hole
+	return hole ? (long)entry->file_size : -1;
+}
+
+// move the blocks of the plain file described by @entry to a map, so that the
+// file can hold holes
+static int chain_to_map(struct entry *entry)
+{
+	uint16_t map[MAP_SLOT_COUNT];
+	size_t block_count = (entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t map_count = (block_count + MAP_SLOT_COUNT - 1) / MAP_SLOT_COUNT;
+	// the blocks shared with clones are copied, the map cannot share them
+	if (file_unshare(entry, block_count) || fat_free_count < (int)map_count) {
+		return -1;
+	}
+	// write the maps to a chain of their own first, the file is left as it
+	// was if they cannot all be written
+	struct entry maps = { .datablk_start_index = FAT_EOC };
+	uint16_t block = entry->datablk_start_index;
+	for (size_t i = 0; i < map_count; ++i) {
+		memset(map, 0, sizeof(map));
+		for (int slot = 0; slot < MAP_SLOT_COUNT && fat_is_block(block); ++slot) {
+			map[slot] = block;
+			block = FAT[block];
+		}
+		if (chain_write(&maps, map, BLOCK_SIZE, i * BLOCK_SIZE) != BLOCK_SIZE) {
+			chain_release(maps.datablk_start_index);
+			return -1;
+		}
+	}
+	// the links from the chain become the links from the slots
+	block = entry->datablk_start_index;
+	while (fat_is_block(block)) {
+		uint16_t next = FAT[block];
+		fat_set(block, FAT_MAPPED);
+		block = next;
+	}
+	entry->datablk_start_index = maps.datablk_start_index;
+	entry->flags = (entry->flags & ~ENTRY_SHARED) | ENTRY_SPARSE;
+	return 0;
+}
+
+// write @count bytes of @buf at @offset of the file described by @entry,
+// extending the file if needed
+static int file_write(struct entry *entry, const void *buf, size_t count, size_t offset)
+{
+	int written_count;
+	// the blocks the appenders copy to must stay where they are
+	append_wait(entry - root_directory.entry_array);
+	// sizes are reported as int
+	if (offset > INT_MAX) {
+		return -1;
+	}
+	if (count > INT_MAX - offset) {
+		count = INT_MAX - offset;
+	}
+	if (offset > entry->file_size && !(entry->flags & ENTRY_MAPPED)) {
+		// compressed content can only be written at its end
+		if (entry->flags & ENTRY_COMPRESSED) {
+			return -1;
+		}
+		// holes are only left in allocated blocks
+		delalloc_flush(entry);
+		// a write leaving a hole of whole blocks makes the file sparse
+		size_t block_count = (entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		if (offset / BLOCK_SIZE > block_count && chain_to_map(entry)) {
+			return -1;
+		}
+	}
+	if (entry->flags & ENTRY_COMPRESSED) {
+		written_count = cfile_write(entry, buf, count, offset);
+	} else if (entry->flags & ENTRY_MAPPED) {
+		written_count = mfile_write(entry, buf, count, offset);
+	} else {
+		written_count = delalloc_write(entry, buf, count, offset);
+	}
+	// update file size if the file grew
+	if (written_count > 0 && entry->file_size < offset + written_count) {
+		entry->file_size = offset + written_count;
+	}
+	return written_count;
+}
+
+// read up to @count bytes at @offset of the file described by @entry into @buf
+static int file_read(struct entry *entry, void *buf, size_t count, size_t offset)
+{
+	// nothing to read at or past the end of the file
+	if (offset >= entry->file_size) {
+		return 0;
+	}
+	if (count > entry->file_size - offset) {
+		count = entry->file_size - offset;
+	}
+	if (entry->flags & ENTRY_COMPRESSED) {
+		return cfile_read(entry, buf, count, offset);
+	}
+	if (entry->flags & ENTRY_MAPPED) {
+		return mfile_read(entry, buf, count, offset);
+	}
+	return delalloc_read(entry, buf, count, offset);
+}
+
+// append @count bytes of @buf to the file described by @entry, as one range
+// that no other append interleaves with, and set @end to the end of the range.
+// Unlike file_write(), nothing is written if the whole range cannot be.
+static int file_append(struct entry *entry, const void *buf, size_t count, size_t *end)
+{
+	struct append_state *state = &appends[entry - root_directory.entry_array];
+	if (count == 0) {
+		return 0;
+	}
+	// the ranges are reserved in allocated blocks
+	if (delalloc_flush(entry)) {
+		return -1;
+	}
+	if (!state->copying) {
+		state->reserved = state->published = entry->file_size;
+		state->failed = 0;
+	}
+	size_t start = state->reserved;
+	// sizes are reported as int
+	if (start > INT_MAX || count > INT_MAX - start) {
+		return -1;
+	}
+	*end = start + count;
+	// compressed and mapped content is appended to with fs_lock held
+	if (entry->flags & (ENTRY_COMPRESSED | ENTRY_MAPPED)) {
+		int written_count = file_write(entry, buf, count, start);
+		return written_count == (int)count ? written_count : -1;
+	}
+
+	// reserve the range, with all its blocks allocated at once
+	size_t first = start / BLOCK_SIZE;
+	size_t block_count = (*end + BLOCK_SIZE - 1) / BLOCK_SIZE - first;
+	uint16_t *blocks = malloc(block_count * sizeof(*blocks));
+	uint8_t *bounce = block_buffer_get();
+	if (!blocks || !bounce || file_unshare(entry, first + block_count)
+	    || chain_extend(entry, first + block_count)) {
+		// the blocks of the ranges reserved so far are kept
+		if (!state->copying) {
+			chain_truncate(entry, (start + BLOCK_SIZE - 1) / BLOCK_SIZE);
+		}
+		free(blocks);
+		block_buffer_put(bounce);
+		return -1;
+	}
+	uint16_t block = entry->datablk_start_index;
+	for (size_t i = 0; i < first; ++i) {
+		block = FAT[block];
+	}
+	for (size_t i = 0; i < block_count; ++i) {
+		blocks[i] = block;
+		block = FAT[block];
+	}
+	state->reserved = *end;
+	state->copying++;
+	appends_copying++;
+
+	// partial blocks are shared with the neighbouring ranges, so they are
+	// written with fs_lock held: the first one is already part of the file,
+	// the last one is new and must be zero past the end of the range
+	const uint8_t *data = buf;
+	size_t head = start % BLOCK_SIZE ? BLOCK_SIZE - start % BLOCK_SIZE : 0;
+	size_t tail = *end % BLOCK_SIZE;
+	int error = 0;
+	if (head > count) {
+		head = count;
+		tail = 0;
+	}
+	if (head) {
+		error = block_read(blocks[0] + superblock.datablk_start_index, bounce);
+		memcpy(bounce + start % BLOCK_SIZE, data, head);
+		error = error || block_write(blocks[0] + superblock.datablk_start_index, bounce);
+	}
+	if (tail && !error) {
+		memset(bounce, 0, BLOCK_SIZE);
+		memcpy(bounce, data + count - tail, tail);
+		error = block_write(blocks[block_count - 1] + superblock.datablk_start_index,
+				    bounce);
+	}
+	block_buffer_put(bounce);
+
+	// the whole blocks only belong to this range, copy them without fs_lock,
+	// one request per run of contiguous blocks
+	size_t i = head ? 1 : 0;
+	size_t whole_end = tail ? block_count - 1 : block_count;
+	assert(fs_lock_depth == 1);
+	fs_lock_depth--;
+	pthread_mutex_unlock(&fs_lock);
+	while (i < whole_end && !error) {
+		size_t run = 1;
+		while (i + run < whole_end && blocks[i + run] == blocks[i] + run) {
+			run++;
+		}
+		error = block_write_range(blocks[i] + superblock.datablk_start_index, run,
+					  data + head + (i - (head ? 1 : 0)) * BLOCK_SIZE);
+		i += run;
+	}
+	pthread_mutex_lock(&fs_lock);
+	fs_lock_depth++;
+	free(blocks);
+
+	// publish the range once the ranges before it are
+	while (state->published != start) {
+		append_cond_wait();
+	}
+	state->published = *end;
+	state->failed = state->failed || error;
+	if (!state->failed) {
+		entry->file_size = *end;
+	}
+	state->copying--;
+	appends_copying--;
+	if (!state->copying && state->failed) {
+		// drop the blocks of the ranges that were not published
+		chain_truncate(entry, (entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	}
+	pthread_cond_broadcast(&append_cond);
+	return state->failed ? -1 : (int)count;
+}
+
+// extend the run of @run_length data blocks starting at @run_start with data
+// block @block, or pass advice @advice on the run to the block cache and start
+// a new one if @block does not follow it. Block 0 ends the run.
+static void advise_run(uint16_t *run_start, size_t *run_length, uint16_t block, int advice)
+{
+	if (*run_length && block == *run_start + *run_length) {
+		(*run_length)++;
+		return;
+	}
+	if (*run_length) {
+		block_advise(*run_start + superblock.datablk_start_index, *run_length, advice);
+	}
+	*run_start = block;
+	*run_length = block ? 1 : 0;
+}
+
+// pass advice @advice on @count bytes at @offset of the file described by
+// @entry to the block cache, one request per run of contiguous data blocks
+static void file_advise(struct entry *entry, size_t offset, size_t count, int advice)
+{
+	if (offset >= entry->file_size || count == 0) {
+		return;
+	}
+	if (count > entry->file_size - offset) {
+		count = entry->file_size - offset;
+	}
+	size_t first = offset / BLOCK_SIZE;
+	size_t last = (offset + count - 1) / BLOCK_SIZE;
+	if (entry->flags & ENTRY_COMPRESSED) {
+		// clusters do not line up with blocks, the whole stream is advised
+		first = 0;
+		last = SIZE_MAX;
+	}
+	uint16_t run_start = 0;
+	size_t run_length = 0;
+	if (entry->flags & ENTRY_MAPPED) {
+		uint16_t map[MAP_SLOT_COUNT];
+		size_t map_index = SIZE_MAX;
+		for (size_t i = first; i <= last; ++i) {
+			if (i / MAP_SLOT_COUNT != map_index) {
+				map_index = i / MAP_SLOT_COUNT;
+				if (chain_read(entry, map, BLOCK_SIZE, map_index * BLOCK_SIZE) != BLOCK_SIZE) {
+					break;
+				}
+			}
+			// holes end the runs
+			advise_run(&run_start, &run_length, map[i % MAP_SLOT_COUNT], advice);
+		}
+	} else {
+		uint16_t block = entry->datablk_start_index;
+		for (size_t i = 0; i < first && fat_is_block(block); ++i) {
+			block = FAT[block];
+		}
+		for (size_t i = first; i <= last && fat_is_block(block); ++i) {
+			advise_run(&run_start, &run_length, block, advice);
+			block = FAT[block];
+		}
+	}
+	advise_run(&run_start, &run_length, 0, advice);
+}
+
+// apply the advice given on @fd once @count bytes were read at @offset: read
+// ahead of sequential reads, and get the blocks read once evicted first
+static void fd_advise_read(int fd, size_t offset, size_t count)
+{
+	struct file_descriptor *desc = &fd_table[fd];
+	size_t end = offset + count;
+	if (count == 0) {
+		return;
+	}
+	if (offset < desc->noreuse_end && end > desc->noreuse_start) {
+		size_t start = offset > desc->noreuse_start ? offset : desc->noreuse_start;
+		size_t stop = end < desc->noreuse_end ? end : desc->noreuse_end;
+		file_advise(desc->entry, start, stop - start, BLOCK_ADVISE_NOREUSE);
+	}
+	if (desc->pattern == FS_ADVISE_SEQUENTIAL) {
+		// the window restarts after a seek
+		if (desc->readahead_end < end || desc->readahead_end > end + READAHEAD_SIZE) {
+			desc->readahead_end = end;
+		}
+		// and moves ahead once half of it is read
+		if (desc->readahead_end < end + READAHEAD_SIZE / 2) {
+			file_advise(desc->entry, desc->readahead_end,
+				    end + READAHEAD_SIZE - desc->readahead_end, BLOCK_ADVISE_WILLNEED);
+			desc->readahead_end = end + READAHEAD_SIZE;
+		}
+	}
+}
+
+// append @count bytes of @buf through file descriptor @fd, which is left at
+// the end of the appended range
+static int fd_append(int fd, const void *buf, size_t count)
+{
+	struct entry *entry = fd_table[fd].entry;
+	size_t end;
+	int written_count = file_append(entry, buf, count, &end);
+	// unless another thread closed it while the data was copied
+	if (written_count > 0 && fd_table[fd].entry == entry) {
+		fd_table[fd].offset = end;
+	}
+	return written_count;
+}
+
+int fs_format(const char *diskname, size_t data_blk_count,
+	      size_t reserved_blk_count)
+{
+	FS_LOCK();
+	if (data_blk_count == 0 || data_blk_count > FS_DATA_BLK_MAX_COUNT) {
+		return -1;
+	}
+	size_t fat_amount = (data_blk_count * sizeof(uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	// superblock + FAT + root directory + reserved area + data blocks
+	size_t total_blocks = 1 + fat_amount + ROOTDIR_BLOCKS + reserved_blk_count + data_blk_count;
+	if (total_blocks > UINT16_MAX) {
+		return -1;
+	}
+
+	struct superblock sb = { 0 };
+	sb.signature = FS_SIGNATURE;
+	sb.total_blocks = total_blocks;
+	sb.rootdir_blk_index = 1 + fat_amount;
+	sb.datablk_start_index = sb.rootdir_blk_index + ROOTDIR_BLOCKS + reserved_blk_count;
+	sb.datablk_amount = data_blk_count;
+	sb.fat_amount = fat_amount;
+	sb.block_shift = BLOCK_SHIFT;
+
+	if (block_disk_create(diskname, total_blocks)) {
+		return -1;
+	}
+	if (block_disk_open(diskname)) {
+		return -1;
+	}
+	int error_flag = block_write(0, &sb);
+	// first FAT entry is reserved and always marked as end of chain
+	uint16_t fat_block[FAT_BLOCK_ENTRIES] = { FAT_EOC };
+	for (size_t i = 0; i < fat_amount && !error_flag; ++i) {
+		error_flag = block_write(i + 1, fat_block);
+		fat_block[0] = FAT_FREE;
+	}
+	struct root_directory rdir = { 0 };
+	if (!error_flag) {
+		error_flag = block_write_range(sb.rootdir_blk_index, ROOTDIR_BLOCKS, &rdir);
+	}
+	if (block_disk_close() || error_flag) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Copies of the FAT and of the root directory as last written to the disk */
+static uint16_t FAT_synced[FAT_MAX_AMOUNT * FAT_BLOCK_ENTRIES];
+static struct root_directory rootdir_synced;
+
+/* Interval between the write-backs of the metadata, in seconds */
+#define META_SYNC_INTERVAL 1
+
+/* Incremented by each mount and unmount, so that the metadata writer of a
+ * mount stops with it */
+static unsigned long mount_generation;
+/* Signaled when the FS is unmounted */
+static pthread_cond_t meta_cond = PTHREAD_COND_INITIALIZER;
+
+// discard the runs of free data blocks from @first to @last - 1, and return
+// the number of blocks discarded, -1 on error
+static int discard_free_runs(uint16_t first, uint16_t last)
+{
+	int discarded = 0;
+	for (uint16_t i = first; i < last; ++i) {
+		if (i == 0 || FAT[i] != FAT_FREE) {
+			continue;
+		}
+		uint16_t run = 1;
+		while (i + run < last && FAT[i + run] == FAT_FREE) {
+			run++;
+		}
+		if (block_discard(superblock.datablk_start_index + i, run)) {
+			return -1;
+		}
+		discarded += run;
+		i += run - 1;
+	}
+	return discarded;
+}
+
+// discard the data blocks freed since the last call that are still free,
+// coalesced into runs
+static int discard_flush(void)
+{
+	if (!discard_count) {
+		return 0;
+	}
+	// the FAT that frees the blocks must be on disk before their content is
+	// gone, else a crash would leave files linked to punched blocks. The
+	// blocks stay pending until it is.
+	if (block_sync()) {
+		writeback_error = 1;
+		return -1;
+	}
+	int error = 0;
+	for (int i = 0; i < superblock.datablk_amount; ++i) {
+		if (!(discard_pending[i / 8] & 1 << i % 8)) {
+			continue;
+		}
+		// a run of pending blocks, which may have been allocated again
+		int run = 1;
+		while (i + run < superblock.datablk_amount
+		       && discard_pending[(i + run) / 8] & 1 << (i + run) % 8) {
+			run++;
+		}
+		if (discard_free_runs(i, i + run) < 0) {
+			error = -1;
+		}
+		i += run - 1;
+	}
+	memset(discard_pending, 0, sizeof(discard_pending));
+	discard_count = 0;
+	return error;
+}
+
+// write the FAT blocks and the root directory back if they changed since they
+// were last written, the block cache then merges them with the data blocks.
+// The blocks freed meanwhile are discarded once the FAT that frees them is on
+// disk.
+static int meta_sync(void)
+{
+	int error = delalloc_flush_all();
+	for (int i = 0; i < superblock.fat_amount; ++i) {
+		uint16_t *fat_block = &FAT[i * FAT_BLOCK_ENTRIES];
+		uint16_t *synced = &FAT_synced[i * FAT_BLOCK_ENTRIES];
+		if (!memcmp(fat_block, synced, BLOCK_SIZE)) {
+			continue;
+		}
+		if (block_write(i + 1, fat_block)) {
+			return -1;
+		}
+		memcpy(synced, fat_block, BLOCK_SIZE);
+	}
+	if (memcmp(&root_directory, &rootdir_synced, sizeof(root_directory))) {
+		if (block_write_range(superblock.rootdir_blk_index, ROOTDIR_BLOCKS,
+				      &root_directory)) {
+			return -1;
+		}
+		rootdir_synced = root_directory;
+	}
+	if (discard_flush()) {
+		error = -1;
+	}
+	return error;
+}
+
+// write the metadata back every META_SYNC_INTERVAL seconds, until the mount
+// of generation @arg ends
+static void *meta_thread(void *arg)
+{
+	unsigned long generation = (uintptr_t)arg;
+	FS_LOCK();
+	while (mount_generation == generation) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += META_SYNC_INTERVAL;
+		fs_lock_depth--;
+		int timed_out = pthread_cond_timedwait(&meta_cond, &fs_lock, &deadline);
+		fs_lock_depth++;
+		if (timed_out && mount_generation == generation) {
+			meta_sync();
+		}
+	}
+	return NULL;
+}
+
+int fs_mount(const char *diskname)
+{
+	return fs_mount_flags(diskname, 0);
+}
+
+int fs_mount_flags(const char *diskname, int flags)
+{
+	FS_LOCK();
+	int disk_flags = (flags & FS_MOUNT_DIRECT ? BLOCK_DISK_DIRECT : 0)
+			 | (flags & FS_MOUNT_HUGEPAGES ? BLOCK_DISK_HUGEPAGES : 0);
+	int opendisk = block_disk_open_flags(diskname, disk_flags);
+	int error_flag = 0;
+	if (opendisk == - 1) {
+		return -1;	
+	}
+	error_flag = block_read(0, &superblock);
+	// check signature == ECS150FS, and that the FS was formatted with the
+	// block size the library is built for
+	int block_shift = superblock.block_shift ? superblock.block_shift : 12;
+	if (error_flag != 0 || superblock.signature != FS_SIGNATURE
+	    || block_shift != BLOCK_SHIFT
+	    || superblock.fat_amount > FAT_MAX_AMOUNT
+	    || superblock.datablk_amount > FS_DATA_BLK_MAX_COUNT) {
+		goto err_close;
+	}
+
+	error_flag = block_read_range(superblock.rootdir_blk_index, ROOTDIR_BLOCKS,
+				      &root_directory);
+	if (error_flag != 0) {
+		goto err_close;
+	}
+
+	// the whole FAT in one request
+	error_flag = block_read_range(1, superblock.fat_amount, FAT);
+	if (error_flag != 0) {
+		goto err_close;
+	}
+
+	// the free block count is only trusted if the FS was unmounted properly,
+	// and the FS is marked as mounted until it is
+	if (superblock.state == FS_STATE_CLEAN) {
+		fat_free_count = superblock.free_blk_count;
+	} else {
+		fat_free_count = fat_free_blocks();
+	}
+	superblock.state = FS_STATE_DIRTY;
+	if (block_write(0, &superblock)) {
+		goto err_close;
+	}
+	refcount_rebuild();
+	// the index of deduplicated blocks is loaded on first use
+	map_loaded = 0;
+	cluster_cache_drop(NULL);
+	discard_enabled = !!(flags & FS_MOUNT_DISCARD);
+	writeback_error = 0;
+	memset(discard_pending, 0, sizeof(discard_pending));
+	discard_count = 0;
+
+	// without a metadata writer, the metadata is only written at unmount
+	memcpy(FAT_synced, FAT, sizeof(FAT));
+	rootdir_synced = root_directory;
+	pthread_t meta;
+	if (!pthread_create(&meta, NULL, meta_thread, (void *)(uintptr_t)++mount_generation)) {
+		pthread_detach(meta);
+	}
+
+	// FS_TRACE records the calls of programs that do not start a trace
+	// themselves
+	const char *tracename = getenv("FS_TRACE");
+	if (!trace_file && tracename && *tracename) {
+		trace_open(tracename);
+	}
+	// recorded once mounted, so that the replay can format a disk of the
+	// same size
+	trace(FS_TRACE_MOUNT, -1, superblock.datablk_amount, 0, 0, NULL, NULL);
+	return 0;
+
+err_close:
+	superblock = (const struct superblock){ 0 };
+	block_disk_close();
+	return -1;
+}
+
+int fs_umount(void)
+{
+	FS_LOCK();
+	trace(FS_TRACE_UMOUNT, -1, 0, 0, 0, NULL, NULL);
+	// No FS mounted
+	if (!superblock.signature || superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
+		if (fd_table[i].entry != NULL){
+			return -1;
+		}
+	}
+	if (file_mapped(NULL, 0, 0)) {
+		return -1;
+	}
+	// appenders may still copy data through file descriptors closed meanwhile
+	append_wait(-1);
+	if (meta_sync()) {
+		return -1;
+	}
+	// metadata is on disk, the free block count can be trusted again
+	superblock.free_blk_count = fat_free_count;
+	superblock.state = FS_STATE_CLEAN;
+	if (block_write(0, &superblock)) {
+		return -1;
+	}
+
+	// the metadata writer stops once it gets fs_lock back
+	mount_generation++;
+	pthread_cond_broadcast(&meta_cond);
+
+	superblock = (const struct superblock){ 0 };
+	memset(FAT, 0, sizeof(FAT));
+	fat_free_count = 0;
+	root_directory = (const struct root_directory){ 0 };
+	if (trace_file) {
+		fflush(trace_file);
+	}
+	int error = writeback_error;
+	writeback_error = 0;
+	return block_disk_close() || error ? -1 : 0;
+}
+
+int fs_sync(void)
+{
+	FS_LOCK();
+	trace(FS_TRACE_SYNC, -1, 0, 0, 0, NULL, NULL);
+	if (superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	int error = meta_sync() || block_sync() || writeback_error;
+	writeback_error = 0;
+	return error ? -1 : 0;
+}
+
+int fs_trace_start(const char *tracename)
+{
+	FS_LOCK();
+	// traces start with a mount, so that they replay on a fresh disk
+	if (!tracename || trace_file || superblock.signature == FS_SIGNATURE) {
+		return -1;
+	}
+	return trace_open(tracename);
+}
+
+int fs_trace_stop(void)
+{
+	FS_LOCK();
+	if (!trace_file) {
+		return -1;
+	}
+	int ret = fclose(trace_file) ? -1 : 0;
+	trace_file = NULL;
+	return ret;
+}
+
+int fs_info(void)
+{
+	FS_LOCK();
+	int rdir_free = rdir_free_blocks();
+	int fat_free = fat_free_count;
+	fprintf(stdout, "FS Info:\n");
+	fprintf(stdout, "total_blk_count=%d\n",		superblock.total_blocks);
+	fprintf(stdout, "fat_blk_count=%d\n",		superblock.fat_amount);
+	fprintf(stdout, "rdir_blk=%d\n",		superblock.rootdir_blk_index);
+	fprintf(stdout, "data_blk=%d\n",		superblock.datablk_start_index);
+	fprintf(stdout, "data_blk_count=%d\n",		superblock.datablk_amount);
+	fprintf(stdout, "fat_free_ratio=%d/%d\n",	fat_free,	superblock.datablk_amount); 
+	fprintf(stdout, "rdir_free_ratio=%d/%d\n",	rdir_free,	FS_FILE_MAX_COUNT);
+	return 0;
+}
+
+int fs_create(const char *filename)
+{
+	FS_LOCK();
+	trace(FS_TRACE_CREATE, -1, 0, 0, 0, filename, NULL);
+	// FS not mounted
+	if (!superblock.signature || superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	// filename invalid or filename is too long
+	int filename_length = strlen(filename);
+	if (!filename || filename_length >= FS_FILENAME_LEN) {
+		return -1;
+	}
+	// filename already exist, anywhere in the root directory
+	if (filename_length == 0 || rdir_lookup(filename) != -1) {
+		return -1;
+	}
+	int index = -1;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		if (root_directory.entry_array[i].filename[0] == '\0') {
+			index = i;
+			break;
+		}
+	}
+	// root directory is full
+	if (index == -1) {
+		return -1;
+	}
+	strcpy((char*)root_directory.entry_array[index].filename, filename);
+	root_directory.entry_array[index].file_size = 0;
+	root_directory.entry_array[index].datablk_start_index = 0xFFFF;  // FAT EOC = 0xFFFF
+	root_directory.entry_array[index].flags = 0;
+	return 0;
+}
+
+int fs_delete(const char *filename)
+{
+	FS_LOCK();
+	trace(FS_TRACE_DELETE, -1, 0, 0, 0, filename, NULL);
+	// FS not mounted
+	if (!superblock.signature || superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	// filename is invalid
+	if (!filename || filename == NULL) {
+		return -1;
+	}
+	// check if filename is opened
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; ++i) {
+		if (fd_table[i].entry && !strcmp((char*)fd_table[i].entry->filename, filename)) {
+			return -1;
+		}
+	}
+	int index = -1;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		if (strcmp((char*)root_directory.entry_array[i].filename, filename) == 0) {
+			index = i;
+			break;
+		}
+	}
+	// if no file named filename, or if it is mapped
+	if (index == -1 || file_mapped(&root_directory.entry_array[index], 0, 0)) {
+		return -1;
+	}
+	append_wait(index);
+	// buffered data never got any block
+	delalloc_discard(&root_directory.entry_array[index]);
+	cluster_cache_drop(&root_directory.entry_array[index]);
+	if (root_directory.entry_array[index].flags & ENTRY_MAPPED) {
+		// data blocks still linked from other maps are kept
+		mfile_release(&root_directory.entry_array[index]);
+	}
+	root_directory.entry_array[index].filename[0] = '\0';
+	root_directory.entry_array[index].file_size = 0;
+	if (root_directory.entry_array[index].datablk_start_index != 0xffff) {
+		// blocks still linked from a clone are kept
+		chain_release(root_directory.entry_array[index].datablk_start_index);
+	}
+	root_directory.entry_array[index].datablk_start_index = '\0';
+	return 0;
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+	FS_LOCK();
+	trace(FS_TRACE_CLONE, -1, 0, 0, 0, src, dst);
+	// FS not mounted
+	if (superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	if (!src || !dst) {
+		return -1;
+	}
+	int src_index = rdir_lookup(src);
+	if (src_index == -1 || rdir_lookup(dst) != -1 || rdir_free_blocks() == 0) {
+		return -1;
+	}
+	// the blocks written through a mapping cannot be shared
+	if (file_mapped(&root_directory.entry_array[src_index], 1, FS_MMAP_WRITE)) {
+		return -1;
+	}
+	// the clone gets the published content only, in allocated blocks
+	append_wait(src_index);
+	if (delalloc_flush(&root_directory.entry_array[src_index]) || fs_create(dst)) {
+		return -1;
+	}
+	struct entry *src_entry = &root_directory.entry_array[src_index];
+	struct entry *dst_entry = &root_directory.entry_array[rdir_lookup(dst)];
+	if (src_entry->flags & ENTRY_MAPPED) {
+		// the clone gets its own map, its data blocks are already shared
+		dst_entry->flags = src_entry->flags & ENTRY_MAPPED;
+		if (mfile_clone(src_entry, dst_entry)) {
+			fs_delete(dst);
+			return -1;
+		}
+		dst_entry->file_size = src_entry->file_size;
+		return 0;
+	}
+	chain_share(src_entry, dst_entry);
+	return 0;
+}
+
+int fs_ls(void)
+{
+	FS_LOCK();
+	struct fs_dir *dir = fs_opendir(0);
+	struct fs_dirent dirent;
+	if (!dir) {
+		return -1;
+	}
+	fprintf(stdout, "FS Ls:\n");
+	while (fs_readdir(dir, &dirent) == 1) {
+		fprintf(stdout, "file: %s, size: %zu, data_blk: %u\n",
+			dirent.name, dirent.size, dirent.first_block);
+	}
+	return fs_closedir(dir);
+}
+
+struct fs_dir {
+	int count;
+	/* Next entry returned by fs_readdir() */
+	int next;
+	struct fs_dirent entries[FS_FILE_MAX_COUNT];
+};
+
+struct fs_dir *fs_opendir(int flags)
+{
+	FS_LOCK();
+	// No FS mounted
+	if (superblock.signature != FS_SIGNATURE) {
+		return NULL;
+	}
+	struct fs_dir *dir = malloc(sizeof(*dir));
+	if (!dir) {
+		return NULL;
+	}
+	dir->count = 0;
+	dir->next = 0;
+	// the copy is the snapshot, later changes do not affect it
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		struct entry *entry = &root_directory.entry_array[i];
+		if (entry->filename[0] == '\0') {
+			continue;
+		}
+		struct fs_dirent *dirent = &dir->entries[dir->count++];
+		memcpy(dirent->name, entry->filename, FS_FILENAME_LEN);
+		dirent->name[FS_FILENAME_LEN - 1] = '\0';
+		dirent->size = entry->file_size;
+		dirent->first_block = entry->datablk_start_index;
+		dirent->extents = 0;
+		if (flags & FS_DIR_EXTENTS) {
+			dirent->extents = chain_extents(entry->datablk_start_index);
+		}
+	}
+	return dir;
+}
+
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *dirent)
+{
+	if (!dir || !dirent) {
+		return -1;
+	}
+	if (dir->next == dir->count) {
+		return 0;
+	}
+	*dirent = dir->entries[dir->next++];
+	return 1;
+}
+
+int fs_closedir(struct fs_dir *dir)
+{
+	if (!dir) {
+		return -1;
+	}
+	free(dir);
+	return 0;
+}
+
+int fs_open(const char *filename)
+{
+	return fs_open_flags(filename, 0);
+}
+
+int fs_open_flags(const char *filename, int flags)
+{
+	FS_LOCK();
+	trace(FS_TRACE_OPEN, -1, 0, 0, flags, filename, NULL);
+	if (flags & ~FS_OPEN_APPEND) {
+		return -1;
+	}
+	// No FS mounted
+	if (!superblock.signature || superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	// filename invalid
+	if (!filename || filename == NULL) {
+		return -1;
+	}
+	int fd_table_index = -1;
+	int file_index = rdir_lookup(filename);
+	// no file named filename
+	if (file_index == -1) {
+		return -1;
+	}
+	for (int j = 0; j < FS_OPEN_MAX_COUNT; ++j) {
+		if (fd_table[j].entry == NULL) {
+			fd_table_index = j;
+			break;
+		}
+	}
+	// there are already %FS_OPEN_MAX_COUNT files currently open
+	if (fd_table_index == -1) {
+		return -1;
+	}
+	fd_table[fd_table_index].entry = &(root_directory.entry_array[file_index]);
+	fd_table[fd_table_index].flags = flags;
+	return fd_table_index;
+}
+
+int fs_close(int fd)
+{
+	FS_LOCK();
+	trace(FS_TRACE_CLOSE, fd, 0, 0, 0, NULL, NULL);
+	// No FS mounted
+	if (!superblock.signature || superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	// if file descriptor @fd is invalid (out of bounds or not currently open)
+	if (fd >= FS_OPEN_MAX_COUNT || !fd_table[fd].entry) {
+		return -1;
+	}
+	fd_table[fd] = (const struct file_descriptor){ 0 };
+	return 0;
+}
+
+int fs_stat(int fd)
+{
+	FS_LOCK();
+	trace(FS_TRACE_STAT, fd, 0, 0, 0, NULL, NULL);
+	// No FS mounted
+	if (!superblock.signature || superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	// if file descriptor @fd is invalid (out of bounds or not currently open)
+	if (fd >= FS_OPEN_MAX_COUNT || !fd_table[fd].entry) {
+		return -1;
+	}
+	return fd_table[fd].entry -> file_size;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	FS_LOCK();
+	trace(FS_TRACE_LSEEK, fd, 0, offset, 0, NULL, NULL);
+	// No FS mounted
+	if (!superblock.signature || superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	// if file descriptor @fd is invalid (out of bounds or not currently open)
+	if (fd >= FS_OPEN_MAX_COUNT || !fd_table[fd].entry) {
+		return -1;
+	}
+	// seeking past the end of the file is allowed, writing there leaves a
+	// hole, but sizes are reported as int
+	if (offset > INT_MAX) {
+		return -1;
+	}
+	fd_table[fd].offset = offset;
+	return 0;
+}
+
+int fs_seek(int fd, size_t offset, int whence)
+{
+	FS_LOCK();
+	trace(FS_TRACE_SEEK, fd, 0, offset, whence, NULL, NULL);
+	if (!fd_is_valid(fd) || (whence != FS_SEEK_DATA && whence != FS_SEEK_HOLE)) {
+		return -1;
+	}
+	struct entry *entry = fd_table[fd].entry;
+	if (offset >= entry->file_size) {
+		return -1;
+	}
+	long found;
+	if (entry->flags & ENTRY_MAPPED) {
+		found = mfile_seek(entry, offset, whence == FS_SEEK_HOLE);
+	} else {
+		// the other files are data up to their end
+		found = whence == FS_SEEK_HOLE ? (long)entry->file_size : (long)offset;
+	}
+	if (found < 0) {
+		return -1;
+	}
+	fd_table[fd].offset = found;
+	return found;
+}
+
+int fs_set_compression(int fd, int enable)
+{
+	FS_LOCK();
+	trace(FS_TRACE_SET_COMPRESSION, fd, 0, 0, enable != 0, NULL, NULL);
+	if (!fd_is_valid(fd)) {
+		return -1;
+	}
+	// the layout of a file cannot change once it holds data
+	struct entry *entry = fd_table[fd].entry;
+	if (entry->file_size != 0 || entry->datablk_start_index != FAT_EOC) {
+		return -1;
+	}
+	if (enable) {
+		entry->flags = (entry->flags & ~ENTRY_MAPPED) | ENTRY_COMPRESSED;
+	} else {
+		entry->flags &= ~ENTRY_COMPRESSED;
+	}
+	return 0;
+}
+
+int fs_set_dedup(int fd, int enable)
+{
+	FS_LOCK();
+	trace(FS_TRACE_SET_DEDUP, fd, 0, 0, enable != 0, NULL, NULL);
+	if (!fd_is_valid(fd)) {
+		return -1;
+	}
+	// the layout of a file cannot change once it holds data
+	struct entry *entry = fd_table[fd].entry;
+	if (entry->file_size != 0 || entry->datablk_start_index != FAT_EOC) {
+		return -1;
+	}
+	if (enable) {
+		entry->flags = (entry->flags & ~(ENTRY_COMPRESSED | ENTRY_SPARSE)) | ENTRY_DEDUP;
+	} else {
+		entry->flags &= ~ENTRY_DEDUP;
+	}
+	return 0;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	FS_LOCK();
+	trace(FS_TRACE_WRITE, fd, count, 0, 0, NULL, NULL);
+	if (fd >= FS_OPEN_MAX_COUNT ) { 
+		return -1;
+	}
+	if (superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	if (fd_table[fd].entry == NULL ) {
+		return -1;
+	}
+	if (buf == NULL) {
+		return -1;
+	}
+        if (count == 0){
+		return 0;
+	}
+	fd_stream(fd);
+	if (fd_table[fd].flags & FS_OPEN_APPEND) {
+		return fd_append(fd, buf, count);
+	}
+	int written_count = file_write(fd_table[fd].entry, buf, count, fd_table[fd].offset);
+	if (written_count > 0) {
+		fd_table[fd].offset += written_count;
+	}
+	return written_count;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	FS_LOCK();
+	trace(FS_TRACE_READ, fd, count, 0, 0, NULL, NULL);
+	if (fd >= FS_OPEN_MAX_COUNT ) { 
+		return -1;
+	}
+	if (superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	if (fd_table[fd].entry == NULL ) {
+		return -1;
+	}
+	if (buf == NULL) {
+		return -1;
+	}
+        if (count == 0){
+		return 0;
+	}
+	fd_stream(fd);
+	int read_count = file_read(fd_table[fd].entry, buf, count, fd_table[fd].offset);
+	fd_advise_read(fd, fd_table[fd].offset, read_count);
+	fd_table[fd].offset += read_count;
+	return read_count;
+}
+
+// read into the buffers of @iov in turn, starting at @offset of the file
+static int file_readv(struct entry *entry, const struct iovec *iov, int iovcnt, size_t offset)
+{
+	int total_read_count = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		int read_count = file_read(entry, iov[i].iov_base, iov[i].iov_len, offset + total_read_count);
+		total_read_count += read_count;
+		if ((size_t)read_count < iov[i].iov_len) {
+			break;
+		}
+	}
+	return total_read_count;
+}
+
+// write the buffers of @iov in turn, starting at @offset of the file
+static int file_writev(struct entry *entry, const struct iovec *iov, int iovcnt, size_t offset)
+{
+	int total_written_count = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		int written_count = file_write(entry, iov[i].iov_base, iov[i].iov_len,
+					 offset + total_written_count);
+		if (written_count < 0) {
+			return total_written_count ? total_written_count : -1;
+		}
+		total_written_count += written_count;
+		if ((size_t)written_count < iov[i].iov_len) {
+			break;
+		}
+	}
+	return total_written_count;
+}
+
+// whether every buffer of @iov is valid
+static int iov_is_valid(const struct iovec *iov, int iovcnt)
+{
+	if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
+		return 0;
+	}
+	for (int i = 0; i < iovcnt; ++i) {
+		if (iov[i].iov_base == NULL && iov[i].iov_len != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// record a call to vectored @op in the trace, if any, with the total size of
+// @iov: the replay splits it evenly between the buffers
+static void trace_iov(uint8_t op, int fd, const struct iovec *iov, int iovcnt)
+{
+	if (!trace_enabled()) {
+		return;
+	}
+	size_t count = 0;
+	for (int i = 0; iov && i < iovcnt; ++i) {
+		count += iov[i].iov_len;
+	}
+	struct fs_trace_record record = {
+		.count = count > UINT32_MAX ? UINT32_MAX : count,
+		.fd = fd,
+		.iovcnt = iovcnt < 0 ? 0 : iovcnt,
+		.op = op,
+	};
+	trace_write(&record, NULL, NULL);
+}
+
+// record a call to fs_copy_range() in the trace, if any
+static void trace_copy(int src_fd, size_t src_off, int dst_fd, size_t dst_off, size_t len)
+{
+	if (!trace_enabled()) {
+		return;
+	}
+	struct fs_trace_record record = {
+		.offset = src_off,
+		.count = len > UINT32_MAX ? UINT32_MAX : len,
+		.fd = src_fd,
+		.op = FS_TRACE_COPY_RANGE,
+		.offset2 = dst_off,
+		.fd2 = dst_fd,
+	};
+	trace_write(&record, NULL, NULL);
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	FS_LOCK();
+	trace_iov(FS_TRACE_READV, fd, iov, iovcnt);
+	if (!fd_is_valid(fd) || !iov_is_valid(iov, iovcnt)) {
+		return -1;
+	}
+	fd_stream(fd);
+	int read_count = file_readv(fd_table[fd].entry, iov, iovcnt, fd_table[fd].offset);
+	fd_advise_read(fd, fd_table[fd].offset, read_count);
+	fd_table[fd].offset += read_count;
+	return read_count;
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	FS_LOCK();
+	trace_iov(FS_TRACE_WRITEV, fd, iov, iovcnt);
+	if (!fd_is_valid(fd) || !iov_is_valid(iov, iovcnt)) {
+		return -1;
+	}
+	fd_stream(fd);
+	if (fd_table[fd].flags & FS_OPEN_APPEND) {
+		// the buffers are appended as a single range
+		if (iovcnt == 1) {
+			return fd_append(fd, iov[0].iov_base, iov[0].iov_len);
+		}
+		size_t count = 0;
+		for (int i = 0; i < iovcnt; ++i) {
+			count += iov[i].iov_len;
+		}
+		uint8_t *buf = malloc(count ? count : 1);
+		if (!buf) {
+			return -1;
+		}
+		size_t copied = 0;
+		for (int i = 0; i < iovcnt; ++i) {
+			memcpy(buf + copied, iov[i].iov_base, iov[i].iov_len);
+			copied += iov[i].iov_len;
+		}
+		int written_count = fd_append(fd, buf, count);
+		free(buf);
+		return written_count;
+	}
+	int written_count = file_writev(fd_table[fd].entry, iov, iovcnt, fd_table[fd].offset);
+	if (written_count > 0) {
+		fd_table[fd].offset += written_count;
+	}
+	return written_count;
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	FS_LOCK();
+	trace(FS_TRACE_PREAD, fd, count, offset, 0, NULL, NULL);
+	if (!fd_is_valid(fd) || buf == NULL) {
+		return -1;
+	}
+	fd_stream(fd);
+	int read_count = file_read(fd_table[fd].entry, buf, count, offset);
+	fd_advise_read(fd, offset, read_count);
+	return read_count;
+}
+
+int fs_advise(int fd, size_t offset, size_t len, int hint)
+{
+	FS_LOCK();
+	trace(FS_TRACE_ADVISE, fd, len, offset, hint, NULL, NULL);
+	if (!fd_is_valid(fd)) {
+		return -1;
+	}
+	fd_stream(fd);
+	struct file_descriptor *desc = &fd_table[fd];
+	// a length of 0 extends to the end of the file, whatever its size
+	size_t end = len && len <= SIZE_MAX - offset ? offset + len : SIZE_MAX;
+	switch (hint) {
+	case FS_ADVISE_NORMAL:
+	case FS_ADVISE_SEQUENTIAL:
+	case FS_ADVISE_RANDOM:
+		// access patterns apply to the whole file
+		desc->pattern = hint;
+		desc->readahead_end = 0;
+		return 0;
+	case FS_ADVISE_WILLNEED:
+		file_advise(desc->entry, offset, end - offset, BLOCK_ADVISE_WILLNEED);
+		return 0;
+	case FS_ADVISE_DONTNEED:
+		file_advise(desc->entry, offset, end - offset, BLOCK_ADVISE_DONTNEED);
+		return 0;
+	case FS_ADVISE_NOREUSE:
+		// and so are the blocks read through @fd later on
+		desc->noreuse_start = offset;
+		desc->noreuse_end = end;
+		file_advise(desc->entry, offset, end - offset, BLOCK_ADVISE_NOREUSE);
+		return 0;
+	}
+	return -1;
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+	FS_LOCK();
+	trace(FS_TRACE_PWRITE, fd, count, offset, 0, NULL, NULL);
+	if (!fd_is_valid(fd) || buf == NULL) {
+		return -1;
+	}
+	fd_stream(fd);
+	return file_write(fd_table[fd].entry, buf, count, offset);
+}
+
+// map the disk blocks holding the range of @m if they are contiguous, and
+// return the address of the range in the mapping, NULL if they cannot be
+static uint8_t *mapping_direct(struct file_mapping *m)
+{
+	struct entry *entry = m->entry;
+	// compressed and mapped content is not stored in file order
+	if (entry->flags & (ENTRY_COMPRESSED | ENTRY_MAPPED)) {
+		return NULL;
+	}
+	if (delalloc_flush(entry)) {
+		return NULL;
+	}
+	size_t first = m->offset / BLOCK_SIZE;
+	size_t count = (m->offset + m->len + BLOCK_SIZE - 1) / BLOCK_SIZE - first;
+	// blocks written through the mapping must only belong to this file
+	if ((m->flags & FS_MMAP_WRITE) && file_unshare(entry, first + count)) {
+		return NULL;
+	}
+	uint16_t block = entry->datablk_start_index;
+	for (size_t i = 0; i < first && fat_is_block(block); ++i) {
+		block = FAT[block];
+	}
+	if (!fat_is_block(block)) {
+		return NULL;
+	}
+	uint16_t start = block;
+	for (size_t i = 1; i < count; ++i) {
+		if (FAT[block] != block + 1) {
+			return NULL;
+		}
+		block++;
+	}
+	uint8_t *addr = block_map(start + superblock.datablk_start_index, count,
+				  m->flags & FS_MMAP_WRITE);
+	if (!addr) {
+		return NULL;
+	}
+	m->block = start + superblock.datablk_start_index;
+	m->block_count = count;
+	return addr + m->offset % BLOCK_SIZE;
+}
+
+void *fs_mmap(int fd, size_t offset, size_t len, int flags)
+{
+	FS_LOCK();
+	if (!fd_is_valid(fd) || (flags & ~FS_MMAP_WRITE) || len == 0) {
+		return NULL;
+	}
+	fd_stream(fd);
+	struct entry *entry = fd_table[fd].entry;
+	// mappings cannot extend the file, and compressed content can only be
+	// written at its end
+	if (offset > entry->file_size || len > entry->file_size - offset
+	    || ((flags & FS_MMAP_WRITE) && (entry->flags & ENTRY_COMPRESSED))) {
+		return NULL;
+	}
+	struct file_mapping *m = NULL;
+	for (int i = 0; i < MAPPING_MAX_COUNT && !m; ++i) {
+		if (!mappings[i].addr) {
+			m = &mappings[i];
+		}
+	}
+	if (!m) {
+		return NULL;
+	}
+	// the appenders may still be copying to the range
+	append_wait(entry - root_directory.entry_array);
+	*m = (struct file_mapping){ .entry = entry, .offset = offset, .len = len, .flags = flags };
+	m->addr = mapping_direct(m);
+	if (m->addr) {
+		return m->addr;
+	}
+
+	// fall back on a copy read through the block cache
+	uint8_t *copy = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (copy == MAP_FAILED) {
+		return NULL;
+	}
+	if (file_read(entry, copy, len, offset) != (int)len
+	    || (!(flags & FS_MMAP_WRITE) && mprotect(copy, len, PROT_READ))) {
+		munmap(copy, len);
+		return NULL;
+	}
+	m->addr = copy;
+	return copy;
+}
+
+int fs_munmap(void *addr)
+{
+	FS_LOCK();
+	struct file_mapping *m = NULL;
+	for (int i = 0; i < MAPPING_MAX_COUNT && addr && !m; ++i) {
+		if (mappings[i].addr == addr) {
+			m = &mappings[i];
+		}
+	}
+	if (!m) {
+		return -1;
+	}
+	int ret = 0;
+	if (m->block_count) {
+		ret = block_unmap(m->addr - m->offset % BLOCK_SIZE, m->block, m->block_count,
+				  m->flags & FS_MMAP_WRITE);
+	} else {
+		// the copy is written back as a whole
+		if ((m->flags & FS_MMAP_WRITE)
+		    && file_write(m->entry, m->addr, m->len, m->offset) != (int)m->len) {
+			ret = -1;
+		}
+		if (munmap(m->addr, m->len)) {
+			ret = -1;
+		}
+	}
+	*m = (const struct file_mapping){ 0 };
+	return ret;
+}
+
+/* Bytes copied at once by fs_copy_range() */
+#define COPY_CHUNK_SIZE (64 * BLOCK_SIZE)
+
+// copy @len bytes at @src_off of the file described by @src to @dst_off of
+// the one described by @dst, a chunk at a time through the block cache
+static int file_copy(struct entry *src, size_t src_off, struct entry *dst, size_t dst_off,
+		     size_t len)
+{
+	// aligned, so that the blocks missing from the cache are read straight
+	// into the buffer
+	size_t size = len < COPY_CHUNK_SIZE ? (len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE
+		: COPY_CHUNK_SIZE;
+	uint8_t *buf = aligned_alloc(BLOCK_SIZE, size);
+	if (!buf) {
+		return -1;
+	}
+	size_t copied = 0;
+	int error = 0;
+	while (copied < len) {
+		size_t count = len - copied < size ? len - copied : size;
+		int read_count = file_read(src, buf, count, src_off + copied);
+		if (read_count <= 0) {
+			error = read_count < 0;
+			break;
+		}
+		int written_count = file_write(dst, buf, read_count, dst_off + copied);
+		if (written_count < 0) {
+			error = 1;
+			break;
+		}
+		copied += written_count;
+		// disk is full
+		if (written_count < read_count) {
+			break;
+		}
+	}
+	free(buf);
+	return copied || !error ? (int)copied : -1;
+}
+
+int fs_copy_range(int src_fd, size_t src_off, int dst_fd, size_t dst_off, size_t len)
+{
+	FS_LOCK();
+	trace_copy(src_fd, src_off, dst_fd, dst_off, len);
+	if (!fd_is_valid(src_fd) || !fd_is_valid(dst_fd) || dst_off > INT_MAX) {
+		return -1;
+	}
+	fd_stream(src_fd);
+	struct entry *src = fd_table[src_fd].entry;
+	struct entry *dst = fd_table[dst_fd].entry;
+	// the copy gets the published content only
+	append_wait(src - root_directory.entry_array);
+	append_wait(dst - root_directory.entry_array);
+	if (src_off >= src->file_size) {
+		return 0;
+	}
+	if (len > src->file_size - src_off) {
+		len = src->file_size - src_off;
+	}
+	// sizes are reported as int
+	if (len > INT_MAX - dst_off) {
+		len = INT_MAX - dst_off;
+	}
+	// a range cannot be copied over itself
+	if (src == dst && src_off < dst_off + len && dst_off < src_off + len) {
+		return -1;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	// a whole plain file copied to an empty one shares its blocks, as a clone
+	if (src != dst && src_off == 0 && dst_off == 0 && len == src->file_size
+	    && !(src->flags & (ENTRY_COMPRESSED | ENTRY_MAPPED))
+	    && !(dst->flags & (ENTRY_COMPRESSED | ENTRY_MAPPED))
+	    && dst->file_size == 0 && dst->datablk_start_index == FAT_EOC
+	    && !file_mapped(src, 1, FS_MMAP_WRITE)) {
+		if (delalloc_flush(src)) {
+			return -1;
+		}
+		chain_share(src, dst);
+		return len;
+	}
+
+	// whole blocks of mapped files are linked into the destination's map,
+	// between files of the same kind so that deduplicated blocks stay indexed
+	size_t shared = 0;
+	if ((src->flags & ENTRY_MAPPED) && (src->flags & ENTRY_MAPPED) == (dst->flags & ENTRY_MAPPED)
+	    && src_off % BLOCK_SIZE == 0 && dst_off % BLOCK_SIZE == 0 && len >= BLOCK_SIZE) {
+		int linked = mfile_share(src, src_off / BLOCK_SIZE, dst, dst_off / BLOCK_SIZE,
+					 len / BLOCK_SIZE);
+		if (linked < 0) {
+			return -1;
+		}
+		shared = linked;
+		if (dst->file_size < dst_off + shared) {
+			dst->file_size = dst_off + shared;
+		}
+		if (shared < len / BLOCK_SIZE * BLOCK_SIZE) {
+			return shared;
+		}
+	}
+	int copied = file_copy(src, src_off + shared, dst, dst_off + shared, len - shared);
+	if (copied < 0) {
+		return shared ? (int)shared : -1;
+	}
+	return shared + copied;
+}
+
+// swap the physical location of data blocks @a and @b (@b may be free) and
+// rename every FAT link and directory entry that pointed to either of them
+static int defrag_swap(uint16_t a, uint16_t b)
+{
+	uint8_t data_a[BLOCK_SIZE], data_b[BLOCK_SIZE];
+	int b_used = FAT[b] != FAT_FREE;
+
+	if (block_read(a + superblock.datablk_start_index, data_a)) {
+		return -1;
+	}
+	if (b_used && block_read(b + superblock.datablk_start_index, data_b)) {
+		return -1;
+	}
+	if (block_write(b + superblock.datablk_start_index, data_a)) {
+		return -1;
+	}
+	if (b_used && block_write(a + superblock.datablk_start_index, data_b)) {
+		return -1;
+	}
+
+	for (int i = 0; i < superblock.datablk_amount; ++i) {
+		if (FAT[i] == a) {
+			fat_set(i, b);
+		} else if (FAT[i] == b && b_used) {
+			fat_set(i, a);
+		}
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		struct entry *entry = &root_directory.entry_array[i];
+		if (entry->filename[0] == '\0') {
+			continue;
+		}
+		if (entry->datablk_start_index == a) {
+			entry->datablk_start_index = b;
+		} else if (entry->datablk_start_index == b && b_used) {
+			entry->datablk_start_index = a;
+		}
+	}
+	uint16_t tmp = FAT[a];
+	fat_set(a, FAT[b]);
+	fat_set(b, tmp);
+	uint32_t links = refcount[a];
+	refcount[a] = refcount[b];
+	refcount[b] = links;
+	return 0;
+}
+
+int fs_defrag(size_t max_moves)
+{
+	FS_LOCK();
+	trace(FS_TRACE_DEFRAG, -1, 0, max_moves, 0, NULL, NULL);
+	// No FS mounted
+	if (superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	append_wait(-1);
+	// the blocks mapped cannot move
+	if (delalloc_flush_all() || file_mapped(NULL, 1, 0)) {
+		return -1;
+	}
+	size_t moves = 0;
+	// data block 0 is reserved, files are packed right after it
+	uint16_t cursor = 1;
+	while (cursor < superblock.datablk_amount && FAT[cursor] == FAT_MAPPED) {
+		cursor++;
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		struct entry *entry = &root_directory.entry_array[i];
+		if (entry->filename[0] == '\0') {
+			continue;
+		}
+		uint16_t block = entry->datablk_start_index;
+		while (block != FAT_EOC && block < superblock.datablk_amount) {
+			// already placed (shared or looping chain), nothing left to move
+			if (block < cursor) {
+				break;
+			}
+			if (block != cursor) {
+				if (moves == max_moves) {
+					return 1;
+				}
+				if (defrag_swap(block, cursor)) {
+					return -1;
+				}
+				moves++;
+				block = cursor;
+			}
+			cursor++;
+			// data blocks of deduplicated files stay where their maps
+			// point to
+			while (cursor < superblock.datablk_amount && FAT[cursor] == FAT_MAPPED) {
+				cursor++;
+			}
+			block = FAT[block];
+		}
+	}
+	return 0;
+}
+
+int fs_frag_info(void)
+{
+	FS_LOCK();
+	// No FS mounted
+	if (superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	int file_count = 0, file_extents = 0, fragmented_files = 0;
+	int free_extents = 0, largest_free = 0, free_run = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		struct entry *entry = &root_directory.entry_array[i];
+		if (entry->filename[0] == '\0' || entry->datablk_start_index == FAT_EOC) {
+			continue;
+		}
+		int extents = chain_extents(entry->datablk_start_index);
+		file_count++;
+		file_extents += extents;
+		if (extents > 1) {
+			fragmented_files++;
+		}
+	}
+	for (int i = 1; i <= superblock.datablk_amount; ++i) {
+		if (i < superblock.datablk_amount && FAT[i] == FAT_FREE) {
+			free_run++;
+			continue;
+		}
+		if (free_run) {
+			free_extents++;
+			if (free_run > largest_free) {
+				largest_free = free_run;
+			}
+		}
+		free_run = 0;
+	}
+	fprintf(stdout, "FS Frag:\n");
+	fprintf(stdout, "file_count=%d\n",		file_count);
+	fprintf(stdout, "file_extent_count=%d\n",	file_extents);
+	fprintf(stdout, "fragmented_file_count=%d\n",	fragmented_files);
+	fprintf(stdout, "free_extent_count=%d\n",	free_extents);
+	fprintf(stdout, "largest_free_extent=%d\n",	largest_free);
+	return 0;
+}
+
+/* Maximum number of threads walking FAT chains in fs_fsck() */
+#define FSCK_MAX_THREADS 16
+/* Ownership map value of the blocks linked from deduplicated file maps */
+#define FSCK_OWNER_MAPPED 0xFF
+
+/* Inconsistencies a FAT chain walk can run into */
+enum fsck_problem {
+	FSCK_OK,
+	FSCK_BAD_LINK,		/* link out of the data area, or bad EOC marker */
+	FSCK_FREE_LINK,		/* link to a block marked as free */
+	FSCK_CROSS_LINK,	/* block already owned by another file */
+	FSCK_LOOP,		/* block already visited by the same file */
+};
+
+struct fsck_file {
+	/* Number of valid blocks in the chain */
+	uint16_t block_count;
+	/* Last valid block of the chain, FAT_EOC if none */
+	uint16_t last_block;
+	enum fsck_problem problem;
+	/* Owner of the cross-linked block, or of the block where the chain
+	 * joins the chain of a clone */
+	int other_file;
+	/* Whether the chain shares blocks with the chain of a clone */
+	int shared;
+};
+
+struct fsck_state {
+	/* Next root directory entry to walk */
+	int next_file;
+	/* Whether the chains are being claimed, or checked */
+	int claiming;
+	/* Owner of each data block: lowest root directory index + 1 of the
+	 * files reaching it, 0 if none, or FSCK_OWNER_MAPPED for the data
+	 * blocks of deduplicated files */
+	uint8_t *owner;
+	/* Blocks already walked by the check of their owner's chain */
+	uint8_t *visited;
+	struct fsck_file files[FS_FILE_MAX_COUNT];
+};
+
+// claim the blocks of the FAT chain of one file in the ownership map, unless a
+// file of a lower index reaches them too, so that the owners do not depend on
+// the order in which the chains are walked
+static void fsck_claim(struct fsck_state *state, int file)
+{
+	uint16_t block = root_directory.entry_array[file].datablk_start_index;
+	uint8_t id = file + 1;
+
+	while (fat_is_block(block) && FAT[block] != FAT_FREE) {
+		uint8_t owner = __atomic_load_n(&state->owner[block], __ATOMIC_RELAXED);
+		do {
+			// the chain loops, or a lower file claims the rest of it
+			if (owner && owner <= id) {
+				return;
+			}
+		} while (!__atomic_compare_exchange_n(&state->owner[block], &owner, id,
+						      1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		block = FAT[block];
+	}
+}
+
+// walk the FAT chain of one file once all the chains are claimed, and check
+// that the file owns its blocks
+static void fsck_walk(struct fsck_state *state, int file)
+{
+	struct fsck_file *result = &state->files[file];
+	uint16_t block = root_directory.entry_array[file].datablk_start_index;
+
+	result->last_block = FAT_EOC;
+	while (block != FAT_EOC) {
+		if (block == 0 || block >= superblock.datablk_amount) {
+			result->problem = FSCK_BAD_LINK;
+			return;
+		}
+		if (FAT[block] == FAT_FREE) {
+			result->problem = FSCK_FREE_LINK;
+			return;
+		}
+		uint8_t owner = state->owner[block];
+		if (result->shared) {
+			// the rest of the chain is owned by the clone, only count it
+			if (result->block_count >= superblock.datablk_amount) {
+				result->problem = FSCK_LOOP;
+				return;
+			}
+		} else if (owner != file + 1) {
+			// clones legitimately join each other's chains
+			result->other_file = owner - 1;
+			if (root_directory.entry_array[file].flags & ENTRY_SHARED
+			    && root_directory.entry_array[owner - 1].flags & ENTRY_SHARED) {
+				result->shared = 1;
+			} else {
+				result->problem = FSCK_CROSS_LINK;
+				return;
+			}
+		} else if (state->visited[block]) {
+			result->problem = FSCK_LOOP;
+			return;
+		} else {
+			// only the owner of a block walks it here
+			state->visited[block] = 1;
+		}
+		result->block_count++;
+		result->last_block = block;
+		block = FAT[block];
+	}
+}
+
+static void *fsck_thread(void *arg)
+{
+	struct fsck_state *state = arg;
+	int file;
+
+	while ((file = __atomic_fetch_add(&state->next_file, 1, __ATOMIC_RELAXED))
+	       < FS_FILE_MAX_COUNT) {
+		if (root_directory.entry_array[file].filename[0] == '\0') {
+			continue;
+		}
+		if (state->claiming) {
+			fsck_claim(state, file);
+		} else {
+			fsck_walk(state, file);
+		}
+	}
+	return NULL;
+}
+
+// run one pass over all the chains on up to @nthreads threads
+static void fsck_pass(struct fsck_state *state, int claiming, long nthreads)
+{
+	pthread_t threads[FSCK_MAX_THREADS];
+	int started = 0;
+
+	state->next_file = 0;
+	state->claiming = claiming;
+	for (; started < nthreads - 1; ++started) {
+		if (pthread_create(&threads[started], NULL, fsck_thread, state)) {
+			break;
+		}
+	}
+	// also walk from this thread, which finishes the job if no thread started
+	fsck_thread(state);
+	for (int i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+// cut the chain of @file after its first @block_count blocks and free the rest
+static void fsck_truncate(struct fsck_state *state, int file, uint16_t block_count)
+{
+	struct entry *entry = &root_directory.entry_array[file];
+	uint16_t block = entry->datablk_start_index;
+
+	if (block_count == 0) {
+		entry->datablk_start_index = FAT_EOC;
+	} else {
+		for (uint16_t i = 1; i < block_count; ++i) {
+			block = FAT[block];
+		}
+		uint16_t last = block;
+		block = FAT[last];
+		fat_set(last, FAT_EOC);
+	}
+	// only free the blocks this file owns, a cross-linked tail is kept by
+	// its other owner
+	while (block != FAT_EOC && block < superblock.datablk_amount
+	       && state->owner[block] == file + 1) {
+		uint16_t next = FAT[block];
+		fat_set(block, FAT_FREE);
+		state->owner[block] = 0;
+		block = next;
+	}
+	if (entry->file_size > (uint32_t)block_count * BLOCK_SIZE) {
+		entry->file_size = (uint32_t)block_count * BLOCK_SIZE;
+	}
+}
+
+// claim the data blocks linked from the valid maps of deduplicated @file, and
+// return the number of invalid links found
+static int fsck_maps(struct fsck_state *state, int file, int repair)
+{
+	struct entry *entry = &root_directory.entry_array[file];
+	uint16_t map[MAP_SLOT_COUNT];
+	size_t map_count = mfile_map_count(entry);
+	int errors = 0;
+
+	if (map_count > state->files[file].block_count) {
+		map_count = state->files[file].block_count;
+	}
+	for (size_t i = 0; i < map_count; ++i) {
+		if (chain_read(entry, map, BLOCK_SIZE, i * BLOCK_SIZE) != BLOCK_SIZE) {
+			return errors + 1;
+		}
+		int bad_slots = 0;
+		for (int slot = 0; slot < MAP_SLOT_COUNT; ++slot) {
+			if (map[slot] == 0) {
+				continue;
+			}
+			if (!fat_is_block(map[slot]) || FAT[map[slot]] != FAT_MAPPED) {
+				bad_slots++;
+				map[slot] = 0;
+				continue;
+			}
+			state->owner[map[slot]] = FSCK_OWNER_MAPPED;
+		}
+		if (bad_slots) {
+			fprintf(stdout, "fsck: file '%s': %d invalid links in map block %zu\n",
+				entry->filename, bad_slots, i);
+			errors++;
+			// the content of these blocks is lost, read them as zeros
+			if (repair) {
+				chain_write(entry, map, BLOCK_SIZE, i * BLOCK_SIZE);
+			}
+		}
+	}
+	return errors;
+}
+
+int fs_fsck(int repair)
+{
+	FS_LOCK();
+	trace(FS_TRACE_FSCK, -1, 0, 0, repair != 0, NULL, NULL);
+	// No FS mounted
+	if (superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	// the chains of the files being appended to are longer than their size,
+	// the ones of the files with buffered data shorter
+	append_wait(-1);
+	if (delalloc_flush_all()) {
+		return -1;
+	}
+	struct fsck_state *state = calloc(1, sizeof(*state));
+	if (!state) {
+		return -1;
+	}
+	state->owner = calloc(superblock.datablk_amount, sizeof(*state->owner));
+	state->visited = calloc(superblock.datablk_amount, sizeof(*state->visited));
+	if (!state->owner || !state->visited) {
+		free(state->owner);
+		free(state->visited);
+		free(state);
+		return -1;
+	}
+
+	// walk all the chains in parallel, the FAT is only read at this point:
+	// once to find the owner of each block, the lowest file reaching it, and
+	// once to check the chains against the owners, so that the problems found
+	// and their repairs do not depend on which thread walks first
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > FSCK_MAX_THREADS) {
+		nthreads = FSCK_MAX_THREADS;
+	}
+	if (nthreads > FS_FILE_MAX_COUNT - rdir_free_blocks()) {
+		nthreads = FS_FILE_MAX_COUNT - rdir_free_blocks();
+	}
+	fsck_pass(state, 1, nthreads);
+	fsck_pass(state, 0, nthreads);
+	// the file owning the blocks where a clone joins its chain shares them
+	// too, owners have lower indexes so each file is marked once scanned
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		if (state->files[i].shared) {
+			state->files[state->files[i].other_file].shared = 1;
+		}
+	}
+
+	int errors = 0;
+	if (FAT[0] != FAT_EOC) {
+		fprintf(stdout, "fsck: reserved FAT entry 0 is %#x instead of EOC\n", FAT[0]);
+		errors++;
+		if (repair) {
+			fat_set(0, FAT_EOC);
+		}
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; ++i) {
+		struct entry *entry = &root_directory.entry_array[i];
+		struct fsck_file *result = &state->files[i];
+		if (entry->filename[0] == '\0') {
+			continue;
+		}
+		switch (result->problem) {
+		case FSCK_OK:
+			break;
+		case FSCK_BAD_LINK:
+			fprintf(stdout, "fsck: file '%s': invalid link after block %d\n",
+				entry->filename, result->block_count);
+			break;
+		case FSCK_FREE_LINK:
+			fprintf(stdout, "fsck: file '%s': link to a free block after block %d\n",
+				entry->filename, result->block_count);
+			break;
+		case FSCK_CROSS_LINK:
+			fprintf(stdout, "fsck: file '%s': cross-linked with file '%s' after block %d\n",
+				entry->filename, root_directory.entry_array[result->other_file].filename,
+				result->block_count);
+			break;
+		case FSCK_LOOP:
+			fprintf(stdout, "fsck: file '%s': chain loops after block %d\n",
+				entry->filename, result->block_count);
+			break;
+		}
+		if (result->problem != FSCK_OK) {
+			errors++;
+			if (repair) {
+				// keep the valid head of the chain, mark its end
+				if (result->last_block == FAT_EOC) {
+					entry->datablk_start_index = FAT_EOC;
+				} else {
+					fat_set(result->last_block, FAT_EOC);
+				}
+				// each map block of a mapped file covers many blocks
+				uint32_t max_size = (uint32_t)result->block_count * BLOCK_SIZE;
+				if (entry->flags & ENTRY_MAPPED) {
+					max_size *= MAP_SLOT_COUNT;
+				}
+				if (entry->file_size > max_size) {
+					entry->file_size = max_size;
+				}
+				// the clusters of a compressed file cannot be trusted anymore
+				if (entry->flags & ENTRY_COMPRESSED) {
+					fsck_truncate(state, i, 0);
+					entry->file_size = 0;
+				}
+			}
+		}
+		uint32_t expected = (entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		if (entry->flags & ENTRY_COMPRESSED && entry->file_size && result->problem == FSCK_OK) {
+			// index block followed by the compressed stream
+			struct cluster_index index;
+			if (chain_read(entry, &index, BLOCK_SIZE, 0) == BLOCK_SIZE) {
+				expected = 1 + (index.stream_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			}
+		}
+		if (entry->flags & ENTRY_MAPPED) {
+			expected = mfile_map_count(entry);
+			errors += fsck_maps(state, i, repair);
+		}
+		if (result->problem != FSCK_OK) {
+			// the broken chain already accounts for the size mismatch
+			continue;
+		} else if (result->block_count > expected) {
+			fprintf(stdout, "fsck: file '%s': %d blocks for a size of %d bytes\n",
+				entry->filename, result->block_count, entry->file_size);
+			errors++;
+			// cutting a chain shared with a clone would also cut the clone
+			if (repair && !result->shared) {
+				fsck_truncate(state, i, expected);
+			}
+		} else if (result->block_count < expected) {
+			fprintf(stdout, "fsck: file '%s': size of %d bytes exceeds its %d blocks\n",
+				entry->filename, entry->file_size, result->block_count);
+			errors++;
+			// a compressed file's size cannot be derived from its chain
+			if (repair && entry->flags & ENTRY_MAPPED) {
+				entry->file_size = (uint32_t)result->block_count * MAP_SLOT_COUNT * BLOCK_SIZE;
+			} else if (repair && !(entry->flags & ENTRY_COMPRESSED)) {
+				entry->file_size = (uint32_t)result->block_count * BLOCK_SIZE;
+			}
+		}
+	}
+
+	// blocks marked as used in the FAT but that no file owns
+	int leaked = 0;
+	for (int i = 1; i < superblock.datablk_amount; ++i) {
+		if (FAT[i] != FAT_FREE && !state->owner[i]) {
+			leaked++;
+			if (repair) {
+				fat_set(i, FAT_FREE);
+			}
+		}
+	}
+	for (int i = superblock.datablk_amount; i < superblock.fat_amount * FAT_BLOCK_ENTRIES; ++i) {
+		if (FAT[i] != FAT_FREE) {
+			leaked++;
+			if (repair) {
+				fat_set(i, FAT_FREE);
+			}
+		}
+	}
+	if (leaked) {
+		fprintf(stdout, "fsck: %d leaked blocks\n", leaked);
+		errors++;
+	}
+	// the count persisted in the superblock may be stale
+	if (fat_free_count != fat_free_blocks()) {
+		fprintf(stdout, "fsck: free block count is %d instead of %d\n",
+			fat_free_count, fat_free_blocks());
+		errors++;
+		if (repair) {
+			fat_free_count = fat_free_blocks();
+		}
+	}
+
+	if (repair) {
+		// compressed files may have been cut
+		cluster_cache_drop(NULL);
+		refcount_rebuild();
+		if (map_rebuild()) {
+			errors = -1;
+		}
+	}
+	free(state->owner);
+	free(state->visited);
+	free(state);
+	return errors;
+}
+
+int fs_trim(void)
+{
+	FS_LOCK();
+	trace(FS_TRACE_TRIM, -1, 0, 0, 0, NULL, NULL);
+	if (superblock.signature != FS_SIGNATURE) {
+		return -1;
+	}
+	// the buffered data gets its blocks, and the FAT that frees the other
+	// blocks is on disk before they are discarded
+	if (meta_sync() || block_sync()) {
+		return -1;
+	}
+	return discard_free_runs(1, superblock.datablk_amount);
+}
@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -12,6 +13,51 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Maximum number of data blocks in a file system */
+#define FS_DATA_BLK_MAX_COUNT 8192
+
+/*
+ * All the functions below can be called from several threads at once, they
+ * are serialized by a lock internal to the library.
+ */
+
+/** Information about a file, as returned by fs_readdir() */
+struct fs_dirent {
+	/** Name of the file */
+	char name[FS_FILENAME_LEN];
+	/** Size of the file in bytes */
+	size_t size;
+	/** First data block of the file, 0xFFFF if the file has none */
+	unsigned int first_block;
+	/** Number of runs of contiguous data blocks, with %FS_DIR_EXTENTS only */
+	unsigned int extents;
+};
+
+/** fs_opendir() flag: count the extents of each file */
+#define FS_DIR_EXTENTS 0x1
+
+/** Directory iterator, see fs_opendir() */
+struct fs_dir;
+
+/**
+ * fs_format - Create a new file system
+ * @diskname: Name of the virtual disk file
+ * @data_blk_count: Number of data blocks
+ * @reserved_blk_count: Number of blocks reserved before the data blocks
+ *
+ * Create virtual disk file @diskname and format it with an empty file system
+ * of @data_blk_count data blocks. @reserved_blk_count blocks are left unused
+ * between the root directory and the first data block. Only the superblock,
+ * the FAT and the root directory are written, the rest of the virtual disk
+ * file is left sparse.
+ *
+ * Return: -1 if @data_blk_count is 0 or larger than %FS_DATA_BLK_MAX_COUNT, if
+ * the disk would have too many blocks, or if the virtual disk file cannot be
+ * created or written. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blk_count,
+	      size_t reserved_blk_count);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,22 +66,73 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * Mounting only reads the superblock, the root directory and the FAT. The
+ * index of deduplicated blocks is loaded the first time it is needed. The
+ * file system is marked as mounted on disk until fs_umount(), so that the free
+ * block count persisted in the superblock is only trusted after a proper
+ * unmount.
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/** fs_mount_flags() flag: bypass the host's page cache */
+#define FS_MOUNT_DIRECT 0x1
+/** fs_mount_flags() flag: back the block buffers with huge pages if possible */
+#define FS_MOUNT_HUGEPAGES 0x2
+/** fs_mount_flags() flag: discard the data blocks that files free */
+#define FS_MOUNT_DISCARD 0x4
+
+/**
+ * fs_mount_flags - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of %FS_MOUNT_* flags
+ *
+ * Same as fs_mount(), with options. With %FS_MOUNT_DIRECT, the virtual disk
+ * file is accessed with O_DIRECT: its blocks are not cached by the host, so
+ * large disks do not compete for the host's memory and each access has a
+ * predictable latency. Reads and writes are fastest when their buffers are
+ * aligned on the I/O size of the host's file system (4 KiB usually), other
+ * buffers are copied. With %FS_MOUNT_HUGEPAGES, the buffers of the library are
+ * backed by huge pages when the host has some available. With
+ * %FS_MOUNT_DISCARD, the data blocks freed by deleted or truncated files are
+ * punched out of the virtual disk file (see fs_trim()) in the background, with
+ * the metadata that frees them.
+ *
+ * Return: -1 if fs_mount() would fail, or if the host's file system does not
+ * support O_DIRECT, or if %FS_MOUNT_DIRECT is requested with blocks smaller
+ * than 4 KiB (see disk.h). 0 otherwise.
+ */
+int fs_mount_flags(const char *diskname, int flags);
+
 /**
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file. The root directory, the FAT and the free block count are written
+ * back, and the file system is marked as unmounted properly.
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
- * closed, or if there are still open file descriptors. 0 otherwise.
+ * closed, or if there are still open file descriptors or mappings. 0
+ * otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Write the mounted file system back to disk
+ *
+ * Written data and metadata are cached, and written back to the virtual disk
+ * in the background: the data buffered by fs_write() gets its blocks and the
+ * FAT and the root directory are written back every second, the data blocks
+ * once they have been cached for a second or when too many of them are.
+ * Write everything back now, and wait until it is on disk.
+ *
+ * Return: -1 if no FS is currently mounted, or if some data could not be
+ * written back. 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -69,10 +166,27 @@ int fs_create(const char *filename);
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * delete, or if file @filename is currently open or mapped. 0 otherwise.
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_clone - Clone a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst with the same content as file @src, without
+ * copying any data: both files share their data blocks. A shared block is
+ * copied the first time it is written through either file, along with the
+ * shared blocks that precede it in that file.
+ *
+ * Return: -1 if no FS is currently mounted, or if @src or @dst is invalid, or
+ * if there is no file named @src, or if file @dst cannot be created (see
+ * fs_create()), or if @src has writable mappings of its disk blocks (see
+ * fs_mmap()). 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
 /**
  * fs_ls - List files on file system
  *
@@ -82,6 +196,41 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_opendir - Open the root directory for listing
+ * @flags: 0, or %FS_DIR_EXTENTS
+ *
+ * Take a snapshot of the files located in the root directory, to be listed
+ * with fs_readdir(). Files created or deleted after the snapshot is taken do
+ * not change what the iterator returns. Counting the extents of each file with
+ * %FS_DIR_EXTENTS walks their FAT chains, and is thus off by default.
+ *
+ * Return: NULL if no FS is currently mounted, or if memory cannot be
+ * allocated. Otherwise return an iterator to be freed with fs_closedir().
+ */
+struct fs_dir *fs_opendir(int flags);
+
+/**
+ * fs_readdir - Get the next file of a directory listing
+ * @dir: Iterator returned by fs_opendir()
+ * @dirent: Information about the file
+ *
+ * Fill @dirent with the information about the next file of @dir. Files are
+ * returned in the order of their root directory entries.
+ *
+ * Return: -1 if @dir is invalid, 0 if all the files of @dir have already been
+ * returned. 1 otherwise.
+ */
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *dirent);
+
+/**
+ * fs_closedir - Free a directory listing
+ * @dir: Iterator returned by fs_opendir()
+ *
+ * Return: -1 if @dir is invalid. 0 otherwise.
+ */
+int fs_closedir(struct fs_dir *dir);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -101,6 +250,28 @@ int fs_ls(void);
  */
 int fs_open(const char *filename);
 
+/** fs_open_flags() flag: fs_write() and fs_writev() append to the file */
+#define FS_OPEN_APPEND 0x1
+
+/**
+ * fs_open_flags - Open a file with options
+ * @filename: File name
+ * @flags: Bitwise OR of %FS_OPEN_* flags
+ *
+ * Same as fs_open(), with options. With %FS_OPEN_APPEND, fs_write() and
+ * fs_writev() ignore the file offset and append their data to the file as one
+ * range, even when other threads append to the same file concurrently, and
+ * leave the file offset at the end of that range. Concurrent appenders copy
+ * their data in parallel, and the file size grows in the order the ranges
+ * were reserved. An append is all or nothing: it returns -1 without changing
+ * the file if the disk cannot hold the whole range, or if a concurrent append
+ * of an earlier range failed. fs_pwrite() still writes at its offset.
+ *
+ * Return: -1 if fs_open() would fail, or if @flags is invalid. Otherwise,
+ * return the file descriptor.
+ */
+int fs_open_flags(const char *filename, int flags);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
@@ -133,12 +304,75 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * The offset can be past the end of the file. Writing there leaves a hole
+ * between the previous end of the file and the written data, which reads as
+ * zeros. Holes spanning whole blocks take no space on disk.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * than INT_MAX. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
+#define FS_SEEK_DATA 0
+#define FS_SEEK_HOLE 1
+
+/**
+ * fs_seek - Set file offset to the next data or hole
+ * @fd: File descriptor
+ * @offset: File offset to search from
+ * @whence: %FS_SEEK_DATA or %FS_SEEK_HOLE
+ *
+ * Find the first offset at or after @offset that holds data (%FS_SEEK_DATA),
+ * or that is in a hole (%FS_SEEK_HOLE), and set the file offset associated
+ * with file descriptor @fd to it. Data and holes are found with block
+ * granularity, and the end of the file counts as a hole. Only files with
+ * holes have any, the other files are a single run of data.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @whence is invalid, or
+ * if @offset is not before the end of the file, or if no data follows @offset
+ * with %FS_SEEK_DATA. Otherwise return the new file offset.
+ */
+int fs_seek(int fd, size_t offset, int whence);
+
+/**
+ * fs_set_compression - Enable or disable compression of a file
+ * @fd: File descriptor
+ * @enable: Whether the file content should be stored compressed
+ *
+ * Set whether the content of the file referenced by file descriptor @fd is
+ * compressed on disk. Compression is transparent: file sizes and offsets
+ * always refer to the uncompressed content, and any offset can be read without
+ * decompressing the whole file. A compressed file can however only be written
+ * at the end of its content, (i.e., at an offset that is past the beginning of
+ * its last cluster of 8 blocks, and not past its end), and cannot exceed
+ * a quarter of a block minus one clusters (1023 clusters of 32 KiB with the
+ * default 4 KiB blocks).
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the file is not empty.
+ * 0 otherwise.
+ */
+int fs_set_compression(int fd, int enable);
+
+/**
+ * fs_set_dedup - Enable or disable deduplication of a file
+ * @fd: File descriptor
+ * @enable: Whether the content of the file should be deduplicated
+ *
+ * Set whether the content of the file referenced by file descriptor @fd is
+ * deduplicated on disk. Each block of a deduplicated file is only stored if no
+ * block of any deduplicated file already holds the same content, and blocks of
+ * zeros are not stored at all. Deduplication is transparent and any offset can
+ * be written. Enabling deduplication disables compression, and vice versa.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the file is not empty.
+ * 0 otherwise.
+ */
+int fs_set_dedup(int fd, int enable);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -155,9 +389,16 @@ int fs_lseek(int fd, size_t offset);
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
+ * The bytes written past the blocks a file already has are buffered, and the
+ * blocks that hold them are only allocated when the file system is written
+ * back (see fs_sync()), in as few contiguous runs as possible. Enough free
+ * blocks are reserved for them meanwhile. Files deleted before then never get
+ * any block.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
- * return the number of bytes actually written.
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if the
+ * file is compressed and the offset is before its last cluster or past its
+ * end. Otherwise return the number of bytes actually written.
  */
 int fs_write(int fd, void *buf, size_t count);
 
@@ -182,4 +423,270 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_readv - Read from a file into multiple buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to be filled with data
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_read(), except that the data is scattered into the @iovcnt
+ * buffers described by @iov, each buffer being filled completely before the
+ * next one is. Whole blocks are read directly into the buffers.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iovcnt is negative, or
+ * if one of the buffers is NULL. Otherwise return the number of bytes actually
+ * read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_writev - Write to a file from multiple buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to write in the file
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_write(), except that the data is gathered from the @iovcnt
+ * buffers described by @iov, in order.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iovcnt is negative, or
+ * if one of the buffers is NULL. Otherwise return the number of bytes actually
+ * written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), except that the data is read from @offset and that the
+ * file offset of the file descriptor is left untouched. Several threads can
+ * therefore read from the same file descriptor concurrently.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * return the number of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write to
+ *
+ * Same as fs_write(), except that the data is written at @offset and that the
+ * file offset of the file descriptor is left untouched.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is larger than INT_MAX. Otherwise return the number of bytes actually
+ * written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_copy_range - Copy a range between files
+ * @src_fd: File descriptor of the file to copy from
+ * @src_off: Offset to copy from
+ * @dst_fd: File descriptor of the file to copy to
+ * @dst_off: Offset to copy to
+ * @len: Number of bytes to copy
+ *
+ * Copy @len bytes at @src_off of the file referenced by @src_fd to @dst_off of
+ * the file referenced by @dst_fd, without going through any buffer of the
+ * caller, and leave the file offsets of both file descriptors untouched. Like
+ * fs_write(), the destination grows as needed, and the copy stops early if the
+ * disk runs out of space.
+ *
+ * When possible, the data blocks are shared instead of copied, and copied on
+ * write later on: when a whole file is copied to an empty one, as with
+ * fs_clone(), and for the whole blocks copied between deduplicated files or
+ * between sparse files at block-aligned offsets. The rest is copied block by
+ * block, through large requests.
+ *
+ * Return: -1 if no FS is currently mounted, or if @src_fd or @dst_fd is
+ * invalid (out of bounds or not currently open), or if @dst_off is larger than
+ * INT_MAX, or if both ranges overlap in the same file, or if nothing could be
+ * copied because of an error. Otherwise return the number of bytes actually
+ * copied, which is smaller than @len if the source ends before.
+ */
+int fs_copy_range(int src_fd, size_t src_off, int dst_fd, size_t dst_off, size_t len);
+
+/* fs_advise() hints */
+#define FS_ADVISE_NORMAL 0	/* no particular access pattern, the default */
+#define FS_ADVISE_SEQUENTIAL 1	/* the file is read sequentially */
+#define FS_ADVISE_RANDOM 2	/* the file is read in random order */
+#define FS_ADVISE_WILLNEED 3	/* the range will be read soon */
+#define FS_ADVISE_DONTNEED 4	/* the range will not be read soon */
+#define FS_ADVISE_NOREUSE 5	/* the range is read once */
+
+/**
+ * fs_advise - Advise the file system about the use of a file
+ * @fd: File descriptor
+ * @offset: Offset of the range in the file
+ * @len: Length of the range in bytes, 0 for up to the end of the file
+ * @hint: One of the %FS_ADVISE_* values
+ *
+ * Tell the file system how the file referenced by file descriptor @fd will be
+ * read, so that it caches the right blocks. The most recently read blocks are
+ * cached in memory, until blocks read later on evict them.
+ *
+ * %FS_ADVISE_NORMAL, %FS_ADVISE_SEQUENTIAL and %FS_ADVISE_RANDOM apply to the
+ * whole file, through @fd only: with %FS_ADVISE_SEQUENTIAL, each read is
+ * followed by the background read of the content past it. With
+ * %FS_ADVISE_WILLNEED, the range is read into the cache in the background.
+ * With %FS_ADVISE_DONTNEED, it is dropped from the cache. With
+ * %FS_ADVISE_NOREUSE, its cached blocks, and the ones of the range read
+ * through @fd later on, are the first ones to be evicted, so that a scan does
+ * not evict blocks that other readers keep using. Advice is best effort, and
+ * does not change the content that is read.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @hint is invalid. 0
+ * otherwise.
+ */
+int fs_advise(int fd, size_t offset, size_t len, int hint);
+
+/** fs_mmap() flag: the mapping can be written to */
+#define FS_MMAP_WRITE 0x1
+
+/**
+ * fs_mmap - Map a file range in memory
+ * @fd: File descriptor
+ * @offset: Offset of the range in the file
+ * @len: Length of the range in bytes
+ * @flags: Bitwise OR of %FS_MMAP_* flags
+ *
+ * Map @len bytes at @offset of the file referenced by file descriptor @fd in
+ * memory, read-only unless @flags has %FS_MMAP_WRITE. When the range is held
+ * by contiguous blocks of a plain file, and the virtual disk file can map them
+ * (see block_map()), the mapping shows the blocks themselves, without any copy.
+ * Writes through it reach the disk directly. The blocks of a writable mapping
+ * are not cached until fs_munmap(), so that fs_read() and fs_write() stay
+ * coherent with it, while a read-only mapping only shows the writes made with
+ * fs_write() meanwhile once written back (see fs_sync()). Otherwise the
+ * mapping is a copy of the range, read through the block cache, and writes
+ * through it are written to the file by fs_munmap(). The mapping stays valid
+ * until fs_munmap(), even once @fd is closed.
+ *
+ * Return: the address of the range in memory, or NULL if no FS is currently
+ * mounted, or if file descriptor @fd is invalid (out of bounds or not
+ * currently open), or if @flags is invalid, or if @len is 0, or if the range
+ * goes past the end of the file, or if %FS_MMAP_WRITE is requested on a
+ * compressed file, or if the range cannot be mapped.
+ */
+void *fs_mmap(int fd, size_t offset, size_t len, int flags);
+
+/**
+ * fs_munmap - Unmap a file range
+ * @addr: Address returned by fs_mmap()
+ *
+ * Unmap the range mapped by fs_mmap() at @addr, writing its copy back to the
+ * file first if it is writable.
+ *
+ * Return: -1 if @addr is not a mapping returned by fs_mmap(), or if the copy
+ * cannot be written back in full. 0 otherwise.
+ */
+int fs_munmap(void *addr);
+
+/**
+ * fs_defrag - Defragment the file system
+ * @max_moves: Maximum number of data blocks to relocate during this call
+ *
+ * Relocate the data blocks of the files located in the root directory so that
+ * each file occupies one contiguous run of blocks, files being packed in root
+ * directory order at the beginning of the data area and free space being
+ * gathered at its end. The FAT and the directory entries are updated along
+ * the way, so files can stay open while the file system is being
+ * defragmented.
+ *
+ * The operation is incremental: at most @max_moves blocks are relocated per
+ * call, and the file system is consistent between two calls. A defragmentation
+ * can therefore be interrupted at any time and resumed later by calling
+ * fs_defrag() again.
+ *
+ * Return: -1 if no FS is currently mounted, or if a block cannot be relocated,
+ * or if disk blocks are mapped (see fs_mmap()). 1 if @max_moves blocks were
+ * relocated and there is still work left. 0 once every file is contiguous.
+ */
+int fs_defrag(size_t max_moves);
+
+/**
+ * fs_frag_info - Display fragmentation information about file system
+ *
+ * Display the number of extents (contiguous runs of data blocks) used by the
+ * files of the currently mounted file system, the number of fragmented files,
+ * and the number and largest size of free extents.
+ *
+ * Return: -1 if no FS is currently mounted. 0 otherwise.
+ */
+int fs_frag_info(void);
+
+/**
+ * fs_fsck - Check the consistency of the file system
+ * @repair: Whether inconsistencies should be repaired
+ *
+ * Check the FAT chains of all the files of the currently mounted file system
+ * in parallel and report inconsistencies: invalid links or end-of-chain
+ * markers, links to free blocks, cross-linked or looping chains, chains whose
+ * length does not match the file size, and leaked blocks (blocks marked as
+ * used that no file owns).
+ *
+ * If @repair is not 0, broken chains are cut at their last valid block, file
+ * sizes and chain lengths are made to match, and leaked blocks are freed. The
+ * repairs reach the disk when the file system is unmounted.
+ *
+ * Return: -1 if no FS is currently mounted, or if memory cannot be allocated.
+ * Otherwise return the number of inconsistencies that were found.
+ */
+int fs_fsck(int repair);
+
+/**
+ * fs_trim - Discard the free blocks of the file system
+ *
+ * Punch every run of free data blocks of the currently mounted file system out
+ * of the virtual disk file, so that the host reclaims their space and the
+ * virtual disk file only takes as much space as the content of the files.
+ * Free blocks read as zeros afterwards. Freeing blocks never shrinks the
+ * virtual disk file otherwise, unless the file system was mounted with
+ * %FS_MOUNT_DISCARD.
+ *
+ * Return: -1 if no FS is currently mounted, or if the host's file system
+ * cannot punch holes in files. Otherwise return the number of data blocks
+ * discarded.
+ */
+int fs_trim(void);
+
+/**
+ * fs_trace_start - Start recording a trace of the file system calls
+ * @tracename: Name of the trace file on the host computer
+ *
+ * Record every subsequent call to the functions of this file that operate on
+ * files, with its arguments and a timestamp, to host file @tracename. The data
+ * that is read or written is not recorded, only its size. The trace can be
+ * replayed with fs_replay.x to reproduce the workload on another disk.
+ *
+ * Programs that do not call this function can be traced by setting the
+ * FS_TRACE environment variable to the name of a trace file: the trace then
+ * starts at the first fs_mount().
+ *
+ * Return: -1 if @tracename is NULL or cannot be created, or if a trace is
+ * already being recorded, or if a FS is currently mounted. 0 otherwise.
+ */
+int fs_trace_start(const char *tracename);
+
+/**
+ * fs_trace_stop - Stop recording the trace of the file system calls
+ *
+ * Return: -1 if no trace is being recorded, or if the trace could not be
+ * written entirely. 0 otherwise.
+ */
+int fs_trace_stop(void);
+
 #endif /* _FS_H */
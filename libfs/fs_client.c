@@ -0,0 +1,398 @@
+#define _GNU_SOURCE /* for memfd_create() and file seals */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fs_client.h"
+#include "fs_proto.h"
+
+/* Directory listing, copied from the server by fsc_opendir() */
+struct fsc_dir {
+	int count;
+	/* Next entry returned by fsc_readdir() */
+	int next;
+	struct fs_dirent entries[FS_FILE_MAX_COUNT];
+};
+
+/* Connection to the server, -1 if not connected */
+static int sock = -1;
+/* Shared memory with the server */
+static uint8_t *shm;
+
+// send @req to the server, along with file descriptor @pass_fd if not -1, and
+// return the server's reply
+static int64_t request(struct fs_proto_request *req, int pass_fd)
+{
+	struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+	union {
+		struct cmsghdr header;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct fs_proto_reply reply;
+
+	if (pass_fd != -1) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+	}
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(*req)) {
+		return -1;
+	}
+	if (recv(sock, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply)) {
+		return -1;
+	}
+	return reply.ret;
+}
+
+// request @op on @fd or @filename, which does not carry any data
+static int request_simple(uint32_t op, int fd, const char *filename, int enable)
+{
+	struct fs_proto_request req = { .op = op, .fd = fd, .enable = enable };
+
+	if (sock == -1) {
+		return -1;
+	}
+	if (filename) {
+		// longer names cannot exist on the server
+		if (strlen(filename) >= FS_FILENAME_LEN) {
+			return -1;
+		}
+		strcpy(req.filename, filename);
+	}
+	return request(&req, -1);
+}
+
+// copy @len bytes between the shared memory and the buffers of @iov, starting
+// at byte @pos of the buffers
+static void iov_copy(const struct iovec *iov, int iovcnt, size_t pos, size_t len, int to_shm)
+{
+	size_t copied = 0;
+	for (int i = 0; i < iovcnt && copied < len; ++i) {
+		if (pos >= iov[i].iov_len) {
+			pos -= iov[i].iov_len;
+			continue;
+		}
+		size_t n = iov[i].iov_len - pos;
+		if (n > len - copied) {
+			n = len - copied;
+		}
+		uint8_t *base = (uint8_t *)iov[i].iov_base + pos;
+		if (to_shm) {
+			memcpy(shm + copied, base, n);
+		} else {
+			memcpy(base, shm + copied, n);
+		}
+		copied += n;
+		pos = 0;
+	}
+}
+
+// read or write the buffers of @iov through the shared memory, one chunk of
+// at most FS_PROTO_SHM_SIZE bytes per request
+static int request_io(uint32_t op, int fd, const struct iovec *iov, int iovcnt, size_t offset)
+{
+	int writing = op == FS_PROTO_WRITE || op == FS_PROTO_PWRITE;
+	size_t count = 0;
+
+	if (sock == -1 || iovcnt < 0 || (iovcnt > 0 && !iov)) {
+		return -1;
+	}
+	// reject what the server would, before copying from any buffer
+	for (int i = 0; i < iovcnt; ++i) {
+		if (!iov[i].iov_base && iov[i].iov_len) {
+			return -1;
+		}
+		count += iov[i].iov_len;
+	}
+	size_t total = 0;
+	do {
+		// the offset is only used by positional requests
+		struct fs_proto_request req = { .op = op, .fd = fd, .offset = offset + total };
+		req.count = count - total < FS_PROTO_SHM_SIZE ? count - total : FS_PROTO_SHM_SIZE;
+		if (writing) {
+			iov_copy(iov, iovcnt, total, req.count, 1);
+		}
+		int64_t ret = request(&req, -1);
+		if (ret < 0) {
+			// report the error only if nothing was transferred
+			return total ? (int)total : -1;
+		}
+		if (!writing) {
+			iov_copy(iov, iovcnt, total, ret, 0);
+		}
+		total += ret;
+		if ((uint64_t)ret < req.count) {
+			break;
+		}
+	} while (total < count);
+	return total;
+}
+
+int fsc_connect(const char *sockname)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct fs_proto_request req = { .op = FS_PROTO_HELLO };
+	int memfd;
+
+	if (sock != -1 || !sockname || strlen(sockname) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	strcpy(addr.sun_path, sockname);
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1) {
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		goto err_sock;
+	}
+
+	// the server maps the same memory once it receives the file descriptor
+	memfd = memfd_create("fs_client", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd == -1) {
+		goto err_sock;
+	}
+	// the server only maps memory whose size cannot change under it
+	if (ftruncate(memfd, FS_PROTO_SHM_SIZE)
+	    || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW)) {
+		goto err_memfd;
+	}
+	shm = mmap(NULL, FS_PROTO_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (shm == MAP_FAILED) {
+		goto err_memfd;
+	}
+	if (request(&req, memfd)) {
+		goto err_shm;
+	}
+	close(memfd);
+	return 0;
+
+err_shm:
+	munmap(shm, FS_PROTO_SHM_SIZE);
+err_memfd:
+	close(memfd);
+err_sock:
+	close(sock);
+	sock = -1;
+	return -1;
+}
+
+int fsc_disconnect(void)
+{
+	if (sock == -1) {
+		return -1;
+	}
+	munmap(shm, FS_PROTO_SHM_SIZE);
+	close(sock);
+	sock = -1;
+	return 0;
+}
+
+int fsc_sync(void)
+{
+	return request_simple(FS_PROTO_SYNC, -1, NULL, 0);
+}
+
+int fsc_create(const char *filename)
+{
+	return filename ? request_simple(FS_PROTO_CREATE, -1, filename, 0) : -1;
+}
+
+int fsc_delete(const char *filename)
+{
+	return filename ? request_simple(FS_PROTO_DELETE, -1, filename, 0) : -1;
+}
+
+int fsc_clone(const char *src, const char *dst)
+{
+	struct fs_proto_request req = { .op = FS_PROTO_CLONE };
+
+	if (sock == -1 || !src || !dst || strlen(src) >= FS_FILENAME_LEN
+	    || strlen(dst) >= FS_FILENAME_LEN) {
+		return -1;
+	}
+	strcpy(req.filename, src);
+	strcpy(req.filename2, dst);
+	return request(&req, -1);
+}
+
+struct fsc_dir *fsc_opendir(int flags)
+{
+	struct fs_proto_request req = { .op = FS_PROTO_OPENDIR, .enable = flags };
+	struct fsc_dir *dir;
+	int64_t count;
+
+	if (sock == -1) {
+		return NULL;
+	}
+	count = request(&req, -1);
+	if (count < 0 || count > FS_FILE_MAX_COUNT) {
+		return NULL;
+	}
+	dir = malloc(sizeof(*dir));
+	if (!dir) {
+		return NULL;
+	}
+	dir->count = count;
+	dir->next = 0;
+	memcpy(dir->entries, shm, count * sizeof(struct fs_dirent));
+	return dir;
+}
+
+int fsc_readdir(struct fsc_dir *dir, struct fs_dirent *dirent)
+{
+	if (!dir || !dirent) {
+		return -1;
+	}
+	if (dir->next == dir->count) {
+		return 0;
+	}
+	*dirent = dir->entries[dir->next++];
+	return 1;
+}
+
+int fsc_closedir(struct fsc_dir *dir)
+{
+	if (!dir) {
+		return -1;
+	}
+	free(dir);
+	return 0;
+}
+
+int fsc_open(const char *filename)
+{
+	return fsc_open_flags(filename, 0);
+}
+
+int fsc_open_flags(const char *filename, int flags)
+{
+	return filename ? request_simple(FS_PROTO_OPEN, -1, filename, flags) : -1;
+}
+
+int fsc_close(int fd)
+{
+	return request_simple(FS_PROTO_CLOSE, fd, NULL, 0);
+}
+
+int fsc_stat(int fd)
+{
+	return request_simple(FS_PROTO_STAT, fd, NULL, 0);
+}
+
+int fsc_lseek(int fd, size_t offset)
+{
+	struct fs_proto_request req = { .op = FS_PROTO_LSEEK, .fd = fd, .offset = offset };
+
+	if (sock == -1) {
+		return -1;
+	}
+	return request(&req, -1);
+}
+
+int fsc_seek(int fd, size_t offset, int whence)
+{
+	struct fs_proto_request req = {
+		.op = FS_PROTO_SEEK, .fd = fd, .offset = offset, .enable = whence
+	};
+
+	if (sock == -1) {
+		return -1;
+	}
+	return request(&req, -1);
+}
+
+int fsc_advise(int fd, size_t offset, size_t len, int hint)
+{
+	struct fs_proto_request req = {
+		.op = FS_PROTO_ADVISE, .fd = fd, .offset = offset, .len = len, .enable = hint
+	};
+
+	if (sock == -1) {
+		return -1;
+	}
+	return request(&req, -1);
+}
+
+int fsc_set_compression(int fd, int enable)
+{
+	return request_simple(FS_PROTO_SET_COMPRESSION, fd, NULL, enable);
+}
+
+int fsc_set_dedup(int fd, int enable)
+{
+	return request_simple(FS_PROTO_SET_DEDUP, fd, NULL, enable);
+}
+
+int fsc_write(int fd, void *buf, size_t count)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	if (!buf) {
+		return -1;
+	}
+	return request_io(FS_PROTO_WRITE, fd, &iov, 1, 0);
+}
+
+int fsc_read(int fd, void *buf, size_t count)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	if (!buf) {
+		return -1;
+	}
+	return request_io(FS_PROTO_READ, fd, &iov, 1, 0);
+}
+
+int fsc_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	return request_io(FS_PROTO_READ, fd, iov, iovcnt, 0);
+}
+
+int fsc_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return request_io(FS_PROTO_WRITE, fd, iov, iovcnt, 0);
+}
+
+int fsc_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	if (!buf) {
+		return -1;
+	}
+	return request_io(FS_PROTO_PREAD, fd, &iov, 1, offset);
+}
+
+int fsc_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	if (!buf) {
+		return -1;
+	}
+	return request_io(FS_PROTO_PWRITE, fd, &iov, 1, offset);
+}
+
+int fsc_copy_range(int src_fd, size_t src_off, int dst_fd, size_t dst_off, size_t len)
+{
+	struct fs_proto_request req = {
+		.op = FS_PROTO_COPY_RANGE, .fd = src_fd, .offset = src_off,
+		.fd2 = dst_fd, .offset2 = dst_off, .len = len
+	};
+
+	if (sock == -1) {
+		return -1;
+	}
+	return request(&req, -1);
+}
@@ -0,0 +1,134 @@
+#ifndef _FS_CLIENT_H
+#define _FS_CLIENT_H
+
+#include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
+
+#include "fs.h" /* for struct fs_dirent definition */
+
+/*
+ * Client library of fs_server.x. The server owns a mounted file system and
+ * serves it to many local processes at once. Each function below performs the
+ * fs_*() function of the same name on the server's file system, and returns
+ * what it returned. File descriptors are private to each client.
+ *
+ * Only the functions that operate on files are served. The ones that act on
+ * the whole file system, such as formatting, mounting, checking or
+ * defragmenting it, are left to the server, and fs_info(), fs_ls() and
+ * fs_frag_info() would print on the standard output of the server: none of
+ * them has an fsc_*() counterpart. Neither has fs_mmap(), whose mappings would
+ * live in the address space of the server.
+ */
+
+/**
+ * fsc_connect - Connect to a file system server
+ * @sockname: Path of the Unix domain socket of the server
+ *
+ * Connect to the fs_server.x listening on @sockname, and set up the shared
+ * memory through which file data is exchanged with the server. A client needs
+ * to be connected before it can use any other fsc_*() function, in the same
+ * way as a file system needs to be mounted before using the fs_*() functions.
+ *
+ * Return: -1 if the client is already connected, or if the server cannot be
+ * reached. 0 otherwise.
+ */
+int fsc_connect(const char *sockname);
+
+/**
+ * fsc_disconnect - Disconnect from the file system server
+ *
+ * Close the connection to the server. The files that are still open are
+ * closed by the server.
+ *
+ * Return: -1 if the client is not connected. 0 otherwise.
+ */
+int fsc_disconnect(void);
+
+/** fsc_sync - Write the file system back to disk, see fs_sync() */
+int fsc_sync(void);
+
+/** fsc_create - Create a new file, see fs_create() */
+int fsc_create(const char *filename);
+
+/** fsc_delete - Delete a file, see fs_delete() */
+int fsc_delete(const char *filename);
+
+/** fsc_clone - Clone a file, see fs_clone() */
+int fsc_clone(const char *src, const char *dst);
+
+/** Directory listing, see fsc_opendir() */
+struct fsc_dir;
+
+/**
+ * fsc_opendir - Open the root directory for listing, see fs_opendir()
+ *
+ * The whole listing is copied from the server at once: fsc_readdir() and
+ * fsc_closedir() do not send any request.
+ */
+struct fsc_dir *fsc_opendir(int flags);
+
+/** fsc_readdir - Get the next file of a directory listing, see fs_readdir() */
+int fsc_readdir(struct fsc_dir *dir, struct fs_dirent *dirent);
+
+/** fsc_closedir - Free a directory listing, see fs_closedir() */
+int fsc_closedir(struct fsc_dir *dir);
+
+/** fsc_open - Open a file, see fs_open() */
+int fsc_open(const char *filename);
+
+/** fsc_open_flags - Open a file with options, see fs_open_flags() */
+int fsc_open_flags(const char *filename, int flags);
+
+/** fsc_close - Close a file, see fs_close() */
+int fsc_close(int fd);
+
+/** fsc_stat - Get file status, see fs_stat() */
+int fsc_stat(int fd);
+
+/** fsc_lseek - Set file offset, see fs_lseek() */
+int fsc_lseek(int fd, size_t offset);
+
+/** fsc_seek - Set file offset to the next data or hole, see fs_seek() */
+int fsc_seek(int fd, size_t offset, int whence);
+
+/** fsc_advise - Advise about the use of a file, see fs_advise() */
+int fsc_advise(int fd, size_t offset, size_t len, int hint);
+
+/** fsc_set_compression - Enable or disable compression, see fs_set_compression() */
+int fsc_set_compression(int fd, int enable);
+
+/** fsc_set_dedup - Enable or disable deduplication, see fs_set_dedup() */
+int fsc_set_dedup(int fd, int enable);
+
+/**
+ * fsc_write - Write to a file, see fs_write()
+ *
+ * Writes larger than the shared memory of the client are split into several
+ * requests, and are not atomic with respect to other clients.
+ */
+int fsc_write(int fd, void *buf, size_t count);
+
+/**
+ * fsc_read - Read from a file, see fs_read()
+ *
+ * Reads larger than the shared memory of the client are split into several
+ * requests, and are not atomic with respect to other clients.
+ */
+int fsc_read(int fd, void *buf, size_t count);
+
+/** fsc_readv - Read from a file into several buffers, see fs_readv() */
+int fsc_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** fsc_writev - Write to a file from several buffers, see fs_writev() */
+int fsc_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/** fsc_pread - Read from a file at a given offset, see fs_pread() */
+int fsc_pread(int fd, void *buf, size_t count, size_t offset);
+
+/** fsc_pwrite - Write to a file at a given offset, see fs_pwrite() */
+int fsc_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/** fsc_copy_range - Copy a range between files, see fs_copy_range() */
+int fsc_copy_range(int src_fd, size_t src_off, int dst_fd, size_t dst_off, size_t len);
+
+#endif /* _FS_CLIENT_H */
@@ -0,0 +1,65 @@
+#ifndef _FS_PROTO_H
+#define _FS_PROTO_H
+
+#include <stdint.h>
+
+#include "fs.h"
+
+/*
+ * Protocol between fs_server.x and the client library. Each client connects to
+ * the server's Unix domain socket and passes it a shared memory file with the
+ * FS_PROTO_HELLO request. The client then sends one fixed-size request at a
+ * time, and waits for the matching reply. Data read or written by a request
+ * travels through the shared memory, never through the socket.
+ */
+
+/* Size of the shared memory of each client, the largest I/O of one request */
+#define FS_PROTO_SHM_SIZE (1024 * 1024)
+
+enum fs_proto_op {
+	FS_PROTO_HELLO,
+	FS_PROTO_CREATE,
+	FS_PROTO_DELETE,
+	FS_PROTO_CLONE,
+	FS_PROTO_OPEN,
+	FS_PROTO_CLOSE,
+	FS_PROTO_STAT,
+	FS_PROTO_LSEEK,
+	FS_PROTO_SET_COMPRESSION,
+	FS_PROTO_SET_DEDUP,
+	FS_PROTO_READ,
+	FS_PROTO_WRITE,
+	FS_PROTO_PREAD,
+	FS_PROTO_PWRITE,
+	FS_PROTO_OPENDIR,
+	FS_PROTO_SEEK,
+	FS_PROTO_ADVISE,
+	FS_PROTO_SYNC,
+	FS_PROTO_COPY_RANGE,
+};
+
+struct fs_proto_request {
+	/* One of enum fs_proto_op */
+	uint32_t op;
+	/* File descriptor, and flag or flags of the operation */
+	int32_t fd;
+	int32_t enable;
+	/* Size of the data in the shared memory */
+	uint32_t count;
+	uint64_t offset;
+	/* Length of the range of FS_PROTO_ADVISE and FS_PROTO_COPY_RANGE */
+	uint64_t len;
+	/* Destination of FS_PROTO_COPY_RANGE */
+	int32_t fd2;
+	uint64_t offset2;
+	char filename[FS_FILENAME_LEN];
+	/* Destination of FS_PROTO_CLONE */
+	char filename2[FS_FILENAME_LEN];
+};
+
+struct fs_proto_reply {
+	/* Return value of the fs_*() function */
+	int64_t ret;
+};
+
+#endif /* _FS_PROTO_H */
@@ -0,0 +1,75 @@
+#ifndef _FS_TRACE_H
+#define _FS_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Format of the traces recorded by fs_trace_start(), and replayed by
+ * fs_replay.x. A trace is a struct fs_trace_header followed by one struct
+ * fs_trace_record per call, in the order the calls were made. Each record is
+ * directly followed by the file names it carries, without terminators. The
+ * data that was read or written is not recorded, only its size.
+ */
+
+#define FS_TRACE_MAGIC 0x52545346 /* "FSTR" */
+#define FS_TRACE_VERSION 2
+
+enum fs_trace_op {
+	FS_TRACE_MOUNT,
+	FS_TRACE_UMOUNT,
+	FS_TRACE_CREATE,
+	FS_TRACE_DELETE,
+	FS_TRACE_CLONE,
+	FS_TRACE_OPEN,
+	FS_TRACE_CLOSE,
+	FS_TRACE_STAT,
+	FS_TRACE_LSEEK,
+	FS_TRACE_SEEK,
+	FS_TRACE_SET_COMPRESSION,
+	FS_TRACE_SET_DEDUP,
+	FS_TRACE_READ,
+	FS_TRACE_WRITE,
+	FS_TRACE_READV,
+	FS_TRACE_WRITEV,
+	FS_TRACE_PREAD,
+	FS_TRACE_PWRITE,
+	FS_TRACE_DEFRAG,
+	FS_TRACE_FSCK,
+	FS_TRACE_ADVISE,
+	FS_TRACE_SYNC,
+	FS_TRACE_COPY_RANGE,
+	FS_TRACE_TRIM,
+	FS_TRACE_OP_COUNT
+};
+
+struct fs_trace_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct fs_trace_record {
+	/* Nanoseconds since the start of the trace */
+	uint64_t time;
+	/* File offset, source offset of FS_TRACE_COPY_RANGE, or @max_moves of
+	 * FS_TRACE_DEFRAG */
+	uint64_t offset;
+	/* Number of bytes, or number of data blocks of FS_TRACE_MOUNT */
+	uint32_t count;
+	int32_t fd;
+	/* Number of buffers of FS_TRACE_READV and FS_TRACE_WRITEV */
+	uint32_t iovcnt;
+	/* One of enum fs_trace_op */
+	uint8_t op;
+	/* Flag argument: @enable, @whence, @repair, @hint or @flags of
+	 * fs_open_flags() */
+	uint8_t arg;
+	/* Length of the file name, and of the destination of FS_TRACE_CLONE */
+	uint8_t name_len;
+	uint8_t name2_len;
+	/* Destination offset and file descriptor of FS_TRACE_COPY_RANGE */
+	uint64_t offset2;
+	int32_t fd2;
+	uint32_t unused;
+};
+
+#endif /* _FS_TRACE_H */
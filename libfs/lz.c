@@ -0,0 +1,187 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Shortest back-reference worth encoding */
+#define LZ_MIN_MATCH 4
+/* The last match must start this many bytes before the end of the input */
+#define LZ_MATCH_LIMIT 12
+/* The last bytes of the input are always encoded as literals */
+#define LZ_LAST_LITERALS 5
+/* Farthest back-reference */
+#define LZ_MAX_OFFSET 65535
+
+#define LZ_HASH_BITS 12
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Encode a length continuation: runs of 255 ended by the remainder */
+static int lz_put_length(uint8_t *dst, int op, int cap, int len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= cap)
+			return -1;
+		dst[op++] = 255;
+	}
+	if (op >= cap)
+		return -1;
+	dst[op++] = len;
+	return op;
+}
+
+/*
+ * Emit one sequence: a token, @lit_len literals from @lit, then a match of
+ * @match_len bytes at distance @offset (no match if @match_len is 0)
+ */
+static int lz_put_sequence(uint8_t *dst, int op, int cap, const uint8_t *lit,
+			   int lit_len, int offset, int match_len)
+{
+	int token = op++;
+	int ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+	if (token >= cap)
+		return -1;
+	dst[token] = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+
+	if (lit_len >= 15 && (op = lz_put_length(dst, op, cap, lit_len - 15)) < 0)
+		return -1;
+	if (op + lit_len > cap)
+		return -1;
+	memcpy(dst + op, lit, lit_len);
+	op += lit_len;
+
+	if (!match_len)
+		return op;
+
+	if (op + 2 > cap)
+		return -1;
+	dst[op++] = offset & 0xff;
+	dst[op++] = offset >> 8;
+	if (ml >= 15 && (op = lz_put_length(dst, op, cap, ml - 15)) < 0)
+		return -1;
+	return op;
+}
+
+int lz_compress(const void *src, int src_len, void *dst, int dst_cap)
+{
+	const uint8_t *in = src;
+	uint8_t *out = dst;
+	int table[1 << LZ_HASH_BITS];
+	int ip = 0, anchor = 0, op = 0;
+
+	memset(table, 0xff, sizeof(table));
+
+	while (ip < src_len - LZ_MATCH_LIMIT) {
+		uint32_t seq = lz_read32(in + ip);
+		uint32_t h = lz_hash(seq);
+		int ref = table[h];
+
+		table[h] = ip;
+		if (ref < 0 || ip - ref > LZ_MAX_OFFSET || lz_read32(in + ref) != seq) {
+			/* Skip faster through data that does not compress */
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		int len = LZ_MIN_MATCH;
+		while (ip + len < src_len - LZ_LAST_LITERALS && in[ref + len] == in[ip + len])
+			len++;
+
+		op = lz_put_sequence(out, op, dst_cap, in + anchor, ip - anchor,
+				     ip - ref, len);
+		if (op < 0)
+			return 0;
+		ip += len;
+		anchor = ip;
+	}
+
+	op = lz_put_sequence(out, op, dst_cap, in + anchor, src_len - anchor, 0, 0);
+	return op < 0 ? 0 : op;
+}
+
+/* Decode a length continuation, -1 if it runs past the end of the input */
+static int lz_get_length(const uint8_t *src, int *ip, int src_len)
+{
+	int len = 0, byte;
+
+	do {
+		if (*ip >= src_len)
+			return -1;
+		byte = src[(*ip)++];
+		len += byte;
+	} while (byte == 255);
+	return len;
+}
+
+int lz_decompress(const void *src, int src_len, void *dst, int dst_cap)
+{
+	const uint8_t *in = src;
+	uint8_t *out = dst;
+	int ip = 0, op = 0;
+
+	while (ip < src_len) {
+		int token = in[ip++];
+		int lit_len = token >> 4;
+		int match_len = token & 15;
+
+		if (lit_len == 15) {
+			int more = lz_get_length(in, &ip, src_len);
+			if (more < 0)
+				return -1;
+			lit_len += more;
+		}
+		if (lit_len > src_len - ip || lit_len > dst_cap - op)
+			return -1;
+		memcpy(out + op, in + ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		/* The last sequence has no match */
+		if (ip == src_len)
+			break;
+
+		if (src_len - ip < 2)
+			return -1;
+		int offset = in[ip] | in[ip + 1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > op)
+			return -1;
+
+		if (match_len == 15) {
+			int more = lz_get_length(in, &ip, src_len);
+			if (more < 0)
+				return -1;
+			match_len += more;
+		}
+		match_len += LZ_MIN_MATCH;
+		if (match_len > dst_cap - op)
+			return -1;
+
+		if (offset >= match_len) {
+			memcpy(out + op, out + op - offset, match_len);
+		} else if (offset >= 8) {
+			/* Overlapping match, copy in chunks that do not overlap */
+			for (int i = 0; i < match_len; i += 8)
+				memcpy(out + op + i, out + op - offset + i,
+				       match_len - i < 8 ? match_len - i : 8);
+		} else {
+			/* Short repeating pattern, byte by byte */
+			for (int i = 0; i < match_len; i++)
+				out[op + i] = out[op + i - offset];
+		}
+		op += match_len;
+	}
+
+	return op;
+}
@@ -0,0 +1,34 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @src_len: Size of @src in bytes
+ * @dst: Buffer to be filled with compressed data
+ * @dst_cap: Size of @dst in bytes
+ *
+ * Compress @src_len bytes of @src into @dst, using the LZ4 block format: a
+ * sequence of literal runs and back-references into the previous 64 KiB.
+ *
+ * Return: 0 if the compressed data does not fit in @dst_cap bytes. Otherwise
+ * return the size of the compressed data.
+ */
+int lz_compress(const void *src, int src_len, void *dst, int dst_cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Data compressed with lz_compress()
+ * @src_len: Size of @src in bytes
+ * @dst: Buffer to be filled with decompressed data
+ * @dst_cap: Size of @dst in bytes
+ *
+ * Decompress @src_len bytes of @src into @dst. Corrupted input cannot make the
+ * decompressor read or write out of the bounds of @src and @dst.
+ *
+ * Return: -1 if @src is corrupted, or if the decompressed data does not fit in
+ * @dst_cap bytes. Otherwise return the size of the decompressed data.
+ */
+int lz_decompress(const void *src, int src_len, void *dst, int dst_cap);
+
+#endif /* _LZ_H */